@@ -45,16 +45,38 @@ class ProtoRegexEngine:
         ES_Negative = "negative encoding"
         ES_RLE = "RLE"
         ES_RLE_TUNED = "RLE-tuned"
+        ES_Bitmap = "bitmap encoding"
+        ES_Adaptive = "adaptive encoding"
 
         scheme2cox = {
             ES_None: "none",
             ES_Negative: "neg",
             ES_RLE: "rle",
             # ES_RLE_TUNED: "rle-tuned", # TODO Work out the right math here
+            ES_Bitmap: "bitmap",
+            ES_Adaptive: "adaptive",
         }
 
         all = scheme2cox.keys()
 
+    class MEMO_OPTION:
+        """Engine options that should not change what matches"""
+        MO_Default = "default"
+        MO_Window = "sliding window"
+        MO_Budget = "memo budget"
+        MO_Repeat = "repeated match"
+        MO_Switch = "switch dispatch"
+
+        option2cox = {
+            MO_Default: [],
+            MO_Window: ["--window=64"], # Small blocks, so short inputs still slide
+            MO_Budget: ["--memo-budget=2048"], # Small, so long inputs evict and narrow. NEGATIVE sizes its table to fit.
+            MO_Repeat: ["--repeat=3"], # Later matches reuse the tables from earlier ones
+            MO_Switch: ["--dispatch=switch"], # The default is threaded where the compiler allows
+        }
+
+        all = option2cox.keys()
+
     @staticmethod
     def buildQueryFile(pattern, input, filePrefix="protoRegexEngineQueryFile-"):
         """Build a query file
@@ -75,19 +97,23 @@ class ProtoRegexEngine:
         return name
 
     @staticmethod
-    def query(selectionScheme, encodingScheme, queryFile, timeout=None):
+    def query(selectionScheme, encodingScheme, queryFile, timeout=None, memoOption=MEMO_OPTION.MO_Default, visitTable=True):
         """Query the engine
 
         selectionScheme: SELECTION_SCHEME
         encodingScheme: ENCODING_SCHEME
         queryFile: file path
         timeout: integer seconds before raising subprocess.TimeoutExpired
+        [memoOption]: MEMO_OPTION
+        [visitTable]: keep the full visit table. Leave it off when timing.
 
         returns: EngineMeasurements
         raises: on rc != 0, or on timeout
         """
         rc, stdout, stderr = libLF.runcmd_OutAndErr(
-            args= [ ProtoRegexEngine.CLI,
+            # The full visit table backs visitsToMostVisitedSimPos and the engine's own guarantee check
+            args= [ ProtoRegexEngine.CLI ] + (['--visit-table'] if visitTable else []) +
+              ProtoRegexEngine.MEMO_OPTION.option2cox[memoOption] + [
               ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[selectionScheme],
               ProtoRegexEngine.ENCODING_SCHEME.scheme2cox[encodingScheme],
               '-f', queryFile ],
@@ -104,7 +130,11 @@ class ProtoRegexEngine:
           libLF.log("Wished for {} bits".format(res.group(1)))
 
         # libLF.log("stderr: <" + stderr + ">")
-        return ProtoRegexEngine.EngineMeasurements(stderr.strip(), "-no match-" in stdout)
+        # With --repeat there is one line per match; the last one describes the final match
+        # Likewise, the last "match ..." line has the final match's captures
+        matchLines = [ line for line in stdout.split("\n") if line.startswith("match") ]
+        captures = matchLines[-1][len("match"):].strip() if matchLines else None
+        return ProtoRegexEngine.EngineMeasurements(stderr.strip().split("\n")[-1], "-no match-" in stdout, captures)
     
     class EngineMeasurements:
         """Engine measurements
@@ -113,12 +143,13 @@ class ProtoRegexEngine:
         emitted by the regex engine.
         It offers some assurance of type safety.
         """
-        def __init__(self, measAsJSON, misMatched):
+        def __init__(self, measAsJSON, misMatched, captures=None):
             obj = json.loads(measAsJSON)
             self._unpackInputInfo(obj['inputInfo'])
             self._unpackMemoizationInfo(obj['memoizationInfo'])
             self._unpackSimulationInfo(obj['simulationInfo'])
             self.matched = not misMatched
+            self.captures = captures # e.g. "(0,2) (1,2)": the spans of \0, \1, ... if matched
         
         def _unpackInputInfo(self, dict):
             self.ii_lenW = int(dict['lenW'])
@@ -137,12 +168,18 @@ class ProtoRegexEngine:
             self.mi_results_nSelectedVertices = int(dict['results']['nSelectedVertices'])
             self.mi_results_lenW = int(dict['results']['lenW'])
 
+            # Absent unless the engine ran with --memo-budget
+            budget = dict['results'].get('memoBudget', None)
+            self.mi_budget_narrowestSelection = budget['narrowestSelection'] if budget else None # As in config.vertexSelection
+            self.mi_budget_degraded = bool(budget['degraded']) if budget else False
+            self.mi_budget_exhausted = bool(budget['exhausted']) if budget else False
+
         def _unpackSimulationInfo(self, dict):
             self.si_nTotalVisits = int(dict['nTotalVisits'])
             self.si_simTimeUS = int(dict['simTimeUS'])
-            self.si_visitsToMostVisitedSimPos = int(dict['visitsToMostVisitedSimPos'])
+            # Absent unless the engine ran with --visit-table
+            self.si_visitsToMostVisitedSimPos = int(dict.get('visitsToMostVisitedSimPos', -1))
             self.si_nPossibleTotalVisitsWithMemoization = int(dict['nPossibleTotalVisitsWithMemoization'])
-            self.si_visitsToMostVisitedSimPos = int(dict['visitsToMostVisitedSimPos'])
 
 ###
 # Input classes
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+# Measure the prototype engine's raw speed: simulation steps (instructions) per second.
+# Each workload runs under each encoding; we report the median of several trials.
+# Run it alone, or use core pinning (e.g. taskset) to reduce interference
+
+# Import libMemo
+import libMemo
+
+# Import libLF
+import os
+import sys
+sys.path.append(os.path.join(os.environ['MEMOIZATION_PROJECT_ROOT'], 'eval', 'lib'))
+import libLF
+
+import argparse
+import statistics
+
+# Shell dependencies
+
+shellDeps = [ libMemo.ProtoRegexEngine.CLI ]
+
+# Other globals
+MAX_MATCH_SECONDS = 60
+
+SS = libMemo.ProtoRegexEngine.SELECTION_SCHEME
+ES = libMemo.ProtoRegexEngine.ENCODING_SCHEME
+
+# nick, pattern, input(nPumps), selection scheme
+# Each makes the engine work hard without blowing up, so the time goes to the simulation loop.
+# The unanchored search retries from each offset, so a workload whose memo keys differ per start is quadratic.
+WORKLOADS = [
+  ("exp-alt",      r"(a|a)*b",                  lambda n: "a" * n,            SS.SS_Full),
+  ("poly-star",    r"a*a*a*b",                  lambda n: "a" * n,            SS.SS_Full),
+  ("charclass",    r"([a-z\d]|[a-m])*!",        lambda n: "az09" * (n // 4),  SS.SS_Full),
+  ("altlist",      r"(ab|ac|ad|a)*x",           lambda n: "ad" * (n // 2),    SS.SS_Loop),
+  # About 200 instructions, so the program itself has a cache footprint
+  ("wide-prog",    "(" + "|".join(r"[a-z]{}[a-z\d]".format(c) for c in "bcdefghijklmnopqrstuvwxy") + r"|az.)*!",
+                                                lambda n: "azz" * (n // 3),   SS.SS_Full),
+  ("backref",      r"(a)(\1|b)*c",              lambda n: "a" * (n // 40),    SS.SS_Full), # Quadratic: keys differ by start
+  ("scan",         r"(a|b)*$",                  lambda n: "ab" * (n // 2),    SS.SS_None),
+  # Log-style fields: long runs of one character class each
+  ("fields",       r'^(\S+) "([^"]*)" (.*)$',   lambda n: "k" * (n // 2) + ' "' + "v" * (n // 4) + '" ' + "r" * (n // 4), SS.SS_Full),
+]
+
+ENCODINGS = [ ES.ES_None, ES.ES_Bitmap, ES.ES_Negative, ES.ES_RLE ]
+
+###
+# Measurement
+###
+
+def measure(pattern, input, selectionScheme, encodingScheme, nTrials):
+  """Returns (nTotalVisits, median simTimeUS)"""
+  queryFile = libMemo.ProtoRegexEngine.buildQueryFile(pattern, input)
+  try:
+    times = []
+    nTotalVisits = None
+    for _ in range(nTrials):
+      em = libMemo.ProtoRegexEngine.query(selectionScheme, encodingScheme, queryFile, timeout=MAX_MATCH_SECONDS, visitTable=False)
+      times.append(em.si_simTimeUS)
+      # The simulation is deterministic
+      assert nTotalVisits is None or nTotalVisits == em.si_nTotalVisits
+      nTotalVisits = em.si_nTotalVisits
+    return nTotalVisits, statistics.median(times)
+  finally:
+    os.unlink(queryFile)
+
+###
+# Main
+###
+
+def main(nPumps, nTrials):
+  libLF.log('nPumps {} nTrials {}'.format(nPumps, nTrials))
+  fmt = "{:<14} {:<18} {:<18} {:>12} {:>10} {:>12}"
+  print(fmt.format("workload", "selection", "encoding", "steps", "simTimeUS", "Msteps/sec"))
+
+  allSteps, allUS = 0, 0
+  for nick, pattern, mkInput, ss in WORKLOADS:
+    # Backreferences force the negative encoding, and without memoization the encoding is moot
+    encodings = [ ES.ES_Negative ] if nick == "backref" else ENCODINGS
+    if ss == SS.SS_None:
+      encodings = [ ES.ES_None ]
+
+    for es in encodings:
+      nSteps, simTimeUS = measure(pattern, mkInput(nPumps), ss, es, nTrials)
+      rate = nSteps / simTimeUS if simTimeUS > 0 else float('nan')
+      print(fmt.format(nick, ss, es, nSteps, int(simTimeUS), "{:.1f}".format(rate)))
+      allSteps += nSteps
+      allUS += simTimeUS
+
+  print("Overall: {:.1f} Msteps/sec".format(allSteps / allUS if allUS > 0 else float('nan')))
+
+# Parse args
+parser = argparse.ArgumentParser(description='Measure the throughput of the prototype engine\'s backtracking simulation, in simulation steps (executed instructions, not counting MemoChecks) per second.')
+parser.add_argument('--pumps', type=int, help='In: Input length for each workload (default 20K)', required=False, default=20*1000,
+  dest='nPumps')
+parser.add_argument('--trials', type=int, help='In: Trials per measurement. We report the median (default 5)', required=False, default=5,
+  dest='nTrials')
+
+# Here we go!
+args = parser.parse_args()
+main(args.nPumps, args.nTrials)
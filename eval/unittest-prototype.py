@@ -58,17 +58,18 @@ class TestCase:
     # Subclass and overload
     assert(False)
   
-  def _queryEngine(self, ss, es, regex, input):
+  def _queryEngine(self, ss, es, regex, input, mo=libMemo.ProtoRegexEngine.MEMO_OPTION.MO_Default):
     """Returns rawCmd, validSyntax, EngineMeasurements"""
     try:
       queryFile = libMemo.ProtoRegexEngine.buildQueryFile(regex, input)
-      rawCmd = "{} {} {} '{}' {}".format(libMemo.ProtoRegexEngine.CLI,
+      rawCmd = "{} --visit-table {} {} {} '{}' {}".format(libMemo.ProtoRegexEngine.CLI,
+            " ".join(libMemo.ProtoRegexEngine.MEMO_OPTION.option2cox[mo]),
             libMemo.ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[ss],
             libMemo.ProtoRegexEngine.ENCODING_SCHEME.scheme2cox[es],
           regex, input
       )
       libLF.log("  Test case: {}".format(rawCmd))
-      em = libMemo.ProtoRegexEngine.query(ss, es, queryFile)
+      em = libMemo.ProtoRegexEngine.query(ss, es, queryFile, memoOption=mo)
       validSyntax = True
     except SyntaxError as err:
       validSyntax = False
@@ -81,7 +82,9 @@ class TestCase:
 
 class SemanticTestCase(TestCase):
   def __init__(self, pieces):
-    self.regex, self.input, self.result = pieces
+    # An optional fourth piece pins the captures of a MATCH, as the engine prints them: "(0,2) (1,2)"
+    self.regex, self.input, self.result = pieces[:3]
+    self.captures = pieces[3] if len(pieces) > 3 else None
     self.expectSyntaxError = (self.result == "SYNTAX")
     self.shouldMatch = (self.result == "MATCH")
     self.type = TestSuite.SEMANTIC_TEST
@@ -90,26 +93,29 @@ class SemanticTestCase(TestCase):
     testResults = []
 
     # Semantics should be identical across all memoization treatments
-    for selectionScheme, encodingScheme in itertools.product(
+    for selectionScheme, encodingScheme, memoOption in itertools.product(
       libMemo.ProtoRegexEngine.SELECTION_SCHEME.scheme2cox.keys(),
-      libMemo.ProtoRegexEngine.ENCODING_SCHEME.scheme2cox.keys()
+      libMemo.ProtoRegexEngine.ENCODING_SCHEME.scheme2cox.keys(),
+      libMemo.ProtoRegexEngine.MEMO_OPTION.option2cox.keys()
     ):
       # Skip nonsense requests
       if libMemo.ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[selectionScheme] == "none" and \
          libMemo.ProtoRegexEngine.ENCODING_SCHEME.scheme2cox[encodingScheme] != "none":
          continue
 
-      rawCmd, validRegex, em = self._queryEngine(selectionScheme, encodingScheme, self.regex, self.input)
+      rawCmd, validRegex, em = self._queryEngine(selectionScheme, encodingScheme, self.regex, self.input, memoOption)
 
       # Calculate the TestResult
       if validRegex:
         if self.expectSyntaxError:
           tr = TestResult(False, "Incorrect, expected syntax error for /{}/".format(self.regex))
         else:
-          if (em.matched and self.shouldMatch) or (not em.matched and not self.shouldMatch):
-            tr = TestResult(True, "Correct, match(/{}/, {})={} under selection '{}' encoding '{}'".format(self.regex, self.input, em.matched, selectionScheme, encodingScheme))
+          if em.matched and self.captures is not None and em.captures != self.captures:
+            tr = TestResult(False, "Incorrect, match(/{}/, {}) captured {}, expected {}, under selection {} encoding {} option {} -- try {}".format(self.regex, self.input, em.captures, self.captures, selectionScheme, encodingScheme, memoOption, rawCmd))
+          elif (em.matched and self.shouldMatch) or (not em.matched and not self.shouldMatch):
+            tr = TestResult(True, "Correct, match(/{}/, {})={} under selection '{}' encoding '{}' option '{}'".format(self.regex, self.input, em.matched, selectionScheme, encodingScheme, memoOption))
           else:
-            tr = TestResult(False, "Incorrect, match(/{}/, {})={} under selection {} encoding {} -- try {}".format(self.regex, self.input, em.matched, selectionScheme, encodingScheme, rawCmd))
+            tr = TestResult(False, "Incorrect, match(/{}/, {})={} under selection {} encoding {} option {} -- try {}".format(self.regex, self.input, em.matched, selectionScheme, encodingScheme, memoOption, rawCmd))
       else: # Invalid regex
         if self.expectSyntaxError:
           tr = TestResult(True, "Correct, syntax error for /{}/".format(self.regex))
@@ -124,8 +130,15 @@ class PerformanceTestCase(TestCase):
   CURVE_POLY = "polynomial"
   CURVE_LIN = "linear"
 
+  # Budgeted runs may narrow down to LOOP, but no further
+  BUDGET_SELECTIONS = [ "ALL", "INDEG>1", "LOOP" ]
+
   def __init__(self, pieces):
-    regex, evilInput, memo, curve = pieces
+    # An optional fifth piece, BUDGET, checks the curve under NEGATIVE with a small memo budget instead
+    regex, evilInput, memo, curve = pieces[:4]
+    self.budgeted = len(pieces) > 4 and pieces[4] == "BUDGET"
+    if len(pieces) > 4 and not self.budgeted:
+      raise SyntaxError("Unexpected option " + pieces[4])
     self.regex = regex
     ei_pref, ei_pump, ei_suff = [p.strip() for p in evilInput.split(":")]
     self.evilInput = libLF.EvilInput().initFromRaw(
@@ -157,16 +170,46 @@ class PerformanceTestCase(TestCase):
   def run(self):
     testResults = []
 
-    baselineVisits = None
-    nAdjustedVisits = []
     maxPumpsExp = 10
     maxPumpsElse = 50
     maxPumps = maxPumpsExp if self.curve == PerformanceTestCase.CURVE_EXP else maxPumpsElse
 
-    # Collect visit counts as we increase pump
+    if self.budgeted:
+      nAdjustedVisits, selections = self._collectVisits(maxPumps, libMemo.ProtoRegexEngine.ENCODING_SCHEME.ES_Negative, libMemo.ProtoRegexEngine.MEMO_OPTION.MO_Budget)
+    else:
+      nAdjustedVisits, _ = self._collectVisits(maxPumps, libMemo.ProtoRegexEngine.ENCODING_SCHEME.ES_None)
+
+    # Confirm the visit counts indicate the expected curve
+    matchedCurve = self._checkCurve(nAdjustedVisits, self.curve)
+    testResults.append(
+      TestResult(matchedCurve, "{}: Error, expected curve {} but visits {}{}".format(self.regex, self.curve, nAdjustedVisits, " under a memo budget" if self.budgeted else ""))
+    )
+
+    # A memo budget trades memory for some redundant work, never for exponential work
+    if self.memoSS != libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_None and self.curve != PerformanceTestCase.CURVE_EXP:
+      if not self.budgeted:
+        nAdjustedVisits, selections = self._collectVisits(maxPumps, libMemo.ProtoRegexEngine.ENCODING_SCHEME.ES_Negative, libMemo.ProtoRegexEngine.MEMO_OPTION.MO_Budget)
+      narrowedTooFar = [ s for s in selections if s not in PerformanceTestCase.BUDGET_SELECTIONS ]
+      testResults.append(
+        TestResult(not narrowedTooFar, "{}: Error, a memo budget narrowed the selection to {}".format(self.regex, narrowedTooFar))
+      )
+      # A flat curve is all zeroes, and its "ratios" would look exponential
+      exponential = any(nAdjustedVisits) and self._checkCurve(nAdjustedVisits, PerformanceTestCase.CURVE_EXP)
+      testResults.append(
+        TestResult(not exponential, "{}: Error, exponential visits {} under a memo budget".format(self.regex, nAdjustedVisits))
+      )
+
+    return testResults
+
+  def _collectVisits(self, maxPumps, encodingScheme, memoOption=libMemo.ProtoRegexEngine.MEMO_OPTION.MO_Default):
+    """Returns the visit counts as we increase pump, less the one-pump count, and the budgeted selections seen"""
+    baselineVisits = None
+    nAdjustedVisits = []
+    selections = set()
+
     for nPumps in range(1, maxPumps):
       input = self.evilInput.build(nPumps)[0]
-      rawCmd, validRegex, em = self._queryEngine(self.memoSS, libMemo.ProtoRegexEngine.ENCODING_SCHEME.ES_None, self.regex, input)
+      rawCmd, validRegex, em = self._queryEngine(self.memoSS, encodingScheme, self.regex, input, memoOption)
       assert(validRegex)
 
       if not baselineVisits:
@@ -175,12 +218,10 @@ class PerformanceTestCase(TestCase):
 
       # Subtract off the "one pump" term so we can see the growth rate
       nAdjustedVisits.append(em.si_nTotalVisits - baselineVisits)
-    
-    # Confirm the visit counts indicate the expected curve
-    matchedCurve = self._checkCurve(nAdjustedVisits, self.curve)
-    return [
-      TestResult(matchedCurve, "{}: Error, expected curve {} but visits {}".format(self.regex, self.curve, nAdjustedVisits))
-    ]
+      if em.mi_budget_narrowestSelection is not None:
+        selections.add(em.mi_budget_narrowestSelection)
+
+    return nAdjustedVisits, selections
   
   def _firstRatios(self, visitCounts):
     return [
@@ -0,0 +1,109 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "arena.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk
+{
+  ArenaChunk *next;
+  int size; /* Usable bytes in data[] */
+  int used;
+  char data[]; /* The header is 16 bytes, so data[] is ARENA_ALIGN'd like malloc's result */
+};
+
+struct Arena
+{
+  ArenaChunk *chunks; /* Most recent first; we only bump-allocate from the head */
+  int chunkBytes;
+  long totalBytes;
+};
+
+static ArenaChunk *
+ArenaChunk_create(int size)
+{
+  ArenaChunk *chunk = malloc(sizeof(*chunk) + size);
+  assert(chunk != NULL);
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+Arena *
+Arena_create(int chunkBytes)
+{
+  Arena *arena = malloc(sizeof *arena);
+  assert(arena != NULL);
+  arena->chunks = NULL;
+  arena->chunkBytes = chunkBytes;
+  arena->totalBytes = sizeof(*arena);
+
+  logMsg(LOG_DEBUG, "Arena_create: arena %p chunkBytes %d", arena, chunkBytes);
+  return arena;
+}
+
+void *
+Arena_alloc(Arena *arena, int nBytes)
+{
+  ArenaChunk *chunk = arena->chunks;
+  void *ret;
+
+  nBytes = ARENA_ROUND_UP(nBytes);
+  if (chunk == NULL || chunk->used + nBytes > chunk->size) {
+    /* Oversized requests get a chunk of their own */
+    int size = nBytes > arena->chunkBytes ? nBytes : arena->chunkBytes;
+    chunk = ArenaChunk_create(size);
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->totalBytes += sizeof(*chunk) + size;
+    logMsg(LOG_DEBUG, "Arena_alloc: arena %p new chunk of %d bytes", arena, size);
+  }
+
+  ret = chunk->data + chunk->used;
+  chunk->used += nBytes;
+  memset(ret, 0, nBytes);
+  return ret;
+}
+
+long
+Arena_bytes(Arena *arena)
+{
+  return arena->totalBytes;
+}
+
+void
+Arena_reset(Arena *arena)
+{
+  ArenaChunk *chunk = NULL, *next = NULL;
+
+  if (arena->chunks == NULL) {
+    return;
+  }
+  for (chunk = arena->chunks->next; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    arena->totalBytes -= sizeof(*chunk) + chunk->size;
+    free(chunk);
+  }
+  arena->chunks->next = NULL;
+  arena->chunks->used = 0;
+}
+
+void
+Arena_destroy(Arena *arena)
+{
+  ArenaChunk *chunk = arena->chunks, *next = NULL;
+  while (chunk != NULL) {
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  free(arena);
+}
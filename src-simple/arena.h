@@ -0,0 +1,37 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/* Bump allocator.
+ * Allocations live until the whole arena is destroyed -- there is no per-object free. */
+
+typedef struct Arena Arena;
+
+/* Every allocation is rounded up to a multiple of this */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND_UP(n) ( ((n) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN )
+
+/* Memory is obtained from the system in chunks of (at least) chunkBytes */
+Arena *
+Arena_create(int chunkBytes);
+
+/* Zeroed, aligned for any scalar type */
+void *
+Arena_alloc(Arena *arena, int nBytes);
+
+/* Bytes obtained from the system, including chunk headers */
+long
+Arena_bytes(Arena *arena);
+
+/* Frees every allocation, but keeps the newest chunk to allocate from again */
+void
+Arena_reset(Arena *arena);
+
+/* Frees every allocation in one shot */
+void
+Arena_destroy(Arena *arena);
+
+#endif /* ARENA_H */
@@ -0,0 +1,432 @@
+// Copyright 2007-2009 Russ Cox.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+//
+// Annotations, statistics, and memoization by James Davis, 2020.
+
+/* The backtracking core, included by backtrack.c once per flavor.
+ *
+ * Define before including (BT_THREADED stays defined; the rest are undefined again at the end):
+ *   BT_NAME      Name of the (static) simulation function
+ *   BT_THREADED  1: direct-threaded dispatch. Each Inst holds the address of its handler.
+ *                0: switch on pc->opcode.
+ *   BT_MEMO      MEMO_KIND_*: how MemoCheck tests and marks (see Memo_kind).
+ *                Anything but MEMO_KIND_GENERIC calls its table's test-and-mark inline.
+ *   BT_CAPTURES  1: track capture groups (and the counted loops' counters, which live in the Sub).
+ *                0: nobody reads them (no submatches wanted, no backreferences, no counted loops).
+ *                   Save is a no-op, and every thread shares the first Sub without counting references.
+ *
+ * The Inst semantics below are shared by all flavors. Add opcodes with BT_OP.
+ * Memoization is explicit: Prog_determineMemoNodes puts a MemoCheck before each memoized vertex. */
+
+#if BT_THREADED
+#define BT_LABEL(op) BT_##op:
+#define BT_NEXT goto *pc->handler
+#define BT_HANDLER(op) [op] = &&BT_##op
+#else
+#define BT_LABEL(op) case op:
+#define BT_NEXT continue
+#endif
+
+#if BT_MEMO == MEMO_KIND_ARRAY
+#define BT_TEST_AND_MARK(q, i) Memo_testAndMarkArray(memo, (q), (i))
+#elif BT_MEMO == MEMO_KIND_BITMAP
+#define BT_TEST_AND_MARK(q, i) Memo_testAndMarkBitmap(memo, (q), (i))
+#elif BT_MEMO == MEMO_KIND_HASH
+#define BT_TEST_AND_MARK(q, i) Memo_testAndMarkHash(memo, (q), (i))
+#elif BT_MEMO == MEMO_KIND_HASH_BR
+#define BT_TEST_AND_MARK(q, i) Memo_testAndMarkHashBackrefs(memo, (q), (i), sub)
+#else
+#define BT_TEST_AND_MARK(q, i) Memo_testAndMark(memo, (q), (i), sub)
+#endif
+
+#if BT_CAPTURES
+#define BT_SHARE(s) incref(s)
+#define BT_RELEASE(s) SubPool_decref(subs, (s))
+#define BT_CLEAR(tv) ThreadVec_clear((tv), subs)
+#else
+#define BT_SHARE(s) (s)
+#define BT_RELEASE(s) do { } while (0)
+#define BT_CLEAR(tv) ((tv)->nThreads = 0)
+#endif
+
+/* "Visit" means that we evaluate pc appropriately. MemoChecks are bookkeeping, not vertices. */
+#define BT_OP(op) \
+  BT_LABEL(op) \
+    logMsg(LOG_VERBOSE, "  search state: <%d (M: %d), %d>", pc->stateNum, INST_INFO(prog, pc)->memoInfo.memoStateNum, woffset(input, sp)); \
+    markVisit(visitTable, pc->stateNum, woffset(input, sp));
+
+static int
+BT_NAME(Prog *prog, char *input, char **subp, int nsubp, BacktrackScratch *scratch)
+{
+  Memo *memo = &scratch->memo;
+  VisitTable *visitTable = &scratch->visitTable;
+  SubPool *subs = &scratch->subs;
+  ThreadVec *ready = &scratch->ready;
+  int i;
+  Inst *pc; /* Current position in VM (pc) */
+  char *sp; /* Current position in input */
+  Sub *sub; /* submatch (capture group) */
+  char *inputEOL; /* Position of \0 terminating input */
+  uint64_t startTime;
+  ThreadVec *threads = NULL;
+	int matched = 0;
+
+  int inZWA = 0;
+  char *sp_save = NULL;
+  ThreadVec *threads_save = NULL;
+
+#if BT_THREADED
+  /* Labels are only addressable in here, so resolve each Inst's handler whenever another simulation ran prog last */
+  static void *handlers[] = {
+    BT_HANDLER(Char),
+    BT_HANDLER(Match),
+    BT_HANDLER(RecursiveMatch),
+    BT_HANDLER(Jmp),
+    BT_HANDLER(Split),
+    BT_HANDLER(SplitMany),
+    BT_HANDLER(Any),
+    BT_HANDLER(CharClass),
+    BT_HANDLER(Save),
+    BT_HANDLER(StringCompare),
+    BT_HANDLER(InlineZeroWidthAssertion),
+    BT_HANDLER(RecursiveZeroWidthAssertion),
+    BT_HANDLER(MemoCheck),
+    BT_HANDLER(CharLoop),
+    BT_HANDLER(Barrier),
+    BT_HANDLER(Cut),
+    BT_HANDLER(CharRepeat),
+    BT_HANDLER(RepeatStart),
+    BT_HANDLER(RepeatTest),
+    BT_HANDLER(RepeatNext),
+  };
+  if (prog->handlers != handlers) {
+    for (i = 0, pc = prog->start; i < prog->len; i++, pc++) {
+      assert(pc->opcode > 0 && pc->opcode < nelem(handlers));
+      pc->handler = handlers[pc->opcode];
+      assert(pc->handler != NULL);
+    }
+    prog->handlers = handlers;
+    logMsg(LOG_DEBUG, "Backtrack: resolved handlers for %d instructions", prog->len);
+  }
+#endif
+
+  inputEOL = input + strlen(input);
+
+  /* Prep sub-captures */
+  sub = SubPool_newsub(subs, nsubp, input);
+  for(i=0; i<nsubp; i++)
+    sub->sub[i] = nil;
+
+  logMsg(LOG_INFO, "Backtrack: Simulation begins");
+  startTime = now();
+
+  /* Initial thread state is < q0, w[0], current capture group > */
+  assert(ready->nThreads == 0);
+  ThreadVec_push(ready, thread(prog->start, input, sub));
+  threads = ready;
+
+  /* To recurse: save the state (sp, threads) and replace threads with the new starting point */
+
+  /* Run threads in stack order */
+BACKTRACKING_SEARCH:
+  while(threads->nThreads > 0) {
+    Thread next, *top = &threads->threads[threads->nThreads - 1];
+    if (top->spTop > top->sp) {
+      /* A CharLoop frame: run its highest thread, leave the rest */
+      next = thread(top->pc, top->spTop--, BT_SHARE(top->sub));
+    } else {
+      next = ThreadVec_pop(threads);
+      if (next.pc == NULL) {
+        /* An atomic group's barrier: every way through the group has failed */
+        BT_RELEASE(next.sub);
+        continue;
+      }
+    }
+    pc = next.pc;
+    sp = next.sp;
+    sub = next.sub;
+    assert(sub->ref > 0);
+
+    if (BT_MEMO == MEMO_KIND_GENERIC && (memo->windowed || memo->budgetBytes > 0)) {
+      /* Threads only move forward, and each push copies the current sp, so every stack is
+       * sorted by sp. Nothing live lies behind the bottom of the outermost stack -- or,
+       * if that is empty, behind the lookahead's start or the thread we just popped. */
+      char *lowWater = (ready->nThreads > 0) ? ready->threads[0].sp : (inZWA ? sp_save : sp);
+      Memo_slideWindow(memo, woffset(input, lowWater));
+    }
+    for(;;) { /* Run thread to completion */
+#if BT_THREADED
+      BT_NEXT;
+      {
+#else
+      switch(pc->opcode) {
+#endif
+      BT_LABEL(MemoCheck)
+        /* Check if we've been here, and mark that we have. */
+        if (BT_TEST_AND_MARK(pc->n, woffset(input, sp))) {
+          /* Since we return on first match, the prior visit failed.
+           * Short-circuit thread */
+          logMsg(LOG_VERBOSE, "<%d (M: %d), %d> marked, short-circuiting thread", pc->stateNum, pc->n, woffset(input, sp));
+          assert((pc+1)->opcode != Match);
+          goto Dead;
+        }
+        pc++;
+        BT_NEXT;
+      BT_OP(Char)
+        if(*sp != pc->c)
+          goto Dead;
+        pc++;
+        sp++;
+        BT_NEXT;
+      BT_OP(Any)
+        if(*sp == 0 || *sp == '\n' || *sp == '\r')
+          goto Dead;
+        pc++;
+        sp++;
+        BT_NEXT;
+      BT_OP(CharClass)
+        /* Never matches NUL, so this stops at the end of the input */
+        if (!CharClass_contains(&prog->charClasses[pc->n], *sp)) {
+          logMsg(LOG_VERBOSE, "char %d not in CC %d", *sp, pc->n);
+          goto Dead;
+        }
+        logMsg(LOG_VERBOSE, "char %d matched CC", *sp);
+        pc++;
+        sp++;
+        BT_NEXT;
+      BT_OP(CharLoop)
+      {
+        /* Greedy: leave from the end of the run now. Leaving earlier waits in one frame. */
+        InstCharClass *cc = &prog->charClasses[pc->n];
+        char *end;
+        if (pc->c < 0) {
+          end = CharClass_span(cc, sp);
+        } else {
+          /* Memoized: each offset is its own search state. Stop at one we have explored from. */
+          for (end = sp; CharClass_contains(cc, *end); end++) {
+            if (BT_TEST_AND_MARK(pc->c, woffset(input, end + 1))) {
+              if (pc->y == NULL) {
+                /* The same run again, and its end failed */
+                markVisits(visitTable, pc->stateNum, woffset(input, sp) + 1, end - sp);
+                goto Dead;
+              }
+              break;
+            }
+          }
+        }
+        logMsg(LOG_VERBOSE, "CharLoop: run of %d", (int) (end - sp));
+        markVisits(visitTable, pc->stateNum, woffset(input, sp) + 1, end - sp);
+        if (end > sp && pc->y != NULL)
+          ThreadVec_push(threads, frame(pc->y, sp, end - 1, BT_SHARE(sub)));
+        pc++;
+        sp = end;
+        BT_NEXT;
+      }
+      BT_OP(CharRepeat)
+      {
+        /* CharLoop, bounded: at most max, and the shorter runs stop at min */
+        InstRepeat *rep = &prog->repeats[pc->n];
+        InstCharClass *cc = &prog->charClasses[rep->cc];
+        char *end;
+        for (end = sp; end - sp < rep->max && CharClass_contains(cc, *end); end++)
+          ;
+        logMsg(LOG_VERBOSE, "CharRepeat: run of %d, {%d,%d}", (int) (end - sp), rep->min, rep->max);
+        if (end - sp < rep->min)
+          goto Dead;
+        if (end > sp + rep->min && pc->y != NULL)
+          ThreadVec_push(threads, frame(pc->y, sp + rep->min, end - 1, BT_SHARE(sub)));
+        pc++;
+        sp = end;
+        BT_NEXT;
+      }
+      BT_OP(RepeatStart)
+#if BT_CAPTURES
+        sub = SubPool_setCounter(subs, sub, prog->repeats[pc->n].counter, 0);
+#else
+        assert(!"Counted loops keep their counters in the Sub");
+#endif
+        pc++;
+        BT_NEXT;
+      BT_OP(RepeatTest)
+      {
+        InstRepeat *rep = &prog->repeats[pc->n];
+        int count = sub->counter[rep->counter];
+        if (count < rep->min) {
+          pc = pc->x;
+        } else if (rep->max >= 0 && count >= rep->max) {
+          pc = pc->y;
+        } else if (rep->greedy) {
+          ThreadVec_push(threads, thread(pc->y, sp, BT_SHARE(sub)));
+          pc = pc->x;
+        } else {
+          ThreadVec_push(threads, thread(pc->x, sp, BT_SHARE(sub)));
+          pc = pc->y;
+        }
+        BT_NEXT;
+      }
+      BT_OP(RepeatNext)
+      {
+        /* Unbounded, past min, the count no longer matters. Stop there, so the memo keys on one count, not many. */
+        InstRepeat *rep = &prog->repeats[pc->n];
+        int count = sub->counter[rep->counter];
+        if (rep->max >= 0 || count < rep->min) {
+#if BT_CAPTURES
+          sub = SubPool_setCounter(subs, sub, rep->counter, count + 1);
+#endif
+        }
+        pc = pc->x;
+        BT_NEXT;
+      }
+      BT_OP(Barrier)
+        /* No pc: the thread that runs out to here is dead */
+        ThreadVec_push(threads, thread(NULL, sp, BT_SHARE(sub)));
+        pc++;
+        BT_NEXT;
+      BT_OP(Cut)
+      {
+        /* Threads pushed since the group began are the other ways through it. Inner groups have cut theirs already,
+         * and a lookahead's sub-simulation has returned, so the first barrier down the stack is this group's. */
+        Thread *t;
+        do {
+          assert(threads->nThreads > 0);
+          t = &threads->threads[--threads->nThreads];
+          BT_RELEASE(t->sub);
+        } while (t->pc != NULL);
+        pc++;
+        BT_NEXT;
+      }
+      BT_OP(Match)
+        logMsg(LOG_VERBOSE, "Match: eolAnchor %d sp %p inputEOL %p", prog->eolAnchor, sp, inputEOL);
+        if (!prog->eolAnchor || (prog->eolAnchor && sp == inputEOL)) {
+          for(i=0; i<nsubp; i++)
+            subp[i] = sub->sub[i];
+          BT_RELEASE(sub);
+
+					matched = 1;
+					goto CleanupAndRet;
+        }
+        goto Dead;
+      BT_OP(Jmp)
+        pc = pc->x;
+        BT_NEXT;
+      BT_OP(Split) /* Non-deterministic choice */
+        ThreadVec_push(threads, thread(pc->y, sp, BT_SHARE(sub)));
+        pc = pc->x;  /* continue current thread */
+        BT_NEXT;
+      BT_OP(SplitMany) /* Non-deterministic choice */
+      {
+        InstEdges *edges = &prog->edgeLists[pc->n];
+        for (i = 1; i < edges->arity; i++) {
+          ThreadVec_push(threads, thread(edges->edges[i], sp, BT_SHARE(sub)));
+        }
+        pc = edges->edges[0];  /* continue current thread */
+        BT_NEXT;
+      }
+      BT_OP(Save)
+#if BT_CAPTURES
+        logMsg(LOG_DEBUG, "  save %d at %p", pc->n, sp);
+        sub = SubPool_update(subs, sub, pc->n, sp);
+#endif
+        pc++;
+        BT_NEXT;
+      BT_OP(StringCompare)
+      {
+        /* Check if appropriate sub matches */
+        logMsg(LOG_DEBUG, "  StringCompare on %d at %p", pc->n, sp);
+        int nCharsMatched = _stringCompare(pc, sub, sp, inputEOL);
+        if (nCharsMatched > -1) {
+          sp += nCharsMatched;
+          pc++;
+          BT_NEXT;
+        }
+
+        goto Dead;
+      }
+      BT_OP(InlineZeroWidthAssertion)
+      {
+        if (_testInlineZeroWidthAssertion(pc, sp, sp == input, sp == inputEOL)) {
+          pc++;
+          BT_NEXT;
+        }
+
+				logMsg(LOG_DEBUG, "InlineZWA %c unsatisfied", pc->c);
+        goto Dead;
+      }
+      BT_OP(RecursiveZeroWidthAssertion)
+      {
+        // Save state: i, backtrack stack
+        assert(!inZWA); // No nesting
+        inZWA = 1;
+        sp_save = sp;
+        threads_save = threads;
+
+        // Override
+        Inst *newPC = pc+1;
+        ThreadVec *override = &scratch->zwaThreads;
+        assert(override->nThreads == 0);
+        ThreadVec_push(override, thread(newPC, sp, sub));
+        threads = override;
+        logMsg(LOG_DEBUG, "Overriding threads %p with %p -- a sub-simulation starting at <q%d, i%d>", threads_save, threads, (int)(newPC-prog->start), (int)(sp - input));
+        goto BACKTRACKING_SEARCH;
+      }
+        assert(!"unreachable");
+      BT_OP(RecursiveMatch)
+        logMsg(LOG_DEBUG, "Made it to %d RecursiveMatch", (int)(pc-prog->start));
+        // Restore state: i, backtrack stack
+        assert(inZWA);
+        inZWA = 0;
+        sp = sp_save; // Zero-width
+        logMsg(LOG_DEBUG, "Restoring threads from %p to %p", threads, threads_save);
+        BT_CLEAR(threads); /* The other ways to satisfy the lookahead */
+        threads = threads_save;
+        threads_save = nil;
+
+        pc++; // Advance beyond the ZWA
+        logMsg(LOG_DEBUG, "Resuming execution at <q%d, i%d>\n", (int)(pc-prog->start), (int)(sp-input));
+        BT_NEXT; // Pick up where we left off
+
+#if !BT_THREADED
+      default:
+        logMsg(LOG_ERROR, "Unknown opcode %d", pc->opcode);
+#endif
+      }
+    }
+  Dead:
+    BT_RELEASE(sub);
+  }
+  // Backtracking stack is exhausted.
+  if (inZWA) {
+    // No way to honor the ZWA from this point. Backtrack.
+    logMsg(LOG_INFO, "Could not honor ZWA");
+    inZWA = 0;
+    sp = sp_save; // Zero-width
+    threads = threads_save;
+    threads_save = nil;
+    goto BACKTRACKING_SEARCH;
+  }
+	matched = 0;
+
+CleanupAndRet:
+	//decref(&sub);
+  printStats(prog, memo, visitTable, startTime, sub);
+  /* Leave the scratch empty for the next match */
+  BT_CLEAR(ready);
+  BT_CLEAR(&scratch->zwaThreads);
+#if !BT_CAPTURES
+  SubPool_decref(subs, sub); /* The one every thread shared */
+#endif
+  return matched;
+}
+
+#undef BT_OP
+#undef BT_LABEL
+#undef BT_NEXT
+#undef BT_HANDLER
+#undef BT_TEST_AND_MARK
+#undef BT_SHARE
+#undef BT_RELEASE
+#undef BT_CLEAR
+#undef BT_NAME
+#undef BT_MEMO
+#undef BT_CAPTURES
@@ -0,0 +1,69 @@
+// Copyright 2020 James Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/* The simulations for one dispatch flavor, included by backtrack.c once per flavor.
+ *
+ * Define before including:
+ *   BT_THREADED                 As for backtrack-core.h
+ *   BT_INSTANCE(memo, captures) Name of the simulation for Memo_kind memo, with or without captures
+ *   BT_TABLE                    Name of the table to define: BacktrackFn [MEMO_NKINDS][2],
+ *                               indexed by Memo_kind and whether to track captures.
+ *
+ * Backreferences need captures, so there is no MEMO_KIND_HASH_BR without them. */
+
+#define BT_NAME BT_INSTANCE(Generic, NoCaptures)
+#define BT_MEMO MEMO_KIND_GENERIC
+#define BT_CAPTURES 0
+#include "backtrack-core.h"
+
+#define BT_NAME BT_INSTANCE(Generic, Captures)
+#define BT_MEMO MEMO_KIND_GENERIC
+#define BT_CAPTURES 1
+#include "backtrack-core.h"
+
+#define BT_NAME BT_INSTANCE(Array, NoCaptures)
+#define BT_MEMO MEMO_KIND_ARRAY
+#define BT_CAPTURES 0
+#include "backtrack-core.h"
+
+#define BT_NAME BT_INSTANCE(Array, Captures)
+#define BT_MEMO MEMO_KIND_ARRAY
+#define BT_CAPTURES 1
+#include "backtrack-core.h"
+
+#define BT_NAME BT_INSTANCE(Bitmap, NoCaptures)
+#define BT_MEMO MEMO_KIND_BITMAP
+#define BT_CAPTURES 0
+#include "backtrack-core.h"
+
+#define BT_NAME BT_INSTANCE(Bitmap, Captures)
+#define BT_MEMO MEMO_KIND_BITMAP
+#define BT_CAPTURES 1
+#include "backtrack-core.h"
+
+#define BT_NAME BT_INSTANCE(Hash, NoCaptures)
+#define BT_MEMO MEMO_KIND_HASH
+#define BT_CAPTURES 0
+#include "backtrack-core.h"
+
+#define BT_NAME BT_INSTANCE(Hash, Captures)
+#define BT_MEMO MEMO_KIND_HASH
+#define BT_CAPTURES 1
+#include "backtrack-core.h"
+
+#define BT_NAME BT_INSTANCE(HashBr, Captures)
+#define BT_MEMO MEMO_KIND_HASH_BR
+#define BT_CAPTURES 1
+#include "backtrack-core.h"
+
+static BacktrackFn BT_TABLE[MEMO_NKINDS][2] = {
+  [MEMO_KIND_GENERIC] = { BT_INSTANCE(Generic, NoCaptures), BT_INSTANCE(Generic, Captures) },
+  [MEMO_KIND_ARRAY]   = { BT_INSTANCE(Array, NoCaptures),   BT_INSTANCE(Array, Captures) },
+  [MEMO_KIND_BITMAP]  = { BT_INSTANCE(Bitmap, NoCaptures),  BT_INSTANCE(Bitmap, Captures) },
+  [MEMO_KIND_HASH]    = { BT_INSTANCE(Hash, NoCaptures),    BT_INSTANCE(Hash, Captures) },
+  [MEMO_KIND_HASH_BR] = { NULL,                             BT_INSTANCE(HashBr, Captures) },
+};
+
+#undef BT_INSTANCE
+#undef BT_TABLE
@@ -22,12 +22,22 @@ struct Thread
   Inst *pc; /* Automaton vertex ~= Instruction to execute */
   char *sp; /* Offset in candidate string, w */
   Sub *sub; /* Sub-match (capture groups) */
+  /* Usually sp. Above sp, this is a CharLoop frame: one saved thread for each of sp, sp+1, ..., spTop,
+   * sharing pc and sub. They run from spTop down. */
+  char *spTop;
 };
 
 static Thread
 thread(Inst *pc, char *sp, Sub *sub)
 {
-  Thread t = {pc, sp, sub};
+  Thread t = {pc, sp, sub, sp};
+  return t;
+}
+
+static Thread
+frame(Inst *pc, char *sp, char *spTop, Sub *sub)
+{
+  Thread t = {pc, sp, sub, spTop};
   return t;
 }
 
@@ -92,6 +102,15 @@ ThreadVec_pop(ThreadVec *tv)
   return t;
 }
 
+/* Abandon the remaining threads, returning their Subs to pool. Keeps the capacity. */
+static void
+ThreadVec_clear(ThreadVec *tv, SubPool *pool)
+{
+  while (tv->nThreads > 0) {
+    SubPool_decref(pool, tv->threads[--tv->nThreads].sub);
+  }
+}
+
 static void
 ThreadVec_push(ThreadVec *tv, Thread t)
 {
@@ -104,54 +123,57 @@ ThreadVec_push(ThreadVec *tv, Thread t)
   assert(tv->nThreads <= tv->maxThreads);
 }
 
-/***** Helpers for evaluating complex Instructions *****/
+/****** Scratch ********/
 
-static int
-_inCharClass(Inst *pc, char c)
+struct BacktrackScratch
 {
-  int i, j;
-  int inThisRange = 0, inAnyInstCharRange = 0;
-
-  // Test for membership in each of the CharRange conditions
-  for (i = 0; i < pc->charRangeCounts; i++) {
-    logMsg(LOG_DEBUG, "testing range %d of %d (inv this one? %d)", i, pc->charRangeCounts, pc->charRanges[i].invert ? 1 : 0);
-    inThisRange = 0;
-    for (j = 0; j < pc->charRanges[i].count; j++) {
-      logMsg(LOG_DEBUG, "testing range %d.%d: [%d, %d]", i, j, pc->charRanges[i].lows[j], pc->charRanges[i].highs[j]);
-      inThisRange += pc->charRanges[i].lows[j] <= (int) c && (int) c <= pc->charRanges[i].highs[j];
-    }
-
-    // Invert the inner formula
-    if (pc->charRanges[i].invert)
-      inThisRange = !inThisRange;
+  ThreadVec ready; /* The backtracking stack */
+  ThreadVec zwaThreads; /* The stack for a lookahead's sub-simulation (they do not nest) */
+  SubPool subs;
+  Memo memo;
+  VisitTable visitTable;
+};
 
-    if (inThisRange) {
-      logMsg(LOG_VERBOSE, "in range %d", i);
-      inAnyInstCharRange = 1;
-    }
-  }
+BacktrackScratch *
+BacktrackScratch_create(void)
+{
+  BacktrackScratch *scratch = mal(sizeof *scratch); /* Zeroed: empty tables and pool */
+  scratch->ready = ThreadVec_alloc();
+  scratch->zwaThreads = ThreadVec_alloc();
+  logMsg(LOG_DEBUG, "BacktrackScratch_create: scratch %p", scratch);
+  return scratch;
+}
 
-  // Apply top-level inversion
-  if ( (inAnyInstCharRange && !pc->invert) || (!inAnyInstCharRange && pc->invert) )
-    return 1;
-  return 0;
+void
+BacktrackScratch_destroy(BacktrackScratch *scratch)
+{
+  ThreadVec_free(&scratch->ready);
+  ThreadVec_free(&scratch->zwaThreads);
+  SubPool_free(&scratch->subs);
+  if (scratch->memo.epoch != 0)
+    freeMemoTable(scratch->memo);
+  if (scratch->visitTable.epoch != 0)
+    freeVisitTable(scratch->visitTable);
+  free(scratch);
 }
 
+/***** Helpers for evaluating complex Instructions *****/
+
 static int
 _stringCompare(Inst *pc, Sub *sub, char *sp, char *inputEOL)
 {
   static char msg[128];
 
   // CG is not set -- match the empty string
-  if (sub->sub[CGID_TO_SUB_STARTP_IX(pc->cgNum)] == nil || sub->sub[CGID_TO_SUB_ENDP_IX(pc->cgNum)] == nil) {
-    logMsg(LOG_DEBUG, "CG %d not set yet (startpix %d endpix %d). We match the empty string", pc->cgNum, CGID_TO_SUB_STARTP_IX(pc->cgNum), CGID_TO_SUB_ENDP_IX(pc->cgNum));
+  if (sub->sub[CGID_TO_SUB_STARTP_IX(pc->n)] == nil || sub->sub[CGID_TO_SUB_ENDP_IX(pc->n)] == nil) {
+    logMsg(LOG_DEBUG, "CG %d not set yet (startpix %d endpix %d). We match the empty string", pc->n, CGID_TO_SUB_STARTP_IX(pc->n), CGID_TO_SUB_ENDP_IX(pc->n));
     return 0;
   }
 
-  logMsg(LOG_DEBUG, "CG %d set, checking match", pc->cgNum);
+  logMsg(LOG_DEBUG, "CG %d set, checking match", pc->n);
 
-  char *begin = CGID_TO_STARTP(sub, pc->cgNum);
-  char *end = CGID_TO_ENDP(sub, pc->cgNum);
+  char *begin = CGID_TO_STARTP(sub, pc->n);
+  char *end = CGID_TO_ENDP(sub, pc->n);
   int charsRemaining = inputEOL - sp;
   logMsg(LOG_DEBUG, "charsRemaining %d end-begin %d", charsRemaining, end-begin);
 
@@ -235,210 +257,48 @@ woffset(char *input, char *sp)
 int
 backtrack(Prog *prog, char *input, /* start-end pointers for each CG */ char **subp, /* Length of subp */ int nsubp)
 {
-  Memo memo;
-  VisitTable visitTable;
-  int i;
-  Inst *pc; /* Current position in VM (pc) */
-  char *sp; /* Current position in input */
-  Sub *sub; /* submatch (capture group) */
-  char *inputEOL; /* Position of \0 terminating input */
-  uint64_t startTime;
-  ThreadVec *threads = NULL;
-	int matched = 0;
-
-  int inZWA = 0;
-  char *sp_save = NULL;
-  ThreadVec *threads_save = NULL;
-
-  inputEOL = input + strlen(input);
-
-  /* Prep sub-captures */
-  sub = newsub(nsubp, input);
-  for(i=0; i<nsubp; i++)
-    sub->sub[i] = nil;
-
-  /* Prep memo structures */
+  BacktrackScratch *scratch = BacktrackScratch_create();
+  int matched = backtrackWithScratch(prog, input, subp, nsubp, scratch);
+  BacktrackScratch_destroy(scratch);
+  return matched;
+}
+
+/* The simulations: one per dispatch flavor, Memo_kind, and whether to track captures */
+typedef int (*BacktrackFn)(Prog *prog, char *input, char **subp, int nsubp, BacktrackScratch *scratch);
+
+#define BT_THREADED 0
+#define BT_INSTANCE(memo, captures) _backtrackSwitch##memo##captures
+#define BT_TABLE _backtrackSwitchInstances
+#include "backtrack-instances.h"
+#undef BT_THREADED
+
+#if COMPUTED_GOTO
+#define BT_THREADED 1
+#define BT_INSTANCE(memo, captures) _backtrackThreaded##memo##captures
+#define BT_TABLE _backtrackThreadedInstances
+#include "backtrack-instances.h"
+#undef BT_THREADED
+#endif
+
+int
+backtrackWithScratch(Prog *prog, char *input, char **subp, int nsubp, BacktrackScratch *scratch)
+{
+  BacktrackFn (*instances)[2] = _backtrackSwitchInstances;
+  int kind, captures;
+
+  /* Prep memo structures. What they turned out to be picks the simulation. */
   logMsg(LOG_VERBOSE, "Initializing visit table");
-  visitTable = initVisitTable(prog, strlen(input) + 1);
+  VisitTable_reuse(&scratch->visitTable, prog, strlen(input) + 1);
   logMsg(LOG_VERBOSE, "Initializing memo table");
-  memo = initMemoTable(prog, strlen(input) + 1);
-
-  logMsg(LOG_INFO, "Backtrack: Simulation begins");
-  startTime = now();
-
-  /* Initial thread state is < q0, w[0], current capture group > */
-  ThreadVec ready = ThreadVec_alloc();
-  ThreadVec_push(&ready, thread(prog->start, input, sub));
-  threads = &ready;
-
-  /* To recurse: save the state (sp, threads) and replace threads with the new starting point */
-
-  /* Run threads in stack order */
-BACKTRACKING_SEARCH:
-  while(threads->nThreads > 0) {
-    Thread next = ThreadVec_pop(threads);
-    pc = next.pc;
-    sp = next.sp;
-    sub = next.sub;
-    assert(sub->ref > 0);
-    for(;;) { /* Run thread to completion */
-      logMsg(LOG_VERBOSE, "  search state: <%d (M: %d), %d>", pc->stateNum, pc->memoInfo.memoStateNum, woffset(input, sp));
-
-      if (prog->memoMode != MEMO_NONE && pc->memoInfo.memoStateNum >= 0) {
-        /* Check if we've been here. */
-        if (isMarked(&memo, pc->memoInfo.memoStateNum, woffset(input, sp), sub)) {
-          /* Since we return on first match, the prior visit failed.
-           * Short-circuit thread */
-          logMsg(LOG_VERBOSE, "marked, short-circuiting thread");
-          assert(pc->opcode != Match);
-          goto Dead;
-        }
-
-        /* Mark that we've been here */
-        markMemo(&memo, pc->memoInfo.memoStateNum, woffset(input, sp), sub);
-      }
-
-      /* "Visit" means that we evaluate pc appropriately. */
-      markVisit(&visitTable, pc->stateNum, woffset(input, sp));
-
-      /* Proceed as normal */
-      switch(pc->opcode) {
-      case Char:
-        if(*sp != pc->c)
-          goto Dead;
-        pc++;
-        sp++;
-        continue;
-      case Any:
-        if(*sp == 0 || *sp == '\n' || *sp == '\r')
-          goto Dead;
-        pc++;
-        sp++;
-        continue;
-      case CharClass:
-        if (*sp == 0)
-          goto Dead;
-        /* Look through char class mins/maxes */
-        logMsg(LOG_VERBOSE, "Does char %d match CC? charClassCounts %d",
-          *sp, pc->charRangeCounts);
-
-        if (!_inCharClass(pc, *sp)) {
-          logMsg(LOG_VERBOSE, "not in char class");
-          goto Dead;
-        }
-        logMsg(LOG_VERBOSE, "char %d matched CC", *sp);
-        pc++;
-        sp++;  
-        continue;
-      case Match:
-        logMsg(LOG_VERBOSE, "Match: eolAnchor %d sp %p inputEOL %p", prog->eolAnchor, sp, inputEOL);
-        if (!prog->eolAnchor || (prog->eolAnchor && sp == inputEOL)) {
-          for(i=0; i<nsubp; i++)
-            subp[i] = sub->sub[i];
-          decref(sub);
-
-					matched = 1;
-					goto CleanupAndRet;
-        }
-        goto Dead;
-      case Jmp:
-        pc = pc->x;
-        continue;
-      case Split: /* Non-deterministic choice */
-        ThreadVec_push(threads, thread(pc->y, sp, incref(sub)));
-        pc = pc->x;  /* continue current thread */
-        continue;
-      case SplitMany: /* Non-deterministic choice */
-        for (i = 1; i < pc->arity; i++) {
-          ThreadVec_push(threads, thread(pc->edges[i], sp, incref(sub)));
-        }
-        pc = pc->edges[0];  /* continue current thread */
-        continue;
-      case Save:
-        logMsg(LOG_DEBUG, "  save %d at %p", pc->n, sp);
-        sub = update(sub, pc->n, sp);
-        pc++;
-        continue;
-      case StringCompare:
-      {
-        /* Check if appropriate sub matches */
-        logMsg(LOG_DEBUG, "  StringCompare on %d at %p", pc->cgNum, sp);
-        int nCharsMatched = _stringCompare(pc, sub, sp, inputEOL);
-        if (nCharsMatched > -1) {
-          sp += nCharsMatched;
-          pc++;
-          continue;
-        }
-
-        goto Dead;
-      }
-      case InlineZeroWidthAssertion:
-      {
-        if (_testInlineZeroWidthAssertion(pc, sp, sp == input, sp == inputEOL)) {
-          pc++;
-          continue;
-        }
-
-				logMsg(LOG_DEBUG, "InlineZWA %c unsatisfied", pc->c);
-        goto Dead;
-      }
-      case RecursiveZeroWidthAssertion:
-      {
-        // Save state: i, backtrack stack
-        assert(!inZWA); // No nesting
-        inZWA = 1;
-        sp_save = sp;
-        threads_save = threads;
-
-        // Override
-        Inst *newPC = pc+1;
-        ThreadVec override = ThreadVec_alloc();
-        ThreadVec_push(&override, thread(newPC, sp, sub));
-        threads = &override;
-        logMsg(LOG_DEBUG, "Overriding threads %p with %p -- a sub-simulation starting at <q%d, i%d>", threads_save, threads, (int)(newPC-prog->start), (int)(sp - input));
-        goto BACKTRACKING_SEARCH;
-      }
-        assert(!"unreachable");
-      case RecursiveMatch:
-        logMsg(LOG_DEBUG, "Made it to %d RecursiveMatch", (int)(pc-prog->start));
-        // Restore state: i, backtrack stack
-        assert(inZWA);
-        inZWA = 0;
-        sp = sp_save; // Zero-width
-        logMsg(LOG_DEBUG, "Restoring threads from %p to %p", threads, threads_save);
-        ThreadVec_free(threads);
-        threads = threads_save;
-        threads_save = nil;
-
-        pc++; // Advance beyond the ZWA
-        logMsg(LOG_DEBUG, "Resuming execution at <q%d, i%d>\n", (int)(pc-prog->start), (int)(sp-input));
-        continue; // Pick up where we left off
-
-      default:
-        logMsg(LOG_ERROR, "Unknown opcode %d", pc->opcode);
-      }
-    }
-  Dead:
-    decref(sub);
-  }
-  // Backtracking stack is exhausted.
-  if (inZWA) {
-    // No way to honor the ZWA from this point. Backtrack.
-    logMsg(LOG_INFO, "Could not honor ZWA");
-    inZWA = 0;
-    sp = sp_save; // Zero-width
-    ThreadVec_free(threads);
-    threads = threads_save;
-    threads_save = nil;
-    goto BACKTRACKING_SEARCH;
-  }
-	matched = 0;
-
-CleanupAndRet:
-	//decref(&sub);
-  printStats(prog, &memo, &visitTable, startTime, sub);
-  ThreadVec_free(&ready);
-  freeVisitTable(visitTable);
-  freeMemoTable(memo);
-  return matched;
+  Memo_reuse(&scratch->memo, prog, strlen(input) + 1);
+
+  kind = Memo_kind(&scratch->memo);
+  captures = nsubp > 0 || scratch->memo.backrefs || usesCountedLoops(prog); /* The counters live in the Sub */
+#if COMPUTED_GOTO
+  if (prog->dispatch == DISPATCH_THREADED)
+    instances = _backtrackThreadedInstances;
+#endif
+  assert(COMPUTED_GOTO || prog->dispatch == DISPATCH_SWITCH);
+  logMsg(LOG_DEBUG, "Backtrack: dispatch %d, memo kind %d, captures %d", prog->dispatch, kind, captures);
+  return instances[kind][captures](prog, input, subp, nsubp, scratch);
 }
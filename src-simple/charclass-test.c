@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2020, James Davis http://people.cs.vt.edu/davisjam/
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "charclass.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static InstCharRange
+range(int low, int high)
+{
+  InstCharRange cr = { .lows = { low }, .highs = { high }, .count = 1 };
+  return cr;
+}
+
+void testMembership() {
+  logMsg(LOG_INFO, "Test begins: testMembership");
+  InstCharClass cc;
+  InstCharRange cr;
+  int b;
+
+  logMsg(LOG_INFO, "  [a-z]");
+  memset(&cc, 0, sizeof cc);
+  cr = range('a', 'z');
+  CharClass_addRange(&cc, &cr);
+  CharClass_finish(&cc);
+  for (b = 0; b < 256; b++)
+    assert(CharClass_contains(&cc, (char) b) == (b >= 'a' && b <= 'z'));
+  assert(CharClass_size(&cc) == 26);
+
+  logMsg(LOG_INFO, "  [^a-z] has the high bytes but not NUL");
+  CharClass_invert(&cc);
+  CharClass_finish(&cc);
+  for (b = 0; b < 256; b++)
+    assert(CharClass_contains(&cc, (char) b) == (b != 0 && !(b >= 'a' && b <= 'z')));
+  assert(CharClass_size(&cc) == 256 - 26 - 1);
+
+  logMsg(LOG_INFO, "  \\D-style item: inverted within the class");
+  memset(&cc, 0, sizeof cc);
+  cr = range('0', '9');
+  cr.invert = 1;
+  CharClass_addRange(&cc, &cr);
+  CharClass_finish(&cc);
+  assert(!CharClass_contains(&cc, '5'));
+  assert(CharClass_contains(&cc, 'x'));
+  assert(CharClass_contains(&cc, (char) 0xe9));
+  assert(!CharClass_contains(&cc, '\0'));
+
+  logMsg(LOG_INFO, "  Many ranges");
+  memset(&cc, 0, sizeof cc);
+  for (b = 1; b < 256; b += 2) {
+    cr = range((signed char) b, (signed char) b);
+    CharClass_addRange(&cc, &cr);
+  }
+  CharClass_finish(&cc);
+  for (b = 0; b < 256; b++)
+    assert(CharClass_contains(&cc, (char) b) == (b % 2 == 1));
+  assert(CharClass_size(&cc) == 128);
+
+  logMsg(LOG_INFO, "...test passed");
+}
+
+/* The vectorized span agrees with the scalar one, wherever the run starts and ends */
+void testSpan() {
+  logMsg(LOG_INFO, "Test begins: testSpan");
+  InstCharClass classes[3];
+  InstCharRange cr;
+  int c, start, len, stop, trial;
+  /* Aligned, so we control every offset's alignment */
+  static char buf[256] __attribute__((aligned(16)));
+
+  memset(classes, 0, sizeof classes);
+  cr = range('a', 'z');
+  CharClass_addRange(&classes[0], &cr);
+  cr = range('0', '9');
+  cr.invert = 1;
+  CharClass_addRange(&classes[1], &cr);
+  srand(1);
+  for (c = 0; c < 256; c++) {
+    if (rand() % 2) {
+      cr = range((signed char) c, (signed char) c);
+      CharClass_addRange(&classes[2], &cr);
+    }
+  }
+  for (c = 0; c < 3; c++)
+    CharClass_finish(&classes[c]);
+
+  for (c = 0; c < 3; c++) {
+    logMsg(LOG_INFO, "  class %d: %d members", c, CharClass_size(&classes[c]));
+    for (start = 0; start < 16; start++) {
+      for (len = 0; len < 80; len++) {
+        for (trial = 0; trial < 4; trial++) {
+          /* A run of members from start, then a random byte (a member or not), then the terminator */
+          char *sp = buf + start;
+          int i;
+          for (i = 0; i < len; i++) {
+            do {
+              sp[i] = (char) (1 + rand() % 255);
+            } while (!CharClass_contains(&classes[c], sp[i]));
+          }
+          sp[len] = (char) (rand() % 256);
+          sp[len + 1] = '\0';
+
+          stop = CharClass_spanScalar(&classes[c], sp) - sp;
+          assert(stop >= len && stop <= len + 1);
+          assert(CharClass_span(&classes[c], sp) - sp == stop);
+        }
+      }
+    }
+  }
+
+  logMsg(LOG_INFO, "  stops at NUL");
+  memset(buf, 'q', sizeof buf);
+  buf[sizeof(buf) - 1] = '\0';
+  for (start = 0; start < 16; start++)
+    assert(CharClass_span(&classes[0], buf + start) == buf + sizeof(buf) - 1);
+
+  logMsg(LOG_INFO, "...test passed");
+}
+
+int main(int argc, char** argv) {
+  logMsg(LOG_INFO, "Running the CharClass unit test suite...");
+
+  testMembership();
+  testSpan();
+
+  return 0;
+}
@@ -0,0 +1,129 @@
+// Copyright 2020 James Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file
+
+#include "charclass.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHARCLASS_SSSE3 1
+#include <immintrin.h>
+#else
+#define CHARCLASS_SSSE3 0
+#endif
+
+static int
+_inRange(InstCharRange *cr, int c)
+{
+	int j, in = 0;
+
+	for (j = 0; j < cr->count; j++)
+		in |= cr->lows[j] <= c && c <= cr->highs[j];
+	return cr->invert ? !in : in;
+}
+
+void
+CharClass_addRange(InstCharClass *cc, InstCharRange *cr)
+{
+	int b;
+
+	for (b = 0; b < 256; b++) {
+		if (_inRange(cr, (int) (signed char) b))
+			cc->bits[b >> 6] |= ((uint64_t) 1) << (b & 63);
+	}
+}
+
+void
+CharClass_invert(InstCharClass *cc)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		cc->bits[i] = ~cc->bits[i];
+}
+
+void
+CharClass_finish(InstCharClass *cc)
+{
+	int b;
+
+	cc->bits[0] &= ~(uint64_t) 1; /* NUL */
+
+	memset(cc->nibbleRows, 0, sizeof cc->nibbleRows);
+	for (b = 0; b < 256; b++) {
+		if (CharClass_contains(cc, (char) b))
+			cc->nibbleRows[b >> 7][b & 15] |= 1 << ((b >> 4) & 7);
+	}
+}
+
+int
+CharClass_size(const InstCharClass *cc)
+{
+	int i, n = 0;
+
+	for (i = 0; i < 4; i++)
+		n += __builtin_popcountll(cc->bits[i]);
+	return n;
+}
+
+char *
+CharClass_spanScalar(const InstCharClass *cc, char *sp)
+{
+	while (CharClass_contains(cc, *sp))
+		sp++;
+	return sp;
+}
+
+#if CHARCLASS_SSSE3
+/* Sixteen bytes at a time. Split each byte into nibbles hi:lo.
+ * pshufb looks up lo in both nibble rows and hi in a table of bit masks; the byte is a member iff the masks meet.
+ * Loads are aligned, so a block never crosses into the next page. The first one may start before sp and
+ * the last one may run past the terminator, which is why the address sanitizer must look away. */
+__attribute__((target("ssse3"), no_sanitize_address))
+static char *
+_spanSSSE3(const InstCharClass *cc, char *sp)
+{
+	const __m128i rowsLow = _mm_loadu_si128((const __m128i *) cc->nibbleRows[0]);  /* hi 0-7 */
+	const __m128i rowsHigh = _mm_loadu_si128((const __m128i *) cc->nibbleRows[1]); /* hi 8-15 */
+	const __m128i bitOf = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	const __m128i loNibble = _mm_set1_epi8(0x0f);
+	const __m128i seven = _mm_set1_epi8(7);
+	unsigned skew = (uintptr_t) sp & 15;
+	const char *block = sp - skew;
+	unsigned misses;
+
+	for (;;) {
+		__m128i v = _mm_load_si128((const __m128i *) block);
+		__m128i lo = _mm_and_si128(v, loNibble);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), loNibble);
+		__m128i inHighRows = _mm_cmpgt_epi8(hi, seven);
+		__m128i row = _mm_or_si128(
+			_mm_and_si128(inHighRows, _mm_shuffle_epi8(rowsHigh, lo)),
+			_mm_andnot_si128(inHighRows, _mm_shuffle_epi8(rowsLow, lo)));
+		__m128i hit = _mm_and_si128(row, _mm_shuffle_epi8(bitOf, hi));
+
+		misses = _mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_setzero_si128()));
+		misses &= ~0u << skew; /* Bytes before sp */
+		skew = 0;
+		if (misses != 0)
+			return (char *) block + __builtin_ctz(misses);
+		block += 16;
+	}
+}
+#endif
+
+char *
+CharClass_span(const InstCharClass *cc, char *sp)
+{
+#if CHARCLASS_SSSE3
+	static int haveSSSE3 = -1;
+
+	if (haveSSSE3 < 0)
+		haveSSSE3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	if (haveSSSE3)
+		return _spanSSSE3(cc, sp);
+#endif
+	return CharClass_spanScalar(cc, sp);
+}
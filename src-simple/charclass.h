@@ -0,0 +1,64 @@
+// Copyright 2020 James Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file
+
+#ifndef CHARCLASS_H
+#define CHARCLASS_H
+
+/* CharClass operands: sets of bytes, built at compile time.
+ *
+ * Membership is one bit per byte value, so a test is O(1) whatever the class looked like in the regex.
+ * NUL is never a member: a test fails, and a span stops, at the end of the input. */
+
+#include <stdint.h>
+
+typedef struct InstCharClass InstCharClass;
+typedef struct InstCharRange InstCharRange;
+
+struct InstCharClass
+{
+	uint64_t bits[4]; /* Byte b is a member iff bit b%64 of bits[b/64] is set */
+
+	/* For CharClass_span: the same set, arranged by nibble (see CharClass_finish).
+	 * Bit h%8 of nibbleRows[h/8][lo] is set iff byte (h << 4 | lo) is a member. */
+	uint8_t nibbleRows[2][16];
+};
+
+/* Scratch for building a CharClass: one item of the regex's class, e.g. 'a-z' or '\W' */
+struct InstCharRange
+{
+	// Big enough to hold any built-in char classes
+	int lows[5];
+	int highs[5]; // Inclusive
+	int count;
+	int invert; // For \W, \S, \D
+};
+
+/* Building. Start from a zeroed InstCharClass, add items, then finish. */
+
+/* Add the members of cr. Bounds compare to the input's (signed) chars, as the old range test did. */
+void CharClass_addRange(InstCharClass *cc, InstCharRange *cr);
+/* Complement: for [^...] */
+void CharClass_invert(InstCharClass *cc);
+/* Call once the set is complete. Drops NUL and fills in the span tables. */
+void CharClass_finish(InstCharClass *cc);
+
+/* Querying */
+
+static inline int
+CharClass_contains(const InstCharClass *cc, char c)
+{
+	unsigned char b = (unsigned char) c;
+	return (cc->bits[b >> 6] >> (b & 63)) & 1;
+}
+
+/* Number of members */
+int CharClass_size(const InstCharClass *cc);
+
+/* The first byte at or after sp that is not in cc. The NUL terminator is never in cc, so this stops there at the latest.
+ * Vectorized where the CPU allows; it may read the aligned block holding the terminator, never past it. */
+char *CharClass_span(const InstCharClass *cc, char *sp);
+/* CharClass_span, one byte at a time. For reference and for tests. */
+char *CharClass_spanScalar(const InstCharClass *cc, char *sp);
+
+#endif /* CHARCLASS_H */
@@ -9,7 +9,11 @@
 #include <ctype.h>
 
 static Inst *pc; /* VM array */
+static Prog *prog; /* Owns the side tables that emit fills */
 static int count(Regexp*);
+static int _isCharLoop(Regexp*);
+static int _isPossessiveCharLoop(Regexp*);
+static int _isCharRepeat(Regexp*);
 static void emit(Regexp*, int);
 
 static void
@@ -29,14 +33,24 @@ Regexp* _mergeCustomCharClassRanges(Regexp *r);
 
 /* Update this Regexp AST to make it more amenable to compilation
  *  - convert Curly to Alt-chain by expansion: A{1,3} --> A(A(A)?)?
+ *    (unless it compiles to a CharRepeat or a counted loop; see _transformCurlies)
  *  - replace Alt-chains with a "flat" AltList with one child per Alt entity
  *  - replace a CustomCharClass's CharRange chain with a flat list of CharRange's within the CCC
  *  - convert \1 to a backref
  */
+static int
+_hasCurlies(Regexp *r)
+{
+	if (r == NULL)
+		return 0;
+	return r->type == Curly || _hasCurlies(r->left) || _hasCurlies(r->right);
+}
+
 Regexp*
 transform(Regexp *r)
 {
 	Regexp *ret;
+	int hasCurlies = _hasCurlies(r);
 
 	logMsg(LOG_INFO, "Transforming regex (AST pass)");
 
@@ -50,6 +64,7 @@ transform(Regexp *r)
 	logMsg(LOG_DEBUG, "  CustomCharClass");
 	ret = _mergeCustomCharClassRanges(ret);
 
+	ret->hasCurlies = hasCurlies;
 	return ret;
 }
 
@@ -90,7 +105,7 @@ _repeatPatternWithConcat(Regexp *r, int n)
 
 static
 Regexp *
-_repeatPatternWithNestedQuest(Regexp *r, int max)
+_repeatPatternWithNestedQuest(Regexp *r, int max, int nonGreedy)
 {
 	assert(r != NULL);
 	assert(max > 0);
@@ -100,12 +115,14 @@ _repeatPatternWithNestedQuest(Regexp *r, int max)
 	// To avoid recursion, we'll start with the innermost and work our way outward.
 	// max > 0, so we know there's at least an innermost node
 	Regexp *innermost = reg(Quest, copyreg(r), NULL);
+	innermost->n = nonGreedy;
 
 	int i;
 	Regexp *prev = innermost;
 	for (i = 1; i < max; i++) {
 		// Given prev, the next layer is (X prev)?
 		Regexp *nextInnermost = reg(Quest, reg(Cat, copyreg(r), prev), NULL);
+		nextInnermost->n = nonGreedy;
 		prev = nextInnermost;
 	}
 	ret = prev;
@@ -141,12 +158,63 @@ _repeatPatternWithAlt(Regexp *r, int min, int max)
 }
 #endif
 
+/* Could r match the empty string? Conservative: a backreference or a zero-width assertion could. */
+static int
+_matchesEmpty(Regexp *r)
+{
+	int i;
+
+	switch(r->type) {
+	default:
+		fatal("matchesEmpty: unknown type");
+		return 1;
+	case Lit:
+	case Dot:
+	case CustomCharClass:
+		return 0;
+	case CharEscape: /* \1 - \9 are backreferences, which may be empty */
+		return '1' <= r->ch && r->ch <= '9';
+	case Alt:
+		return _matchesEmpty(r->left) || _matchesEmpty(r->right);
+	case AltList:
+		for (i = 0; i < r->arity; i++) {
+			if (_matchesEmpty(r->children[i]))
+				return 1;
+		}
+		return 0;
+	case Cat:
+		return _matchesEmpty(r->left) && _matchesEmpty(r->right);
+	case Paren:
+	case Plus:
+	case Atomic:
+		return _matchesEmpty(r->left);
+	case Curly:
+		return r->curlyMin <= 0 || _matchesEmpty(r->left);
+	case Quest:
+	case Star:
+	case Backref:
+	case Lookahead:
+	case InlineZWA:
+		return 1;
+	}
+}
+
+/* Nesting depth of the counted loops around the Curly being transformed */
+static int curlyLoopDepth = 0;
+
 /* Given A and recursively transformed A':
  *   A{2}   ->  A'A'
  *   A{1,2} ->  A'(A')?
  *   A{,2}  ->  (A'(A')?)?
  *   A{2,}  ->  A'A'A'*
+ * A lazy A{m,n}? expands the same way, with lazy ?'s and *'s.
+ * That costs |A| states per copy, so large bounds are left as Curly for emit:
+ *   x{m,n}  (greedy, one character) is a CharRepeat; x{m,} -> x{m}x*
+ *   A{m,n}  with more than CURLY_EXPANSION_LIMIT copies of A is a counted loop,
+ *           unless A can match empty (the loop could spin), or we are out of counters.
  */
+#define CURLY_EXPANSION_LIMIT 16
+
 Regexp*
 _transformCurlies(Regexp *r)
 {
@@ -159,6 +227,32 @@ _transformCurlies(Regexp *r)
 		logMsg(LOG_DEBUG, "  transformCurlies: Rewriting Curly: (min %d, max %d)", r->curlyMin, r->curlyMax);
 		assert(!(r->curlyMin == -1 && r->curlyMax == -1)); // reject r = a{,} 
 		// r is of the form {m,n} where at most one of m and n is undefined
+		if (r->curlyMin < 0)
+			r->curlyMin = 0;
+
+		if (_isCharRepeat(r)) {
+			if (r->curlyMax >= 0) {
+				logMsg(LOG_DEBUG, "  transformCurlies: CharRepeat");
+				return r;
+			}
+			logMsg(LOG_DEBUG, "  transformCurlies: CharRepeat and CharLoop");
+			Regexp *star = reg(Star, copyreg(r->left), NULL);
+			if (r->curlyMin == 0) {
+				freereg(r);
+				return star;
+			}
+			r->curlyMax = r->curlyMin;
+			return reg(Cat, r, star);
+		}
+
+		int nCopies = (r->curlyMax >= 0) ? r->curlyMax : r->curlyMin + 1;
+		if (nCopies > CURLY_EXPANSION_LIMIT && curlyLoopDepth < MAXCOUNTERS && !_matchesEmpty(r->left)) {
+			logMsg(LOG_DEBUG, "  transformCurlies: Counted loop at depth %d", curlyLoopDepth);
+			curlyLoopDepth++;
+			r->left = _transformCurlies(r->left);
+			curlyLoopDepth--;
+			return r;
+		}
 
 		// Obtain A'. Make a copy anywhere you use it.
 		Regexp *A = _transformCurlies(r->left);
@@ -186,12 +280,13 @@ _transformCurlies(Regexp *r)
 		if (r->curlyMax == -1) {
 			logMsg(LOG_DEBUG, "  transformCurlies: Suffix is A*");
 			suffix = reg(Star, copyreg(A), NULL);
+			suffix->n = r->n;
 		} else {
 			int remainder = r->curlyMax - prefixLen;
 			if (remainder > 0) {
 				// A{,7}: Express with nested Quest
 				logMsg(LOG_DEBUG, "  transformCurlies: Suffix is A{,%d}", remainder);
-				suffix = _repeatPatternWithNestedQuest(A, remainder);
+				suffix = _repeatPatternWithNestedQuest(A, remainder, r->n);
 			} else {
 				// A{5,5} == A{5}
 				logMsg(LOG_DEBUG, "  transformCurlies: No suffix");
@@ -225,8 +320,9 @@ _transformCurlies(Regexp *r)
 	case Paren:
 	case CustomCharClass:
 	case Lookahead:
+	case Atomic:
 		/* Unary operators -- pass the buck. */
-		logMsg(LOG_DEBUG, "  curlies: Quest/Star/Plus/Paren/CCC/Lookahead: passing buck");
+		logMsg(LOG_DEBUG, "  curlies: Quest/Star/Plus/Paren/CCC/Lookahead/Atomic: passing buck");
 		if (r->left != NULL)
 			r->left = _transformCurlies(r->left);
 		return r;
@@ -317,9 +413,10 @@ _transformAltGroups(Regexp *r)
 	case Paren:
 	case CustomCharClass:
 	case Lookahead:
+	case Atomic:
 	case Curly:
 		/* Unary operators -- pass the buck. */
-		logMsg(LOG_DEBUG, "  altGroups: Quest/Star/Plus/Paren/CCC/Lookahead/Curly: passing buck");
+		logMsg(LOG_DEBUG, "  altGroups: Quest/Star/Plus/Paren/CCC/Lookahead/Atomic/Curly: passing buck");
 		if (r->left != NULL)
 			r->left = _transformAltGroups(r->left);
 		return r;
@@ -373,9 +470,10 @@ _escapedNumsToBackrefs(Regexp *r)
     case Plus:
 	case Paren:
 	case Lookahead:
+	case Atomic:
 	case Curly:
 		/* Unary operators -- pass the buck. */
-		logMsg(LOG_DEBUG, "  backrefs: Quest/Star/Plus/Paren/CCC/Lookahead/Curly: passing buck");
+		logMsg(LOG_DEBUG, "  backrefs: Quest/Star/Plus/Paren/CCC/Lookahead/Atomic/Curly: passing buck");
 		r->left = _escapedNumsToBackrefs(r->left);
 		return r;
 	case Lit:
@@ -471,9 +569,10 @@ _mergeCustomCharClassRanges(Regexp *r)
     case Plus:
 	case Paren:
 	case Lookahead:
+	case Atomic:
 	case Curly:
 		/* Unary operators -- pass the buck. */
-		logMsg(LOG_DEBUG, "  mergeCCC: Quest/Star/Plus/Paren/CCC/Lookahead/Curly: passing buck");
+		logMsg(LOG_DEBUG, "  mergeCCC: Quest/Star/Plus/Paren/CCC/Lookahead/Atomic/Curly: passing buck");
 		r->left = _mergeCustomCharClassRanges(r->left);
 		return r;
 	case Lit:
@@ -500,16 +599,20 @@ compile(Regexp *r, int memoMode)
 	p = mal(sizeof *p + n*sizeof p->start[0]);
 	p->start = (Inst*)(p+1);
 	pc = p->start;
-	for (i = 0; i < n; i++) {
-		p->start[i].memoInfo.visitInterval = 1; /* A good default */
-	}
+	prog = p;
 	emit(r, memoMode);
 	pc->opcode = Match;
 	pc++;
 	p->len = pc - p->start;
 	p->eolAnchor = r->eolAnchor;
+	p->hasCurlies = r->hasCurlies;
+	prog = NULL;
 
 	Prog_assignStateNumbers(p);
+	p->info = mal(p->len * sizeof(*p->info));
+	for (i = 0; i < p->len; i++) {
+		p->info[i].memoInfo.visitInterval = 1; /* A good default */
+	}
 	return p;
 }
 
@@ -545,11 +648,21 @@ count(Regexp *r)
 	case Quest:
 		return 1 + count(r->left);
 	case Star:
+		if (_isCharLoop(r))
+			return 1;
 		return 2 + count(r->left);
 	case Plus:
 		return 1 +  count(r->left);
 	case Lookahead:
 		return 2 +  count(r->left); /* ZWA + RecursiveMatch */
+	case Atomic:
+		if (_isPossessiveCharLoop(r))
+			return count(r->left);
+		return 2 + count(r->left); /* Barrier + Cut */
+	case Curly:
+		if (_isCharRepeat(r))
+			return 1;
+		return 3 + count(r->left); /* RepeatStart + RepeatTest + RepeatNext */
 	}
 }
 
@@ -914,32 +1027,181 @@ _emitRegexpCharEscape2InstCharRange(Regexp *r, InstCharRange *instCR)
 	}
 }
 
+/* Add the members of r, one item of a class, to cc */
 static void
-_emitRegexpCharRange2Inst(Regexp *r, Inst *inst)
+_emitRegexpCharRange2Inst(Regexp *r, InstCharClass *cc)
 {
-	InstCharRange *next = &inst->charRanges[ inst->charRangeCounts ];
+	InstCharRange cr;
+
+	memset(&cr, 0, sizeof cr);
 	switch (r->type) {
     default:
 		assert(!"emitrcr2int: Unexpected type");
 	case CharEscape: /* e.g. \w (built-in CC) or \a (nothing) */
-		_emitRegexpCharEscape2InstCharRange(r, next);
+		_emitRegexpCharEscape2InstCharRange(r, &cr);
 		break;
 	case CharRange:
 		switch (r->ccLow->type) {
 		case Lit: /* 'a-z' */
 			assert(r->ccHigh->type == Lit); /* 'a', or 'a-z' (but not 'a-\w') */
-			next->lows[0] = r->ccLow->ch; next->highs[0] = r->ccHigh->ch;
-			next->count = 1;
+			cr.lows[0] = r->ccLow->ch; cr.highs[0] = r->ccHigh->ch;
+			cr.count = 1;
 			break;
 		case CharEscape:
 			assert(r->ccLow->ch == r->ccHigh->ch); // '\w', not '\w-\s'
-			_emitRegexpCharEscape2InstCharRange(r->ccLow, next);
+			_emitRegexpCharEscape2InstCharRange(r->ccLow, &cr);
 			break;
 		default:
 			assert(!"emitrcr2int: CharRange: Unexpected child type");
 		}
 		break;
 	}
+	CharClass_addRange(cc, &cr);
+}
+
+/* Make room for entry n of a side table. The capacity is the next power of two, so grow at each one. */
+static void *
+_growSideTable(void *table, int n, int elemSize)
+{
+	void *grown;
+
+	if (n & (n - 1))
+		return table;
+	grown = mal((n == 0 ? 1 : 2*n) * elemSize);
+	if (n > 0)
+		memcpy(grown, table, n * elemSize);
+	free(table);
+	return grown;
+}
+
+/* A new, empty CharClass operand. Returns its index. */
+static int
+_emitCharClass(void)
+{
+	prog->charClasses = _growSideTable(prog->charClasses, prog->nCharClasses, sizeof(*prog->charClasses));
+	memset(&prog->charClasses[prog->nCharClasses], 0, sizeof(*prog->charClasses));
+	return prog->nCharClasses++;
+}
+
+/* A CharClass operand for what the single-character node r matches. Returns its index. */
+static int
+_emitCharClassFor(Regexp *r)
+{
+	int n = _emitCharClass(), i;
+	InstCharClass *cc = &prog->charClasses[n];
+	InstCharRange cr;
+
+	memset(&cr, 0, sizeof cr);
+	switch (r->type) {
+	default:
+		fatal("emitCharClassFor: unexpected type");
+	case Lit:
+		cr.lows[0] = r->ch; cr.highs[0] = r->ch;
+		cr.count = 1;
+		CharClass_addRange(cc, &cr);
+		break;
+	case Dot: /* As Any */
+		cr.lows[0] = '\n'; cr.highs[0] = '\n';
+		cr.lows[1] = '\r'; cr.highs[1] = '\r';
+		cr.count = 2;
+		cr.invert = 1;
+		CharClass_addRange(cc, &cr);
+		break;
+	case CharEscape:
+		_emitRegexpCharRange2Inst(r, cc);
+		break;
+	case CustomCharClass:
+		assert(r->mergedRanges);
+		for (i = 0; i < r->arity; i++)
+			_emitRegexpCharRange2Inst(r->children[i], cc);
+		if (r->plusDash) {
+			cr.lows[0] = '-'; cr.highs[0] = '-';
+			cr.count = 1;
+			CharClass_addRange(cc, &cr);
+		}
+		if (r->ccInvert)
+			CharClass_invert(cc);
+		break;
+	}
+	CharClass_finish(cc);
+	return n;
+}
+
+/* Can r, a Star or Plus, be a CharLoop? Greedy, over a single character. */
+static int
+_isCharLoop(Regexp *r)
+{
+	if (r->n) /* non-greedy */
+		return 0;
+	switch (r->left->type) {
+	case Lit:
+	case Dot:
+	case CharEscape:
+	case CustomCharClass:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Can r, a Curly, be a CharRepeat? Greedy, over a single character. A CharRepeat needs an upper bound too (see _transformCurlies).
+ * Before _escapedNumsToBackrefs, \1 - \9 are still CharEscapes. */
+static int
+_isCharRepeat(Regexp *r)
+{
+	if (r->n) /* non-greedy */
+		return 0;
+	switch (r->left->type) {
+	case CharEscape:
+		return !('1' <= r->left->ch && r->left->ch <= '9');
+	case Lit:
+	case Dot:
+	case CustomCharClass:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Is r, an Atomic, a possessive x* or x+ or x{m,n}? Then a CharLoop or CharRepeat without shorter runs does it, with no Barrier or Cut. */
+static int
+_isPossessiveCharLoop(Regexp *r)
+{
+	if (r->left->type == Curly)
+		return _isCharRepeat(r->left);
+	return (r->left->type == Star || r->left->type == Plus) && _isCharLoop(r->left);
+}
+
+/* Counted loops enclosing the one emit is working on */
+static int repeatDepth = 0;
+
+/* A new CharRepeat or counted-loop operand for r, a Curly. Returns its index. */
+static int
+_emitRepeat(Regexp *r, int cc, int counter)
+{
+	InstRepeat *rep;
+
+	prog->repeats = _growSideTable(prog->repeats, prog->nRepeats, sizeof(*prog->repeats));
+	rep = &prog->repeats[prog->nRepeats];
+	rep->min = r->curlyMin;
+	rep->max = r->curlyMax;
+	rep->greedy = !r->n;
+	rep->cc = cc;
+	rep->counter = counter;
+	return prog->nRepeats++;
+}
+
+/* A new SplitMany operand with room for arity edges. Returns its index. */
+static int
+_emitEdges(int arity)
+{
+	InstEdges *e;
+
+	prog->edgeLists = _growSideTable(prog->edgeLists, prog->nEdgeLists, sizeof(*prog->edgeLists));
+	e = &prog->edgeLists[prog->nEdgeLists];
+	e->arity = arity;
+	e->edges = mal(arity * sizeof(*e->edges));
+	return prog->nEdgeLists++;
 }
 
 /* Populate pc for r
@@ -967,7 +1229,7 @@ _emitRegexpCharRange2Inst(Regexp *r, Inst *inst)
 static void
 emit(Regexp *r, int memoMode)
 {
-	Inst *p1, *p2, *t, **t2;
+	Inst *p1, *p2, *t, **t2, **edges;
 	int i;
 
 	switch(r->type) {
@@ -988,8 +1250,8 @@ emit(Regexp *r, int memoMode)
 
 	case AltList:
 		pc->opcode = SplitMany;
-		pc->arity = r->arity;
-		pc->edges = mal(r->arity * sizeof(Inst **));
+		pc->n = _emitEdges(r->arity);
+		edges = prog->edgeLists[pc->n].edges;
 
 		/* The Jmp nodes associated with each branch */
 		t2 = mal(r->arity * sizeof(Inst **));
@@ -999,7 +1261,7 @@ emit(Regexp *r, int memoMode)
 		p1->x = pc;
 		for (i = 0; i < r->arity; i++) {
 			/* Emit a branch */
-			p1->edges[i] = pc;
+			edges[i] = pc;
 			emit(r->children[i], memoMode);
 			/* Emit a Jmp node and save it so we can set its destination once we exhaust the AltList */
 			pc->opcode = Jmp;
@@ -1031,34 +1293,9 @@ emit(Regexp *r, int memoMode)
 		break;
 
 	case CustomCharClass:
-		assert(r->mergedRanges);
-		pc->opcode = CharClass;
-		if (r->arity+1 > nelem(pc->charRanges)) // +1: space for a dash if needed
-			fatal("Too many ranges in char class");
-
-		pc->charRangeCounts = 0;
-		for (i = 0; i < r->arity; i++) {
-			// This doesn't really emit, it's actually populating pc fields
-			_emitRegexpCharRange2Inst(r->children[i], pc);
-			pc->charRangeCounts++;
-		}
-		if (r->plusDash) {
-			pc->charRanges[pc->charRangeCounts].lows[0] = '-';
-			pc->charRanges[pc->charRangeCounts].highs[0] = '-';
-			pc->charRanges[pc->charRangeCounts].count = 1;
-
-			pc->charRangeCounts++;
-		}
-		pc->invert = r->ccInvert;
-		pc++;
-		break;
-
 	case CharEscape:
 		pc->opcode = CharClass;
-
-		// Fill in the pc details
-		_emitRegexpCharRange2Inst(r, pc);
-		pc->charRangeCounts = 1;
+		pc->n = _emitCharClassFor(r);
 		pc++;
 		break;
 	
@@ -1092,6 +1329,14 @@ emit(Regexp *r, int memoMode)
 		break;
 
 	case Star:
+		if (_isCharLoop(r)) {
+			pc->opcode = CharLoop;
+			pc->n = _emitCharClassFor(r->left);
+			pc->c = -1; /* Prog_determineMemoNodes sets this */
+			pc->y = pc + 1;
+			pc++;
+			break;
+		}
 		pc->opcode = Split;
 		p1 = pc++;
 		p1->x = pc;
@@ -1110,6 +1355,14 @@ emit(Regexp *r, int memoMode)
 	case Plus:
 		p1 = pc;
 		emit(r->left, memoMode);
+		if (_isCharLoop(r)) { /* x+ -> xx* */
+			pc->opcode = CharLoop;
+			pc->n = (p1->opcode == CharClass) ? p1->n : _emitCharClassFor(r->left);
+			pc->c = -1;
+			pc->y = pc + 1;
+			pc++;
+			break;
+		}
 		pc->opcode = Split;
 		pc->x = p1; /* Back-edge */
 		p2 = pc;
@@ -1124,7 +1377,7 @@ emit(Regexp *r, int memoMode)
 
 	case Backref:
 		pc->opcode = StringCompare;
-		pc->cgNum = r->cgNum;
+		pc->n = r->cgNum;
 		pc++;
 		break;
 
@@ -1141,6 +1394,51 @@ emit(Regexp *r, int memoMode)
 		pc->c = r->ch;
 		pc++;
 		break;
+
+	case Atomic:
+		if (_isPossessiveCharLoop(r)) {
+			emit(r->left, memoMode);
+			assert((pc-1)->opcode == CharLoop || (pc-1)->opcode == CharRepeat);
+			(pc-1)->y = NULL;
+			break;
+		}
+		pc->opcode = Barrier;
+		pc++;
+		emit(r->left, memoMode);
+		pc->opcode = Cut;
+		pc++;
+		break;
+
+	case Curly:
+		if (_isCharRepeat(r)) {
+			assert(r->curlyMax >= 0);
+			pc->opcode = CharRepeat;
+			pc->n = _emitRepeat(r, _emitCharClassFor(r->left), -1);
+			pc->c = -1;
+			pc->y = pc + 1;
+			pc++;
+			break;
+		}
+		/* Loops at one depth are never live at once, so the depth picks the counter */
+		assert(repeatDepth < MAXCOUNTERS);
+		pc->opcode = RepeatStart;
+		pc->n = _emitRepeat(r, -1, repeatDepth);
+		p1 = pc++;
+		pc->opcode = RepeatTest;
+		pc->n = p1->n;
+		p2 = pc++;
+		p2->x = pc;
+		repeatDepth++;
+		if (repeatDepth > prog->nCounters)
+			prog->nCounters = repeatDepth;
+		emit(r->left, memoMode);
+		repeatDepth--;
+		pc->opcode = RepeatNext;
+		pc->n = p1->n;
+		pc->x = p2; /* Back-edge */
+		pc++;
+		p2->y = pc;
+		break;
 	}
 }
 
@@ -1159,50 +1457,74 @@ usesBackreferences(Prog *prog)
   return 0;
 }
 
+int
+usesAtomicGroups(Prog *prog)
+{
+  Inst *pc;
+  int i;
+
+  for (i = 0, pc = prog->start; i < prog->len; i++, pc++) {
+    if (pc->opcode == Barrier) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int
+usesCountedLoops(Prog *prog)
+{
+  return prog->nCounters > 0;
+}
+
 void
 printprog(Prog *p)
 {
 	Inst *pc, *e;
+	InstInfoForMemoSelPolicy *memoInfo;
+	InstEdges *edges;
 	int i;
 	
 	pc = p->start;
 	e = p->start + p->len;
 	
 	for(; pc < e; pc++) {
+		memoInfo = &INST_INFO(p, pc)->memoInfo;
 		switch(pc->opcode) {
 		default:
 			fatal("printprog: unknown opcode");
 		case StringCompare:
-			printf("%2d. stringcompare %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->cgNum, pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. stringcompare %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->n, memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			break;
 		case Split:
-			printf("%2d. split %d, %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), (int)(pc->x-p->start), (int)(pc->y-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. split %d, %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), (int)(pc->x-p->start), (int)(pc->y-p->start), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			//printf("%2d. split %d, %d\n", (int)(pc->stateNum), (int)(pc->x->stateNum), (int)(pc->y->stateNum));
 			break;
 		case SplitMany:
 			printf("%2d. splitmany ", (int) (pc - p->start));
-			for (i = 0; i < pc->arity; i++) {
-				printf("%d", (int) (pc->edges[i]-p->start));
-				if (i + 1 < pc->arity)
+			edges = &p->edgeLists[pc->n];
+			for (i = 0; i < edges->arity; i++) {
+				printf("%d", (int) (edges->edges[i]-p->start));
+				if (i + 1 < edges->arity)
 					printf(",");
 			}
-			printf(" (memo? %d -- state %d, visitInterval %d)\n", pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf(" (memo? %d -- state %d, visitInterval %d)\n", memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			//printf("%2d. split %d, %d\n", (int)(pc->stateNum), (int)(pc->x->stateNum), (int)(pc->y->stateNum));
 			break;
 		case Jmp:
-			printf("%2d. jmp %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), (int)(pc->x-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. jmp %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), (int)(pc->x-p->start), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			//printf("%2d. jmp %d\n", (int)(pc->stateNum), (int)(pc->x->stateNum));
 			break;
 		case Char:
-			printf("%2d. char %c (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->c, pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. char %c (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->c, memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			//printf("%2d. char %c\n", (int)(pc->stateNum), pc->c);
 			break;
 		case Any:
-			printf("%2d. any (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. any (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			//printf("%2d. any\n", (int)(pc->stateNum));
 			break;
 		case InlineZeroWidthAssertion:
-			printf("%2d. inlineZWA %c (memo? %d -- state %d)\n", (int)(pc-p->start), pc->c, pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum);
+			printf("%2d. inlineZWA %c (memo? %d -- state %d)\n", (int)(pc-p->start), pc->c, memoInfo->shouldMemo, memoInfo->memoStateNum);
 			//printf("%2d. any\n", (int)(pc->stateNum));
 			break;
 		case RecursiveZeroWidthAssertion:
@@ -1212,122 +1534,315 @@ printprog(Prog *p)
 			printf("%2d. recursivematch\n", (int)(pc-p->start));
 			break;
 		case CharClass:
-			printf("%2d. charClass (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. charClass %d, %d members (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->n, CharClass_size(&p->charClasses[pc->n]), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			//printf("%2d. any\n", (int)(pc->stateNum));
 			break;
+		case CharLoop:
+			printf("%2d. charLoop %d, %d members, memo state %d%s (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->n, CharClass_size(&p->charClasses[pc->n]), pc->c, pc->y == NULL ? ", possessive" : "", memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
+			break;
 		case Match:
-			printf("%2d. match (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. match (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			//printf("%2d. match\n", (int)(pc->stateNum));
 			break;
 		case Save:
-			printf("%2d. save %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->n, pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. save %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->n, memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
 			//printf("%2d. save %d\n", (int)(pc->stateNum), pc->n);
 			break;
+		case MemoCheck:
+			printf("%2d. memocheck %d (vertex %d)\n", (int)(pc-p->start), pc->n, pc->stateNum);
+			break;
+		case Barrier:
+			printf("%2d. barrier (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
+			break;
+		case Cut:
+			printf("%2d. cut (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
+			break;
+		case CharRepeat:
+			printf("%2d. charRepeat {%d,%d} %d, %d members%s (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), p->repeats[pc->n].min, p->repeats[pc->n].max, p->repeats[pc->n].cc, CharClass_size(&p->charClasses[p->repeats[pc->n].cc]), pc->y == NULL ? ", possessive" : "", memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
+			break;
+		case RepeatStart:
+			printf("%2d. repeatStart {%d,%d}%s counter %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), p->repeats[pc->n].min, p->repeats[pc->n].max, p->repeats[pc->n].greedy ? "" : " non-greedy", p->repeats[pc->n].counter, memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
+			break;
+		case RepeatTest:
+			printf("%2d. repeatTest counter %d, %d, %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), p->repeats[pc->n].counter, (int)(pc->x-p->start), (int)(pc->y-p->start), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
+			break;
+		case RepeatNext:
+			printf("%2d. repeatNext counter %d, %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), p->repeats[pc->n].counter, (int)(pc->x-p->start), memoInfo->shouldMemo, memoInfo->memoStateNum, memoInfo->visitInterval);
+			break;
 		}
 	}
 }
 
-static void Prog_unmarkAll(Prog *p)
+/* Add to first what the paths out of pc can consume first.
+ * Returns 0 if one of them could match without consuming, or we cannot tell (backreferences, lookaheads). */
+static int
+_firstChars(Prog *p, Inst *pc, InstCharClass *first, int *seen, Inst **stack)
 {
-	int i = 0;
-	for (i = 0; i < p->len; i++) {
-		p->start[i].startMark = 0;
-		p->start[i].visitMark = 0;
+	int i, nStack = 0;
+	InstEdges *edges;
+	InstCharClass any;
+	InstCharRange cr = { .lows = { '\n', '\r' }, .highs = { '\n', '\r' }, .count = 2, .invert = 1 };
+
+#define PUSH(inst) do { if (!seen[(inst) - p->start]) { seen[(inst) - p->start] = 1; stack[nStack++] = (inst); } } while (0)
+	PUSH(pc);
+	while (nStack > 0) {
+		pc = stack[--nStack];
+		switch (pc->opcode) {
+		default:
+			fatal("firstChars: unknown opcode");
+		case Char:
+			memset(&cr, 0, sizeof cr);
+			cr.lows[0] = pc->c; cr.highs[0] = pc->c;
+			cr.count = 1;
+			CharClass_addRange(first, &cr);
+			break;
+		case Any:
+			memset(&any, 0, sizeof any);
+			CharClass_addRange(&any, &cr); /* Everything but \n and \r */
+			for (i = 0; i < 4; i++)
+				first->bits[i] |= any.bits[i];
+			break;
+		case CharClass:
+			for (i = 0; i < 4; i++)
+				first->bits[i] |= p->charClasses[pc->n].bits[i];
+			break;
+		case CharLoop: /* May consume nothing */
+			for (i = 0; i < 4; i++)
+				first->bits[i] |= p->charClasses[pc->n].bits[i];
+			PUSH(pc + 1);
+			break;
+		case CharRepeat:
+			for (i = 0; i < 4; i++)
+				first->bits[i] |= p->charClasses[p->repeats[pc->n].cc].bits[i];
+			if (p->repeats[pc->n].min == 0)
+				PUSH(pc + 1);
+			break;
+		case Jmp:
+		case RepeatNext:
+			PUSH(pc->x);
+			break;
+		case RepeatTest: /* Either way, whatever the counter */
+			PUSH(pc->x);
+			PUSH(pc->y);
+			break;
+		case Split:
+			PUSH(pc->x);
+			PUSH(pc->y);
+			break;
+		case SplitMany:
+			edges = &p->edgeLists[pc->n];
+			for (i = 0; i < edges->arity; i++)
+				PUSH(edges->edges[i]);
+			break;
+		case InlineZeroWidthAssertion:
+			/* $ \Z \z hold only at the end of the input, and a CharLoop never consumes NUL.
+			 * The others are zero-width, and only narrow what follows. */
+			if (pc->c != '$' && pc->c != 'Z' && pc->c != 'z')
+				PUSH(pc + 1);
+			break;
+		case Save:
+		case Barrier:
+		case Cut:
+		case RepeatStart:
+			PUSH(pc + 1);
+			break;
+		case Match:
+			/* With $, only at the end of the input, and a CharLoop never consumes NUL */
+			if (!p->eolAnchor)
+				return 0;
+			break;
+		case StringCompare:
+		case RecursiveZeroWidthAssertion:
+		case RecursiveMatch:
+			return 0;
+		}
 	}
+#undef PUSH
+	return 1;
 }
 
-static int Inst_couldStartLoop(Inst *inst)
+/* A shorter run of a CharLoop or CharRepeat ends in front of a member of its class.
+ * If nothing that follows the loop can consume such a char, the shorter runs all fail: drop them. */
+void
+Prog_possessify(Prog *p)
 {
-    // For the infinite loop check, we check if there's a loop to a branch.
-	// Only branches can introduce a back-edge -- START a loop.
-	switch (inst->opcode) {
-    case Jmp:
-	case Split:
-	case SplitMany:
-		return 1;
-	default:
-		return 0;
+	int i, j, disjoint, nPossessive = 0;
+	int *seen = mal(p->len * sizeof(*seen));
+	Inst **stack = mal(p->len * sizeof(*stack));
+	InstCharClass first, *cc;
+
+	assert(p->nMemoChecks == 0);
+	for (i = 0; i < p->len; i++) {
+		if ((p->start[i].opcode != CharLoop && p->start[i].opcode != CharRepeat) || p->start[i].y == NULL)
+			continue;
+
+		memset(seen, 0, p->len * sizeof(*seen));
+		memset(&first, 0, sizeof first);
+		if (!_firstChars(p, p->start[i].y, &first, seen, stack))
+			continue;
+
+		cc = &p->charClasses[p->start[i].opcode == CharRepeat ? p->repeats[p->start[i].n].cc : p->start[i].n];
+		disjoint = 1;
+		for (j = 0; j < 4; j++)
+			disjoint = disjoint && (cc->bits[j] & first.bits[j]) == 0;
+		if (disjoint) {
+			logMsg(LOG_DEBUG, "Prog_possessify: %s %d is possessive", p->start[i].opcode == CharRepeat ? "CharRepeat" : "CharLoop", i);
+			p->start[i].y = NULL;
+			nPossessive++;
+		}
 	}
+	logMsg(LOG_INFO, "Prog_possessify: %d possessive CharLoops and CharRepeats", nPossessive);
+
+	free(seen);
+	free(stack);
 }
 
-// Return non-zero if we form a cycle, starting from stateNum, without consuming a character
-// Uses a recursive DFS. Will blow the stack on large curlies...
-static int Prog_epsilonClosure(Prog *p, int stateNum, int start /* True if first call */)
+/* The k-th edge out of pc that consumes nothing, or NULL past the last one */
+static Inst *
+_epsilonEdge(Prog *p, Inst *pc, int k)
 {
-	int i = 0;
-	Inst *curr = &p->start[stateNum];
-
-	logMsg(LOG_DEBUG, "  epsilonClosure: instr %d", stateNum);
-	if (curr->startMark) {
-		logMsg(LOG_DEBUG, "  infinite loop found: returned to instr %d", stateNum);
-		return 1;
-	} else if (curr->visitMark) {
-		logMsg(LOG_DEBUG, "  visited instr %d before, nothing more to mark here", stateNum);
-		return 0;
-	}
-
-	if (start) {
-		curr->startMark = 1;
-	} else {
-		curr->visitMark = 1;
-	}
+	Inst *end;
 
-	switch(curr->opcode) {
+	switch(pc->opcode) {
+	default:
+		fatal("epsilonEdge: unknown opcode");
+	case MemoCheck:
+		fatal("Check for infinite loops before inserting MemoChecks");
 	case Jmp:
-		return Prog_epsilonClosure(p, curr->x->stateNum, 0);
+	case RepeatNext:
+		return k == 0 ? pc->x : NULL;
 	case Split:
-		return Prog_epsilonClosure(p, curr->x->stateNum, 0) ? 1 : Prog_epsilonClosure(p, curr->y->stateNum, 0);
+		return k == 0 ? pc->x : (k == 1 ? pc->y : NULL);
+	case RepeatTest:
+		// The body consumes (see _transformCurlies). Below min, the loop may not leave, so the exit
+		// costs 0 only from the first visit of a loop that may run no times; otherwise a body ran first.
+		if (k == 1 && p->repeats[pc->n].min == 0)
+			return pc->y;
+		return k == 0 ? pc->x : NULL;
 	case SplitMany:
-		for (i = 0; i < curr->arity; i++) {
-			if (Prog_epsilonClosure(p, curr->edges[i]->stateNum, 0))
-				return 1;
-		}	
-		return 0;
-    case Char:
+		return k < p->edgeLists[pc->n].arity ? p->edgeLists[pc->n].edges[k] : NULL;
+	case Char:
 	case Match:
 	case Any:
 	case CharClass:
-		return 0;
-	case Save:
-		// Costs 0, so skip over
-		return Prog_epsilonClosure(p, stateNum + 1, 0);
+		return NULL;
 	case StringCompare:
-		return 0; // TODO This requires a more sophisticated analysis. (.)?\1 can match the empty string
+		return NULL; // TODO This requires a more sophisticated analysis. (.)?\1 can match the empty string
+	case Save:
+	case Barrier:
+	case Cut:
+	case RepeatStart:
 	case InlineZeroWidthAssertion:
-		// InlineZWA costs 0, so skip over
-		return Prog_epsilonClosure(p, stateNum + 1, 0);
+		// Costs 0, so skip over
+		return k == 0 ? pc + 1 : NULL;
+	case CharLoop:
+		// Its self-loop consumes, but it may leave without consuming
+		return k == 0 ? pc + 1 : NULL;
+	case CharRepeat:
+		return (k == 0 && p->repeats[pc->n].min == 0) ? pc + 1 : NULL;
 	case RecursiveZeroWidthAssertion:
-	{
-		// RecursiveZWA costs 0, so skip over
-		// Nesting is verboten
-		while (curr->opcode != RecursiveMatch) curr++;
-		return Prog_epsilonClosure(p, curr->stateNum + 1, 0);
-	}
+		// Costs 0, so skip over the lookahead. Nesting is verboten.
+		// Its body is searched from its own vertices; the RecursiveMatch leads nowhere.
+		if (k > 0)
+			return NULL;
+		for (end = pc; end->opcode != RecursiveMatch; end++)
+			;
+		return end + 1;
 	case RecursiveMatch:
-		// Nothing to do here, we'll explore this from another starting vertex
-		return 0;
-	default:
-		fatal("Unknown inst type");
+		return NULL;
 	}
+}
 
-	fatal("Never reached");
-	return 0;
+/* Tarjan's algorithm, with explicit stacks, over the edges that consume nothing. O(|Q| + |E|). */
+int
+Prog_findEpsilonCycles(Prog *p)
+{
+	int nVertices = p->len - p->nMemoChecks;
+	int *index = mal(nVertices * sizeof(*index)); /* DFS preorder number + 1. 0: not reached yet. */
+	int *lowlink = mal(nVertices * sizeof(*lowlink));
+	char *onStack = mal(nVertices * sizeof(*onStack));
+	int *sccStack = mal(nVertices * sizeof(*sccStack)); /* Reached, and not yet assigned a component */
+	int *dfsStack = mal(nVertices * sizeof(*dfsStack)); /* The DFS path */
+	int *nextEdge = mal(nVertices * sizeof(*nextEdge)); /* By vertex: the next edge of it to follow */
+	int nScc = 0, nSccStack = 0, nDfsStack = 0, nextIndex = 1, nInCycles = 0;
+	int root, v, w, size;
+	Inst *dst;
+
+	assert(p->nMemoChecks == 0);
+	for (root = 0; root < nVertices; root++) {
+		if (index[root])
+			continue;
+		index[root] = lowlink[root] = nextIndex++;
+		sccStack[nSccStack++] = root;
+		onStack[root] = 1;
+		dfsStack[nDfsStack++] = root;
+
+		while (nDfsStack > 0) {
+			v = dfsStack[nDfsStack - 1];
+			dst = _epsilonEdge(p, &p->start[v], nextEdge[v]++);
+			if (dst != NULL) {
+				w = dst - p->start;
+				if (!index[w]) {
+					/* Tree edge: descend */
+					index[w] = lowlink[w] = nextIndex++;
+					sccStack[nSccStack++] = w;
+					onStack[w] = 1;
+					dfsStack[nDfsStack++] = w;
+				} else if (onStack[w] && index[w] < lowlink[v]) {
+					lowlink[v] = index[w];
+				}
+				continue;
+			}
+
+			/* v is finished. Is it the root of a component? */
+			nDfsStack--;
+			if (nDfsStack > 0 && lowlink[v] < lowlink[dfsStack[nDfsStack - 1]])
+				lowlink[dfsStack[nDfsStack - 1]] = lowlink[v];
+			if (lowlink[v] != index[v])
+				continue;
+
+			size = 0;
+			do {
+				w = sccStack[--nSccStack];
+				onStack[w] = 0;
+				p->info[w].epsilonScc = nScc;
+				size++;
+			} while (w != v);
+			/* A cycle, unless it is one vertex without an edge to itself */
+			for (w = nSccStack; w < nSccStack + size; w++) {
+				int inCycle = size > 1;
+				int k;
+				for (k = 0; !inCycle && (dst = _epsilonEdge(p, &p->start[sccStack[w]], k)) != NULL; k++)
+					inCycle = (dst == &p->start[sccStack[w]]);
+				p->info[sccStack[w]].inEpsilonCycle = inCycle;
+				nInCycles += inCycle;
+			}
+			nScc++;
+		}
+	}
+	p->nEpsilonSccs = nScc;
+	logMsg(LOG_DEBUG, "Prog_findEpsilonCycles: %d components, %d vertices on cycles", nScc, nInCycles);
+
+	free(index);
+	free(lowlink);
+	free(onStack);
+	free(sccStack);
+	free(dfsStack);
+	free(nextEdge);
+	return nInCycles;
 }
 
 void Prog_assertNoInfiniteLoops(Prog *p)
 {
 	int i = 0;
-	for (i = 0; i < p->len; i++ ) {
-		if (Inst_couldStartLoop(&p->start[i])) {
-			Prog_unmarkAll(p);
-
-			logMsg(LOG_DEBUG, "  check for no infinite loops: starting from instr %d", i);
-			if (Prog_epsilonClosure(p, i, 1)) {
-				logMsg(LOG_DEBUG, "Found infinite loop from instr %d. Unsupported regex", i);
-				fatal("'syntax error': infinite loop possible due to nested *s like (a*)*");
-			}
+
+	if (Prog_findEpsilonCycles(p) > 0) {
+		for (i = 0; i < p->len; i++) {
+			if (p->info[i].inEpsilonCycle)
+				logMsg(LOG_DEBUG, "Found infinite loop through instr %d (component %d). Unsupported regex", i, p->info[i].epsilonScc);
 		}
+		fatal("'syntax error': infinite loop possible due to nested *s like (a*)*");
 	}
 
 	logMsg(LOG_DEBUG, "No infinite loops found");
-}
\ No newline at end of file
+}
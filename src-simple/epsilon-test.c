@@ -0,0 +1,152 @@
+/*
+Copyright (c) 2020, James Davis http://people.cs.vt.edu/davisjam/
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "regexp.h"
+#include "memoize.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Prog_findEpsilonCycles replaced a recursive DFS from each branch. That DFS is the reference here. */
+
+static char *startMark, *visitMark;
+
+/* Non-zero if we return to the start without consuming a character */
+static int
+closure(Prog *p, Inst *curr, int start)
+{
+  int i, s = curr - p->start;
+  InstEdges *edges;
+
+  if (startMark[s])
+    return 1;
+  if (visitMark[s])
+    return 0;
+  if (start)
+    startMark[s] = 1;
+  else
+    visitMark[s] = 1;
+
+  switch (curr->opcode) {
+  case Jmp:
+  case RepeatNext:
+    return closure(p, curr->x, 0);
+  case Split:
+    return closure(p, curr->x, 0) || closure(p, curr->y, 0);
+  case RepeatTest:
+    return closure(p, curr->x, 0) || (p->repeats[curr->n].min == 0 && closure(p, curr->y, 0));
+  case SplitMany:
+    edges = &p->edgeLists[curr->n];
+    for (i = 0; i < edges->arity; i++) {
+      if (closure(p, edges->edges[i], 0))
+        return 1;
+    }
+    return 0;
+  case Save:
+  case Barrier:
+  case Cut:
+  case RepeatStart:
+  case InlineZeroWidthAssertion:
+  case CharLoop:
+    return closure(p, curr + 1, 0);
+  case CharRepeat:
+    return p->repeats[curr->n].min == 0 && closure(p, curr + 1, 0);
+  case RecursiveZeroWidthAssertion:
+    while (curr->opcode != RecursiveMatch)
+      curr++;
+    return closure(p, curr + 1, 0);
+  default:
+    return 0;
+  }
+}
+
+static int
+isBranch(Inst *pc)
+{
+  return pc->opcode == Jmp || pc->opcode == Split || pc->opcode == SplitMany || pc->opcode == RepeatTest || pc->opcode == RepeatNext;
+}
+
+/* The components agree with the DFS at every branch. Returns whether p has an epsilon cycle. */
+static int
+checkAgainstClosure(char *pattern)
+{
+  Prog *p = compile(transform(parse(pattern)), MEMO_NONE);
+  int i, nInCycles, anyCycle = 0;
+
+  startMark = mal(p->len);
+  visitMark = mal(p->len);
+  nInCycles = Prog_findEpsilonCycles(p);
+  for (i = 0; i < p->len; i++) {
+    if (!isBranch(&p->start[i]))
+      continue;
+    memset(startMark, 0, p->len);
+    memset(visitMark, 0, p->len);
+    assert(closure(p, &p->start[i], 1) == p->info[i].inEpsilonCycle);
+    anyCycle |= p->info[i].inEpsilonCycle;
+  }
+  assert((nInCycles > 0) == anyCycle);
+  logMsg(LOG_INFO, "  %s: %d components, %d vertices on cycles", pattern, p->nEpsilonSccs, nInCycles);
+
+  free(startMark);
+  free(visitMark);
+  return anyCycle;
+}
+
+void testAgreesWithClosure() {
+  logMsg(LOG_INFO, "Test begins: testAgreesWithClosure");
+
+  logMsg(LOG_INFO, "  Loops that consume");
+  assert(!checkAgainstClosure("(a|ab)*c"));
+  assert(!checkAgainstClosure("^(a+)+$"));
+  assert(!checkAgainstClosure("(a|b|c)*?d"));
+  assert(!checkAgainstClosure("^(?>(a|a)*)$"));
+  assert(!checkAgainstClosure("a(?=(b|c)*)b*"));
+
+  logMsg(LOG_INFO, "  Loops that need not consume");
+  assert(checkAgainstClosure("(a*)*"));
+  assert(checkAgainstClosure("(a?|b)+"));
+  assert(checkAgainstClosure("(a{0,3})*"));
+  assert(checkAgainstClosure("(b|(?=a))*"));
+
+  logMsg(LOG_INFO, "  Counted loops nested in loops");
+  assert(!checkAgainstClosure("((ab){1,20})*c"));
+  assert(!checkAgainstClosure("((a){1,20})+"));
+  assert(!checkAgainstClosure("(((\\w){1,20}|[^a]))+$"));
+  assert(!checkAgainstClosure("(?:(?:ab){1,20})*?c"));
+  assert(!checkAgainstClosure("((?:(?:ab){17,18}c){17,})*"));
+  assert(checkAgainstClosure("((ab){0,20})*c"));
+  assert(checkAgainstClosure("((?:(?:ab){17,18}c){0,20}|x)*"));
+
+  logMsg(LOG_INFO, "...test passed");
+}
+
+int main(int argc, char** argv) {
+  logMsg(LOG_INFO, "Running the epsilon cycle unit test suite...");
+
+  testAgreesWithClosure();
+
+  return 0;
+}
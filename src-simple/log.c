@@ -1,4 +1,5 @@
 #include "log.h"
+#include "logtrace.h"
 
 #include <stdarg.h>
 #include <time.h>
@@ -6,6 +7,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 char logLevels[LOG_MAX+1][16] = {
     "silent",
@@ -39,14 +42,214 @@ int getenvVerbosity() {
     assert(!"Unknown verbosity");
 }
 
+/* Binary trace backend, chosen by MEMOIZATION_LOGFILE=path. Decode with logdecode.
+ * Each thread appends records to its own buffer, and writes the buffer out as one chunk
+ * when it fills, on logFlush, and (for the thread that calls exit) at exit.
+ * A record is a timestamp and the raw arguments -- no formatting, no clock-to-string, no stdio. */
+
+#define TRACE_BUFFER_BYTES (1 << 20)
+#define TRACE_MAX_FORMATS 4096 /* Power of 2. Format ids are slot numbers. */
+/* Largest possible message record */
+#define TRACE_MAX_MESSAGE_BYTES (4 + 8 + LOGTRACE_MAX_ARGS * (1 + LOGTRACE_MAX_STRING))
+
+typedef struct TraceFormat TraceFormat;
+struct TraceFormat
+{
+  const char *fmt; /* NULL if the slot is empty */
+  int nArgs; /* -1: cannot record the arguments, so we record none */
+  char types[LOGTRACE_MAX_ARGS];
+};
+
+typedef struct TraceBuffer TraceBuffer;
+struct TraceBuffer
+{
+  uint32_t threadId;
+  int nFormats;
+  TraceFormat formats[TRACE_MAX_FORMATS]; /* Keyed by the format string's address */
+  long nDropped; /* Messages lost because formats was full */
+  int used; /* Bytes of buf in use, starting with the chunk header */
+  char buf[TRACE_BUFFER_BYTES];
+};
+
+static int traceFd = -1;
+static uint32_t nTraceThreads = 0;
+static __thread TraceBuffer *traceBuffer = NULL;
+
+static void
+_traceFlush(TraceBuffer *tb)
+{
+  LogTraceChunk chunk;
+
+  if (tb->used == sizeof(chunk)) {
+    return;
+  }
+  chunk.threadId = tb->threadId;
+  chunk.nBytes = tb->used - sizeof(chunk);
+  memcpy(tb->buf, &chunk, sizeof(chunk));
+
+  /* One write per chunk, so chunks from different threads do not interleave */
+  if (write(traceFd, tb->buf, tb->used) != tb->used) {
+    fprintf(stderr, "log: short write to MEMOIZATION_LOGFILE, trace is truncated\n");
+  }
+  tb->used = sizeof(chunk);
+}
+
+static TraceBuffer *
+_traceBuffer(void)
+{
+  if (traceBuffer == NULL) {
+    traceBuffer = calloc(1, sizeof(*traceBuffer));
+    assert(traceBuffer != NULL);
+    traceBuffer->threadId = __sync_fetch_and_add(&nTraceThreads, 1);
+    traceBuffer->used = sizeof(LogTraceChunk);
+  }
+  return traceBuffer;
+}
+
+static void
+_tracePut(TraceBuffer *tb, const void *src, int n)
+{
+  memcpy(tb->buf + tb->used, src, n);
+  tb->used += n;
+}
+
+/* The id of fmt in this thread's chunks, defining it if this is its first use. -1 if full. */
+static int
+_traceFormatId(TraceBuffer *tb, const char *fmt)
+{
+  int mask = TRACE_MAX_FORMATS - 1;
+  int ix = ((uintptr_t) fmt >> 3) & mask;
+  uint8_t kind = LOGTRACE_FORMAT;
+  uint16_t id, len;
+
+  while (tb->formats[ix].fmt != NULL) {
+    if (tb->formats[ix].fmt == fmt) {
+      return ix;
+    }
+    ix = (ix + 1) & mask;
+  }
+
+  if (2 * (tb->nFormats + 1) > TRACE_MAX_FORMATS) {
+    return -1;
+  }
+  tb->formats[ix].fmt = fmt;
+  tb->formats[ix].nArgs = logtrace_argTypes(fmt, tb->formats[ix].types, NULL);
+  tb->nFormats++;
+
+  len = strlen(fmt);
+  if (tb->used + 5 + len > TRACE_BUFFER_BYTES) {
+    _traceFlush(tb);
+  }
+  id = ix;
+  _tracePut(tb, &kind, 1);
+  _tracePut(tb, &id, 2);
+  _tracePut(tb, &len, 2);
+  _tracePut(tb, fmt, len);
+  return ix;
+}
+
+static void
+_traceRecord(int level, const char *message, va_list args)
+{
+  TraceBuffer *tb = _traceBuffer();
+  TraceFormat *format;
+  struct timespec ts;
+  uint64_t nowNs, u64;
+  uint8_t kind = LOGTRACE_MESSAGE, lvl = level, len;
+  uint16_t id;
+  double d;
+  const char *str;
+  int ix, i;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  nowNs = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  ix = _traceFormatId(tb, message);
+  if (ix < 0) {
+    tb->nDropped++;
+    return;
+  }
+  format = &tb->formats[ix];
+
+  if (tb->used + TRACE_MAX_MESSAGE_BYTES > TRACE_BUFFER_BYTES) {
+    _traceFlush(tb);
+  }
+  id = ix;
+  _tracePut(tb, &kind, 1);
+  _tracePut(tb, &lvl, 1);
+  _tracePut(tb, &id, 2);
+  _tracePut(tb, &nowNs, 8);
+
+  for (i = 0; i < format->nArgs; i++) {
+    switch (format->types[i]) {
+    case LOGTRACE_ARG_INT:
+      u64 = (uint64_t) (int64_t) va_arg(args, int);
+      _tracePut(tb, &u64, 8);
+      break;
+    case LOGTRACE_ARG_LONG:
+      u64 = (uint64_t) va_arg(args, long long);
+      _tracePut(tb, &u64, 8);
+      break;
+    case LOGTRACE_ARG_DOUBLE:
+      d = va_arg(args, double);
+      _tracePut(tb, &d, 8);
+      break;
+    case LOGTRACE_ARG_POINTER:
+      u64 = (uintptr_t) va_arg(args, void *);
+      _tracePut(tb, &u64, 8);
+      break;
+    case LOGTRACE_ARG_STRING:
+      str = va_arg(args, const char *);
+      if (str == NULL)
+        str = "(null)";
+      len = strnlen(str, LOGTRACE_MAX_STRING);
+      _tracePut(tb, &len, 1);
+      _tracePut(tb, str, len);
+      break;
+    }
+  }
+}
+
+void
+logFlush(void)
+{
+  if (traceFd >= 0 && traceBuffer != NULL) {
+    _traceFlush(traceBuffer);
+    if (traceBuffer->nDropped > 0) {
+      fprintf(stderr, "log: dropped %ld messages, more than %d distinct formats\n", traceBuffer->nDropped, TRACE_MAX_FORMATS / 2);
+      traceBuffer->nDropped = 0;
+    }
+  }
+}
+
+static void
+_traceInit(const char *path)
+{
+  traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (traceFd < 0) {
+    fprintf(stderr, "log: cannot open MEMOIZATION_LOGFILE %s, logging as text\n", path);
+    return;
+  }
+  if (write(traceFd, LOGTRACE_MAGIC, LOGTRACE_MAGIC_LEN) != LOGTRACE_MAGIC_LEN) {
+    fprintf(stderr, "log: cannot write MEMOIZATION_LOGFILE %s, logging as text\n", path);
+    close(traceFd);
+    traceFd = -1;
+    return;
+  }
+  atexit(logFlush);
+}
+
 int initialized = 0;
-int maxVerbosity = LOG_SILENT;
+int logVerbosity = LOG_MAX;
 void log_init() {
     if (initialized) {
         return;
     }
 
-    maxVerbosity = getenvVerbosity();
+    logVerbosity = getenvVerbosity();
+    if (logVerbosity > LOG_SILENT && getenv("MEMOIZATION_LOGFILE") != NULL) {
+        _traceInit(getenv("MEMOIZATION_LOGFILE"));
+    }
     initialized = 1;
 }
 
@@ -57,19 +260,20 @@ int shouldLog(int logLvl)
         log_init();
     }
 
-    return logLvl <= maxVerbosity;
+    return logLvl <= LOG_COMPILE_MAX && logLvl <= logVerbosity;
 }
 
-void logMsg(int level, const char* message, ...) {
+void logMsg_emit(int level, const char* message, ...) {
     va_list args;
 
-    if (!initialized){
-        log_init();
-    }
-
+    /* Before log_init, logMsg lets everything through; filter again with the real level */
     if (shouldLog(level)) {
         va_start(args, message);
-        logMsg_format(logLevels[level], message, args);
+        if (traceFd >= 0) {
+            _traceRecord(level, message, args);
+        } else {
+            logMsg_format(logLevels[level], message, args);
+        }
         va_end(args);
     }
 }
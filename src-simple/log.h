@@ -21,9 +21,40 @@ enum
  * Logging is performed at or below the specified level.
  * Default level is SILENT */
 
-void logMsg(int level, const char* message, ...);
+/* Messages above LOG_COMPILE_MAX are compiled out, e.g. -DLOG_COMPILE_MAX=LOG_INFO
+ * keeps the per-step VERBOSE and DEBUG messages out of a timing build. */
+#ifndef LOG_COMPILE_MAX
+#define LOG_COMPILE_MAX LOG_MAX
+#endif
+
+/* The level read from the environment.
+ * Starts at LOG_MAX so that the first logMsg reaches log.c and reads the environment. */
+extern int logVerbosity;
+
+#define LOG_UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+/* A disabled message costs one predicted branch. Its arguments are not evaluated. */
+#define logEnabled(level) \
+  ((level) <= LOG_COMPILE_MAX && LOG_UNLIKELY((level) <= logVerbosity))
+
+/* The format must be a string literal. The binary trace records each format once, keyed by its address,
+ * so a reused buffer would be decoded as whatever it held first. Log such text with "%s".
+ * The "" makes any other format a compile error. */
+#define logMsg(level, ...) \
+  do { \
+    if (logEnabled(level)) \
+      logMsg_emit((level), "" __VA_ARGS__); \
+  } while (0)
+
+/* Use logMsg */
+void logMsg_emit(int level, const char* message, ...);
+
+/* With MEMOIZATION_LOGFILE=path, messages go to a binary trace at path instead of stdout.
+ * Decode it with logdecode. Each thread buffers its own messages; the thread that exits flushes
+ * at exit, and other threads should call logFlush before they finish. */
+void logFlush(void);
 
 /* True if we log such messages (e.g. to control a call to printre). */
 int shouldLog(int level);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,275 @@
+// Copyright 2020 James Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file
+
+/* Decode a binary trace (MEMOIZATION_LOGFILE) into the text that logMsg would have printed.
+ * Timestamps are seconds since the first message. */
+
+#include "logtrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAX_FORMATS 65536 /* Format ids are uint16 */
+
+static const char *levels[] = { "silent", "error", "warn", "info", "verbose", "debug" };
+
+typedef struct ThreadFormats ThreadFormats;
+struct ThreadFormats
+{
+  uint32_t threadId;
+  char **formats; /* By format id */
+  ThreadFormats *next;
+};
+
+static ThreadFormats *threads = NULL;
+static int multiThreaded = 0;
+static uint64_t firstNs = 0;
+static int sawMessage = 0;
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: logdecode trace.bin\n");
+  exit(2);
+}
+
+static void
+corrupt(const char *why)
+{
+  fprintf(stderr, "logdecode: corrupt trace: %s\n", why);
+  exit(1);
+}
+
+static ThreadFormats *
+threadFormats(uint32_t threadId)
+{
+  ThreadFormats *t;
+  for (t = threads; t != NULL; t = t->next) {
+    if (t->threadId == threadId)
+      return t;
+  }
+  if (threads != NULL)
+    multiThreaded = 1;
+
+  t = calloc(1, sizeof(*t));
+  assert(t != NULL);
+  t->threadId = threadId;
+  t->formats = calloc(MAX_FORMATS, sizeof(*t->formats));
+  assert(t->formats != NULL);
+  t->next = threads;
+  threads = t;
+  return t;
+}
+
+/* Cursor over one chunk */
+typedef struct Cursor Cursor;
+struct Cursor
+{
+  const char *p;
+  const char *end;
+};
+
+static void
+take(Cursor *c, void *dst, size_t n)
+{
+  if (c->end - c->p < (long) n)
+    corrupt("entry runs past the end of its chunk");
+  memcpy(dst, c->p, n);
+  c->p += n;
+}
+
+/* Print fmt[from, to), which has no conversions, collapsing each %% as printf would */
+static void
+printLiteral(const char *fmt, int from, int to)
+{
+  int i;
+  for (i = from; i < to; i++) {
+    putchar(fmt[i]);
+    if (fmt[i] == '%')
+      i++;
+  }
+}
+
+/* Offset of the first conversion in fmt at or after pos */
+static int
+nextConversion(const char *fmt, int pos)
+{
+  while (fmt[pos] != '%' || fmt[pos + 1] == '%') {
+    pos += (fmt[pos] == '%') ? 2 : 1;
+  }
+  return pos;
+}
+
+/* Print one message: walk the format, printing each conversion with its recorded argument */
+static void
+printMessage(Cursor *c, const char *fmt)
+{
+  char types[LOGTRACE_MAX_ARGS];
+  int convEnds[LOGTRACE_MAX_ARGS];
+  int nArgs = logtrace_argTypes(fmt, types, convEnds);
+  int i, k, n, convStart, pos = 0, nStars = 0;
+  int stars[2];
+  char spec[64];
+  uint64_t u64;
+  double d;
+  uint8_t len;
+  char str[LOGTRACE_MAX_STRING + 1];
+
+  if (nArgs < 0) {
+    /* Arguments were not recorded */
+    fputs(fmt, stdout);
+    return;
+  }
+
+  for (i = 0; i < nArgs; i++) {
+    if (convEnds[i] == -1) {
+      /* A '*' width or precision, for the conversion that follows */
+      take(c, &u64, 8);
+      if (nStars < 2)
+        stars[nStars++] = (int) u64;
+      continue;
+    }
+
+    convStart = nextConversion(fmt, pos);
+    printLiteral(fmt, pos, convStart);
+    pos = convEnds[i];
+
+    /* Rebuild the spec with a length modifier that matches what we pass */
+    if (pos - convStart + 3 > (int) sizeof(spec))
+      corrupt("conversion spec too long");
+    n = 0;
+    for (k = convStart; k < pos - 1; k++) {
+      if (strchr("hlzjtL", fmt[k]) == NULL)
+        spec[n++] = fmt[k];
+    }
+    if (types[i] == LOGTRACE_ARG_INT || types[i] == LOGTRACE_ARG_LONG) {
+      spec[n++] = 'l';
+      spec[n++] = 'l';
+    }
+    spec[n++] = fmt[pos - 1];
+    spec[n] = '\0';
+
+    switch (types[i]) {
+    case LOGTRACE_ARG_INT:
+    case LOGTRACE_ARG_LONG:
+      take(c, &u64, 8);
+      if (nStars == 2)
+        printf(spec, stars[0], stars[1], (long long) u64);
+      else if (nStars == 1)
+        printf(spec, stars[0], (long long) u64);
+      else
+        printf(spec, (long long) u64);
+      break;
+    case LOGTRACE_ARG_DOUBLE:
+      take(c, &d, 8);
+      if (nStars == 2)
+        printf(spec, stars[0], stars[1], d);
+      else if (nStars == 1)
+        printf(spec, stars[0], d);
+      else
+        printf(spec, d);
+      break;
+    case LOGTRACE_ARG_POINTER:
+      take(c, &u64, 8);
+      printf(spec, (void *) (uintptr_t) u64);
+      break;
+    case LOGTRACE_ARG_STRING:
+      take(c, &len, 1);
+      take(c, str, len);
+      str[len] = '\0';
+      if (nStars == 2)
+        printf(spec, stars[0], stars[1], str);
+      else if (nStars == 1)
+        printf(spec, stars[0], str);
+      else
+        printf(spec, str);
+      break;
+    }
+    nStars = 0;
+  }
+  printLiteral(fmt, pos, strlen(fmt));
+}
+
+static void
+decodeChunk(Cursor *c, ThreadFormats *t)
+{
+  uint8_t kind, level;
+  uint16_t id, len;
+  uint64_t ns;
+
+  while (c->p < c->end) {
+    take(c, &kind, 1);
+    switch (kind) {
+    case LOGTRACE_FORMAT:
+      take(c, &id, 2);
+      take(c, &len, 2);
+      free(t->formats[id]);
+      t->formats[id] = malloc(len + 1);
+      assert(t->formats[id] != NULL);
+      take(c, t->formats[id], len);
+      t->formats[id][len] = '\0';
+      break;
+    case LOGTRACE_MESSAGE:
+      take(c, &level, 1);
+      take(c, &id, 2);
+      take(c, &ns, 8);
+      if (t->formats[id] == NULL)
+        corrupt("message before its format");
+      if (!sawMessage) {
+        firstNs = ns;
+        sawMessage = 1;
+      }
+      printf("%12.6f ", (double) (ns - firstNs) / 1e9);
+      if (multiThreaded)
+        printf("t%u ", t->threadId);
+      printf("[%s]:\t", level < sizeof(levels) / sizeof(levels[0]) ? levels[level] : "?");
+      printMessage(c, t->formats[id]);
+      printf("\n");
+      break;
+    default:
+      corrupt("unknown entry kind");
+    }
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  FILE *f;
+  char magic[LOGTRACE_MAGIC_LEN];
+  LogTraceChunk chunk;
+  char *buf = NULL;
+  size_t bufLen = 0;
+  Cursor c;
+
+  if (argc != 2)
+    usage();
+
+  f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    fprintf(stderr, "logdecode: cannot open %s\n", argv[1]);
+    return 1;
+  }
+  if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, LOGTRACE_MAGIC, sizeof(magic)) != 0)
+    corrupt("bad magic");
+
+  while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+    if (chunk.nBytes > bufLen) {
+      bufLen = chunk.nBytes;
+      buf = realloc(buf, bufLen);
+      assert(buf != NULL);
+    }
+    if (fread(buf, 1, chunk.nBytes, f) != chunk.nBytes)
+      corrupt("truncated chunk");
+    c.p = buf;
+    c.end = buf + chunk.nBytes;
+    decodeChunk(&c, threadFormats(chunk.threadId));
+  }
+
+  free(buf);
+  fclose(f);
+  return 0;
+}
@@ -0,0 +1,113 @@
+// Copyright 2020 James Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file
+
+#ifndef LOGTRACE_H
+#define LOGTRACE_H
+
+/* Binary trace format, written by log.c when MEMOIZATION_LOGFILE is set and read by logdecode.
+ *
+ * File: LOGTRACE_MAGIC, then chunks.
+ * Chunk: LogTraceChunk, then nBytes of entries. One thread's buffer per chunk.
+ * Entry: a kind byte, then
+ *   LOGTRACE_FORMAT:  uint16 fmtId, uint16 len, len bytes of format string.
+ *                     Defines fmtId for the rest of this thread's chunks.
+ *   LOGTRACE_MESSAGE: uint8 level, uint16 fmtId, uint64 timestamp (ns, monotonic), then the arguments:
+ *                     8 bytes per number or pointer; uint8 len plus len bytes per string.
+ * Integers are native-endian and unaligned. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOGTRACE_MAGIC "MEMOTRC1"
+#define LOGTRACE_MAGIC_LEN 8
+
+enum
+{
+  LOGTRACE_FORMAT=0,
+  LOGTRACE_MESSAGE
+};
+
+typedef struct LogTraceChunk LogTraceChunk;
+struct LogTraceChunk
+{
+  uint32_t threadId;
+  uint32_t nBytes;
+};
+
+/* Argument types, one per conversion in the format string */
+#define LOGTRACE_MAX_ARGS 16
+#define LOGTRACE_ARG_INT 'i'      /* int, char */
+#define LOGTRACE_ARG_LONG 'l'     /* long, long long, size_t, ... */
+#define LOGTRACE_ARG_DOUBLE 'd'
+#define LOGTRACE_ARG_POINTER 'p'
+#define LOGTRACE_ARG_STRING 's'
+#define LOGTRACE_MAX_STRING 255   /* Longer %s arguments are truncated */
+
+/* Fill types with the argument type of each conversion in fmt.
+ * Returns the number of arguments, or -1 if fmt has too many or one we cannot record.
+ * If convEnds is not NULL, convEnds[k] is the offset just past the k'th conversion. */
+static inline int
+logtrace_argTypes(const char *fmt, char *types, int *convEnds)
+{
+  const char *p = fmt;
+  int nArgs = 0, isLong;
+
+  while (*p) {
+    if (*p++ != '%')
+      continue;
+    if (*p == '%') {
+      p++;
+      continue;
+    }
+
+    /* Flags, width, precision. A '*' consumes an int. */
+    while (*p && (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0'))
+      p++;
+    for (; *p && ((*p >= '0' && *p <= '9') || *p == '.' || *p == '*'); p++) {
+      if (*p == '*') {
+        if (nArgs == LOGTRACE_MAX_ARGS)
+          return -1;
+        types[nArgs] = LOGTRACE_ARG_INT;
+        if (convEnds != NULL)
+          convEnds[nArgs] = -1; /* Not a conversion of its own */
+        nArgs++;
+      }
+    }
+
+    /* Length */
+    isLong = 0;
+    while (*p && (*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't' || *p == 'L')) {
+      if (*p != 'h')
+        isLong = 1;
+      p++;
+    }
+
+    if (nArgs == LOGTRACE_MAX_ARGS)
+      return -1;
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      types[nArgs] = isLong ? LOGTRACE_ARG_LONG : LOGTRACE_ARG_INT;
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      types[nArgs] = LOGTRACE_ARG_DOUBLE;
+      break;
+    case 'p':
+      types[nArgs] = LOGTRACE_ARG_POINTER;
+      break;
+    case 's':
+      types[nArgs] = LOGTRACE_ARG_STRING;
+      break;
+    default:
+      return -1;
+    }
+    p++;
+    if (convEnds != NULL)
+      convEnds[nArgs] = p - fmt;
+    nArgs++;
+  }
+
+  return nArgs;
+}
+
+#endif
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 
 // Set this to 1 if you want to see regex and VM representations
 #define DEBUG 0
@@ -38,9 +39,16 @@ void
 usage(void)
 {
 	/* TODO: Diagnose cases where rle-tuned doesn't help */
-	fprintf(stderr, "usage: re {none|full|indeg|loop} {none|neg|rle|rle-tuned} { regexp string | -f patternAndStr.json }\n");
+	fprintf(stderr, "usage: re [options] {none|full|indeg|loop} {none|neg|rle|rle-tuned|bitmap|adaptive} { regexp string | -f patternAndStr.json }\n");
 	fprintf(stderr, "  The first argument is the memoization strategy\n");
 	fprintf(stderr, "  The second argument is the memo table encoding scheme\n");
+	fprintf(stderr, "  Options:\n");
+	fprintf(stderr, "    --window[=BLOCK]  Discard memo entries behind the backtracking frontier, BLOCK offsets at a time (default %d, a multiple of 64)\n", MEMO_WINDOW_DEFAULT_BLOCK);
+	fprintf(stderr, "    --memo-budget=BYTES  Cap the memo table at BYTES: evict, then memoize fewer vertices\n");
+	fprintf(stderr, "    --repeat=N  Match N times, reusing one match scratch. Stats are printed for each match.\n");
+	fprintf(stderr, "    --dispatch={switch|threaded}  How the backtracker dispatches instructions (default %s)\n", COMPUTED_GOTO ? "threaded" : "switch");
+	fprintf(stderr, "    --visit-table  Count visits to each search state, not just to each vertex. Costs |Q| x |w| ints.\n");
+	fprintf(stderr, "    --no-possessify  Keep backtracking into x* loops even when their shorter runs cannot match\n");
 	exit(2);
 }
 
@@ -130,6 +138,10 @@ getEncoding(char *arg)
 		return ENCODING_RLE;
 	else if (strcmp(arg, "rle-tuned") == 0)
 		return ENCODING_RLE_TUNED;
+	else if (strcmp(arg, "bitmap") == 0)
+		return ENCODING_BITMAP;
+	else if (strcmp(arg, "adaptive") == 0)
+		return ENCODING_ADAPTIVE;
     else {
 		fprintf(stderr, "Error, unknown encoding %s\n", arg);
 		usage();
@@ -141,22 +153,104 @@ static void
 freeprog(Prog *p)
 {
 	int i;
-	for (i = 0; i < p->len; i++) {
-		Inst *inst = p->start + i;
-		if (inst->edges != NULL)
-			free(inst->edges);
+	for (i = 0; i < p->nEdgeLists; i++) {
+		free(p->edgeLists[i].edges);
 	}
+	free(p->edgeLists);
+	free(p->charClasses);
+	free(p->repeats);
+	free(p->info);
+	if (p->start != (Inst *) (p + 1))
+		free(p->start); // Prog_determineMemoNodes rewrote it
 	free(p); // This also free p->start
 }
 
+/* Match repeat times with one scratch, as a worker would.
+ * Returns the last result. */
+static int
+backtrackRepeatedly(Prog *prog, char *input, char **sub, int nsub, int repeat)
+{
+	BacktrackScratch *scratch = BacktrackScratch_create();
+	int i, matched = 0;
+
+	for (i = 0; i < repeat; i++) {
+		memset(sub, 0, nsub * sizeof(*sub));
+		matched = backtrackWithScratch(prog, input, sub, nsub, scratch);
+	}
+	BacktrackScratch_destroy(scratch);
+	return matched;
+}
+
 int
 main(int argc, char **argv)
 {
-	int j, k, l, memoMode, memoEncoding;
+	int j, k, l, opt, memoMode, memoEncoding, memoWindow = 0, repeat = 1, fullVisitTable = 0, possessify = 1, matched;
+	int dispatch = COMPUTED_GOTO ? DISPATCH_THREADED : DISPATCH_SWITCH;
+	long memoBudget = 0;
 	Query q;
 	Regexp *re;
 	Prog *prog;
 	char *sub[MAXSUB]; /* Start and end pointers for each CG */
+	static struct option longOptions[] = {
+		{"window", optional_argument, NULL, 'w'},
+		{"memo-budget", required_argument, NULL, 'b'},
+		{"repeat", required_argument, NULL, 'r'},
+		{"visit-table", no_argument, NULL, 'v'},
+		{"dispatch", required_argument, NULL, 'd'},
+		{"no-possessify", no_argument, NULL, 'p'},
+		{NULL, 0, NULL, 0}
+	};
+
+	/* Options come first. "+": stop at the first positional, so "-f" stays put. */
+	while ((opt = getopt_long(argc, argv, "+", longOptions, NULL)) != -1) {
+		switch (opt) {
+		case 'w':
+			memoWindow = (optarg != NULL) ? atoi(optarg) : MEMO_WINDOW_DEFAULT_BLOCK;
+			if (memoWindow <= 0 || memoWindow % 64 != 0) {
+				fprintf(stderr, "Error, --window block must be a positive multiple of 64\n");
+				usage();
+			}
+			break;
+		case 'b':
+			memoBudget = atol(optarg);
+			if (memoBudget <= 0) {
+				fprintf(stderr, "Error, --memo-budget must be a positive number of bytes\n");
+				usage();
+			}
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			if (repeat <= 0) {
+				fprintf(stderr, "Error, --repeat must be positive\n");
+				usage();
+			}
+			break;
+		case 'v':
+			if (!VISIT_TABLE) {
+				fprintf(stderr, "Error, --visit-table needs a build with VISIT_TABLE=1\n");
+				usage();
+			}
+			fullVisitTable = 1;
+			break;
+		case 'd':
+			if (strcmp(optarg, "switch") == 0)
+				dispatch = DISPATCH_SWITCH;
+			else if (strcmp(optarg, "threaded") == 0 && COMPUTED_GOTO)
+				dispatch = DISPATCH_THREADED;
+			else {
+				fprintf(stderr, "Error, unknown or unsupported --dispatch %s\n", optarg);
+				usage();
+			}
+			break;
+		case 'p':
+			possessify = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 4)
 		usage();
@@ -200,10 +294,16 @@ main(int argc, char **argv)
 		printf("\n");
 	}
 	Prog_assertNoInfiniteLoops(prog);
+	if (possessify)
+		Prog_possessify(prog);
 
 	// Memoization settings
 	prog->memoMode = memoMode;
 	prog->memoEncoding = memoEncoding;
+	prog->memoWindow = memoWindow;
+	prog->memoBudget = memoBudget;
+	prog->fullVisitTable = fullVisitTable;
+	prog->dispatch = dispatch;
 	Prog_determineMemoNodes(prog, memoMode);
 	logMsg(LOG_INFO, "Will memoize %d states", prog->nMemoizedStates);
 
@@ -220,7 +320,11 @@ main(int argc, char **argv)
 			continue;
 		}
 		memset(sub, 0, sizeof sub);
-		if(!tab[j].fn(prog, q.input, sub, nelem(sub))) {
+		if (repeat > 1)
+			matched = backtrackRepeatedly(prog, q.input, sub, nelem(sub), repeat);
+		else
+			matched = tab[j].fn(prog, q.input, sub, nelem(sub));
+		if(!matched) {
 			printf("-no match-\n");
 			continue;
 		}
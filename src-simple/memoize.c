@@ -2,20 +2,25 @@
 #include "regexp.h"
 #include "log.h"
 
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 /******* Compiler phase ********/
 
 static void
 Prog_compute_in_degrees(Prog *p)
 {
 	int i, j;
+	InstEdges *edges;
 
 	/* Initialize */
-	for (i = 0; i < p->len; i++) {
-		p->start[i].memoInfo.inDegree = 0;
+	for (i = 0; i < p->len - p->nMemoChecks; i++) {
+		p->info[i].memoInfo.inDegree = 0;
 	}
 
 	/* q0 has an in-edge */
-	p->start[0].memoInfo.inDegree = 1;
+	INST_INFO(p, &p->start[0])->memoInfo.inDegree = 1;
 
 	/* Increment */
 	for (i = 0; i < p->len; i++) {
@@ -27,19 +32,44 @@ Prog_compute_in_degrees(Prog *p)
 			break;
 		case Jmp:
 			/* Goes to X */
-			p->start[i].x->memoInfo.inDegree++;
+			INST_INFO(p, p->start[i].x)->memoInfo.inDegree++;
 			break;
 		case Split:
 			/* Goes to X or Y */
-			p->start[i].x->memoInfo.inDegree++;
-			p->start[i].y->memoInfo.inDegree++;
+			INST_INFO(p, p->start[i].x)->memoInfo.inDegree++;
+			INST_INFO(p, p->start[i].y)->memoInfo.inDegree++;
 			break;
 		case SplitMany:
 			/* Goes to each child */
-			for (j = 0; j < p->start[i].arity; j++) {
-				p->start[i].edges[j]->memoInfo.inDegree++;
+			edges = &p->edgeLists[p->start[i].n];
+			for (j = 0; j < edges->arity; j++) {
+				INST_INFO(p, edges->edges[j])->memoInfo.inDegree++;
 			}
 			break;
+		case MemoCheck:
+			/* Shares its vertex's info, and the edges into it are the vertex's */
+			break;
+		case CharLoop:
+			/* Goes to itself (one more char) or to next instr */
+			INST_INFO(p, &p->start[i])->memoInfo.inDegree++;
+			INST_INFO(p, &p->start[i+1])->memoInfo.inDegree++;
+			break;
+		case CharRepeat:
+			/* Goes to next instr, from each run length: like the edges out of its expansion x(x(x)?)?
+			 * Possessive too: entered at different offsets, its runs can still end at the same one */
+			if (p->repeats[p->start[i].n].min != p->repeats[p->start[i].n].max)
+				INST_INFO(p, &p->start[i+1])->memoInfo.inDegree++;
+			INST_INFO(p, &p->start[i+1])->memoInfo.inDegree++;
+			break;
+		case RepeatTest:
+			/* Goes around again (X) or leaves (Y) */
+			INST_INFO(p, p->start[i].x)->memoInfo.inDegree++;
+			INST_INFO(p, p->start[i].y)->memoInfo.inDegree++;
+			break;
+		case RepeatNext:
+			/* Goes back to its RepeatTest */
+			INST_INFO(p, p->start[i].x)->memoInfo.inDegree++;
+			break;
 		case Any:
 		case CharClass:
 		case Char:
@@ -48,8 +78,11 @@ Prog_compute_in_degrees(Prog *p)
 		case InlineZeroWidthAssertion:
 		case RecursiveZeroWidthAssertion:
 		case RecursiveMatch:
+		case Barrier:
+		case Cut:
+		case RepeatStart:
 			/* Always goes to next instr */
-			p->start[i+1].memoInfo.inDegree++;
+			INST_INFO(p, &p->start[i+1])->memoInfo.inDegree++;
 			break;
 		}
 	}
@@ -61,8 +94,8 @@ Prog_find_ancestor_nodes(Prog *p)
 	int i;
 
 	/* Initialize */
-	for (i = 0; i < p->len; i++) {
-		p->start[i].memoInfo.isAncestorLoopDestination = 0;
+	for (i = 0; i < p->len - p->nMemoChecks; i++) {
+		p->info[i].memoInfo.isAncestorLoopDestination = 0;
 	}
 
 	/* Observe back-edges */
@@ -71,27 +104,33 @@ Prog_find_ancestor_nodes(Prog *p)
     switch (p->start[i].opcode) {
     default: break; // Not a branch type, cannot create a back-edge
 		case Jmp:
+		case RepeatNext:
       logMsg(LOG_DEBUG, "  Jmp: from %d to %d", stateNum, p->start[i].x->stateNum);
       if (stateNum > p->start[i].x->stateNum) {
-          p->start[i].x->memoInfo.isAncestorLoopDestination = 1;
+          INST_INFO(p, p->start[i].x)->memoInfo.isAncestorLoopDestination = 1;
       }
       break;
     case Split:
       logMsg(LOG_DEBUG, "  Split option: from %d to %d or %d", stateNum, p->start[i].x->stateNum, p->start[i].y->stateNum);
       if (stateNum > p->start[i].x->stateNum) {
-          p->start[i].x->memoInfo.isAncestorLoopDestination = 1;
+          INST_INFO(p, p->start[i].x)->memoInfo.isAncestorLoopDestination = 1;
       } 
       if (stateNum > p->start[i].y->stateNum) {
-          p->start[i].y->memoInfo.isAncestorLoopDestination = 1;
+          INST_INFO(p, p->start[i].y)->memoInfo.isAncestorLoopDestination = 1;
       } 
       break;
+    case CharLoop:
+      logMsg(LOG_DEBUG, "  CharLoop: from %d to itself", stateNum);
+      INST_INFO(p, &p->start[i])->memoInfo.isAncestorLoopDestination = 1;
+      break;
     case SplitMany:
       {
+        InstEdges *edges = &p->edgeLists[p->start[i].n];
         int j;
-        for (j = 0; j < p->start[i].arity; j++) {
-          logMsg(LOG_DEBUG, "  SplitMany: from %d to %d", stateNum, p->start[i].edges[j]->stateNum);
-          if (stateNum > p->start[i].edges[j]->stateNum) {
-            p->start[i].edges[j]->memoInfo.isAncestorLoopDestination = 1;
+        for (j = 0; j < edges->arity; j++) {
+          logMsg(LOG_DEBUG, "  SplitMany: from %d to %d", stateNum, edges->edges[j]->stateNum);
+          if (stateNum > edges->edges[j]->stateNum) {
+            INST_INFO(p, edges->edges[j])->memoInfo.isAncestorLoopDestination = 1;
           }
         }
       }
@@ -100,63 +139,170 @@ Prog_find_ancestor_nodes(Prog *p)
 	}
 }
 
+/* Insert a MemoCheck before each shouldMemo Inst, and redirect the edges into it to the MemoCheck */
+static void
+Prog_insertMemoChecks(Prog *p)
+{
+	int i, j, k, len = p->len + p->nMemoizedStates;
+	Inst *old = p->start;
+	Inst *rewritten = mal(len * sizeof(*rewritten));
+	int *entry = mal(p->len * sizeof(*entry)); /* Where control enters each old Inst */
+
+	for (i = 0, j = 0; i < p->len; i++) {
+		entry[i] = j;
+		if (p->info[i].memoInfo.shouldMemo) {
+			rewritten[j].opcode = MemoCheck;
+			rewritten[j].n = p->info[i].memoInfo.memoStateNum;
+			rewritten[j].stateNum = old[i].stateNum; /* The vertex it guards */
+			j++;
+		}
+		rewritten[j++] = old[i];
+	}
+	assert(j == len);
+
+	for (j = 0; j < len; j++) {
+		if (rewritten[j].x != NULL)
+			rewritten[j].x = &rewritten[ entry[rewritten[j].x - old] ];
+		if (rewritten[j].y != NULL)
+			rewritten[j].y = &rewritten[ entry[rewritten[j].y - old] ];
+	}
+	for (i = 0; i < p->nEdgeLists; i++) {
+		InstEdges *edges = &p->edgeLists[i];
+		for (k = 0; k < edges->arity; k++) {
+			edges->edges[k] = &rewritten[ entry[edges->edges[k] - old] ];
+		}
+	}
+
+	logMsg(LOG_DEBUG, "Prog_insertMemoChecks: %d instructions -> %d", p->len, len);
+	if (p->start != (Inst *) (p + 1))
+		free(p->start);
+	free(entry);
+	p->start = rewritten;
+	p->len = len;
+	p->nMemoChecks = p->nMemoizedStates;
+	p->handlers = NULL;
+}
+
+/* A marked search state means "explored from here before, and failed". Inside an atomic group, that is not so:
+ * the exploration may have left the group, failed after it, and cut the rest of the group away.
+ * A later visit to that state would leave the group the same way, and should fail the group too, not just its thread.
+ * So we do not memoize the vertices inside a group (through its Cut). The Barrier is fine: a group's outcome depends only on where it starts.
+ * An atomic group's Insts are contiguous, from its Barrier to its Cut. */
+static void
+Prog_unmemoAtomicGroups(Prog *p)
+{
+	int i, depth = 0, nDropped = 0;
+
+	for (i = 0; i < p->len; i++) {
+		if (depth > 0 && p->info[i].memoInfo.shouldMemo) {
+			p->info[i].memoInfo.shouldMemo = 0;
+			nDropped++;
+		}
+		if (p->start[i].opcode == Barrier)
+			depth++;
+		else if (p->start[i].opcode == Cut)
+			depth--;
+	}
+	assert(depth == 0);
+	if (nDropped > 0)
+		logMsg(LOG_INFO, "Prog_determineMemoNodes: not memoizing %d vertices inside atomic groups", nDropped);
+}
+
+/* Within a counted loop, where the simulation goes depends on the loop's counter too: it is part of the search state.
+ * Record which counters each vertex depends on. A loop's Insts are contiguous: RepeatStart (which zeroes the counter,
+ * so does not depend on it), RepeatTest, the body, RepeatNext. */
+static void
+Prog_assignCounterMasks(Prog *p)
+{
+	int i, mask = 0;
+	InstRepeat *rep;
+
+	for (i = 0; i < p->len; i++) {
+		p->info[i].memoInfo.counterMask = mask;
+		switch (p->start[i].opcode) {
+		case RepeatStart:
+			rep = &p->repeats[p->start[i].n];
+			assert(!(mask & (1 << rep->counter)));
+			mask |= 1 << rep->counter;
+			break;
+		case RepeatNext:
+			rep = &p->repeats[p->start[i].n];
+			mask &= ~(1 << rep->counter);
+			break;
+		}
+	}
+	assert(mask == 0);
+}
+
 void
 Prog_determineMemoNodes(Prog *p, int memoMode)
 {
-	int i, nextStateNum;
+	int i, nextStateNum, nVertices = p->len;
+
+	assert(p->nMemoChecks == 0);
+
+	/* Analyses for the selection policies. A budgeted Memo also uses these to narrow its selection. */
+	Prog_compute_in_degrees(p);
+	Prog_find_ancestor_nodes(p);
+	Prog_assignCounterMasks(p);
 
 	/* Determine which nodes to memoize based on memo mode. */
 	switch (memoMode) {
 	case MEMO_FULL:
         /* Memoize all nodes. */
         logMsg(LOG_DEBUG, "Prog_determineMemoNodes: FULL");
-		for (i = 0; i < p->len; i++){
-			p->start[i].memoInfo.shouldMemo = 1;
+		for (i = 0; i < nVertices; i++){
+			p->info[i].memoInfo.shouldMemo = 1;
 		}
 		break;
 	case MEMO_IN_DEGREE_GT1:
         /* Memoize nodes with in-deg > 1. */
         logMsg(LOG_DEBUG, "Prog_determineMemoNodes: IN_DEGREE");
-		Prog_compute_in_degrees(p);
-		for (i = 0; i < p->len; i++) {
-			if (p->start[i].memoInfo.inDegree > 1) {
-				p->start[i].memoInfo.shouldMemo = 1;
+		for (i = 0; i < nVertices; i++) {
+			if (p->info[i].memoInfo.inDegree > 1) {
+				p->info[i].memoInfo.shouldMemo = 1;
 			}
 		}
 		break;
 	case MEMO_LOOP_DEST:
         /* Memoize nodes that are the destination of a back-edge (i.e. a larger node number points to a smaller node number). */
         logMsg(LOG_DEBUG, "Prog_determineMemoNodes: LOOP");
-        Prog_find_ancestor_nodes(p);
-        for (i = 0; i < p->len; i++) {
-            if (p->start[i].memoInfo.isAncestorLoopDestination) {
-            	logMsg(LOG_DEBUG, "  ancestor node %d", p->start[i].stateNum);
-                p->start[i].memoInfo.shouldMemo = 1;
+        for (i = 0; i < nVertices; i++) {
+            if (p->info[i].memoInfo.isAncestorLoopDestination) {
+            	logMsg(LOG_DEBUG, "  ancestor node %d", i);
+                p->info[i].memoInfo.shouldMemo = 1;
             }
         }
 		break;
 	case MEMO_NONE:
         /* Memoize no nodes. */
         logMsg(LOG_DEBUG, "Prog_determineMemoNodes: NONE");
-		for (i = 0; i < p->len; i++) {
-			p->start[i].memoInfo.shouldMemo = 0;
+		for (i = 0; i < nVertices; i++) {
+			p->info[i].memoInfo.shouldMemo = 0;
 		}
 		break;
 	default:
 		assert(!"Unknown memoMode\n");
 	}
+	Prog_unmemoAtomicGroups(p);
 
 	/* Assign memoStateNum to the shouldMemo nodes */
 	nextStateNum = 0;
-	for (i = 0; i < p->len; i++) {
-		if (p->start[i].memoInfo.shouldMemo) {
-			p->start[i].memoInfo.memoStateNum = nextStateNum;
+	for (i = 0; i < nVertices; i++) {
+		if (p->info[i].memoInfo.shouldMemo) {
+			p->info[i].memoInfo.memoStateNum = nextStateNum;
 			nextStateNum++;
 		} else {
-			p->start[i].memoInfo.memoStateNum = -1;
+			p->info[i].memoInfo.memoStateNum = -1;
 		}
+		/* A CharLoop marks the positions it consumes itself. The MemoCheck before it only sees where it starts. */
+		if (p->start[i].opcode == CharLoop)
+			p->start[i].c = p->info[i].memoInfo.memoStateNum;
 	}
 	p->nMemoizedStates = nextStateNum;
+
+	if (p->nMemoizedStates > 0)
+		Prog_insertMemoChecks(p);
 }
 
 /******* Simulation ********/
@@ -182,22 +328,114 @@ int nCG_BR = 0;
 static int CG_BR_num2memo[MAXSUB]; /* CG number to memo vertex ix -- only populated for the CGBR's */
 static int CG_BR_memo2num[MAXSUB]; /* Memo vertex ix to CG number */
 
-/* Visit table.  */
+/* Demand-zero rows.
+ * The |Q| x |w| tables get one anonymous mapping. The kernel hands out zeroed pages on first touch,
+ * so setting up costs O(|Q|) no matter how long w is, and rows we never visit cost nothing.
+ * Rows of a page or more are page-aligned, so that one can be handed back on its own. */
+
+/* Point rows[0..nRows) into a fresh mapping of *mapBytes. Returns its base, or NULL if there is nothing to map. */
+static void *
+_zeroMapRows(void **rows, int nRows, size_t rowBytes, size_t *stride, size_t *mapBytes)
+{
+  size_t pageBytes = sysconf(_SC_PAGESIZE);
+  char *base;
+  int i;
+
+  *stride = (rowBytes < pageBytes) ? rowBytes : (rowBytes + pageBytes - 1) / pageBytes * pageBytes;
+  *mapBytes = nRows * *stride;
+  if (*mapBytes == 0) {
+    return NULL;
+  }
+
+  base = mmap(NULL, *mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    fatal("out of memory");
+  }
+  for (i = 0; i < nRows; i++) {
+    rows[i] = base + i * *stride;
+  }
+
+  logMsg(LOG_DEBUG, "_zeroMapRows: %d rows of %ld bytes, %ld bytes mapped", nRows, (long) rowBytes, (long) *mapBytes);
+  return base;
+}
+
+/* Give back the pages behind one row. It reads as zeroes afterwards. */
+static void
+_zeroMapReleaseRow(void *row, size_t stride)
+{
+  if (stride % sysconf(_SC_PAGESIZE) == 0) {
+    madvise(row, stride, MADV_DONTNEED);
+  }
+}
+
+/* Zero a row whose first rowBytes may be dirty. A row of its own pages is handed back, which costs
+ * nothing per byte, and its pages come back zeroed only where they are touched again. Shorter rows share
+ * pages with their neighbors, so those we memset. */
+static void
+_zeroMapZeroRow(void *row, size_t rowBytes, size_t stride)
+{
+  if (stride % sysconf(_SC_PAGESIZE) == 0) {
+    _zeroMapReleaseRow(row, stride);
+  } else {
+    memset(row, 0, rowBytes);
+  }
+}
+
+/* Zero the whole mapping by handing back all of its pages */
+static void
+_zeroMapClear(void *base, size_t mapBytes)
+{
+  if (base != NULL) {
+    madvise(base, mapBytes, MADV_DONTNEED);
+  }
+}
+
+static void
+_zeroMapFree(void *base, size_t mapBytes)
+{
+  if (base != NULL) {
+    munmap(base, mapBytes);
+  }
+}
+
+/* Epochs.
+ * A table that outlives one match is cleared by advancing its epoch.
+ * ENCODING_NONE memo cells hold the epoch in which they were marked.
+ * Visit table rows and ENCODING_BITMAP rows have no room for a tag in each cell, so each row carries one,
+ * and a row left over from an earlier epoch is zeroed (_zeroMapZeroRow) when it is first touched in this one. */
+
+/* Before the epoch counter wraps, zero everything and start over */
+#define EPOCH_LAST INT_MAX
+
+/* Visit table.
+ * The counters are cheap and always on. The |Q| x |w| table behind them is for research runs only. */
 
 VisitTable 
 initVisitTable(Prog *prog, int nChars)
 {
   VisitTable visitTable;
-  int nStates = prog->len;
-  int i, j;
+  int nStates = prog->len - prog->nMemoChecks; /* |Q| */
+  int i;
 
   visitTable.nStates = nStates;
   visitTable.nChars = nChars;
-  visitTable.visitVectors = mal(sizeof(int*) * nStates);
-  for (i = 0; i < nStates; i++) {
-    visitTable.visitVectors[i] = mal(sizeof(int) * nChars);
-    for (j = 0; j < nChars; j++) {
-      visitTable.visitVectors[i][j] = 0;
+  visitTable.nTotalVisits = 0;
+  visitTable.visitsPerVertex = mal(sizeof(*visitTable.visitsPerVertex) * nStates);
+  visitTable.epoch = 1;
+
+  visitTable.full = VISIT_TABLE && prog->fullVisitTable;
+  visitTable.nCharsCapacity = nChars;
+  visitTable.visitVectors = NULL;
+  visitTable.map = NULL;
+  visitTable.rowEpochs = NULL;
+  if (visitTable.full) {
+    visitTable.visitVectors = mal(sizeof(int*) * nStates);
+    visitTable.map = _zeroMapRows((void **) visitTable.visitVectors, nStates, sizeof(int) * nChars, &visitTable.rowStride, &visitTable.mapBytes);
+
+    /* Fresh rows are already zero */
+    visitTable.rowEpochs = mal(sizeof(*visitTable.rowEpochs) * nStates);
+    for (i = 0; i < nStates; i++) {
+      visitTable.rowEpochs[i] = visitTable.epoch;
     }
   }
 
@@ -205,9 +443,54 @@ initVisitTable(Prog *prog, int nChars)
 }
 
 void
-markVisit(VisitTable *visitTable, int statenum, int woffset)
+VisitTable_reuse(VisitTable *visitTable, Prog *prog, int nChars)
+{
+  int i;
+
+  if (visitTable->epoch == 0 || visitTable->nStates != prog->len - prog->nMemoChecks
+   || visitTable->full != (VISIT_TABLE && prog->fullVisitTable)
+   || (visitTable->full && visitTable->nCharsCapacity < nChars)) {
+    if (visitTable->epoch != 0) {
+      logMsg(LOG_DEBUG, "VisitTable_reuse: rebuilding (capacity %d chars, need %d)", visitTable->nCharsCapacity, nChars);
+      freeVisitTable(*visitTable);
+    }
+    *visitTable = initVisitTable(prog, nChars);
+    return;
+  }
+
+  visitTable->nChars = nChars;
+  visitTable->nTotalVisits = 0;
+  memset(visitTable->visitsPerVertex, 0, sizeof(*visitTable->visitsPerVertex) * visitTable->nStates);
+
+  if (visitTable->full && visitTable->epoch == EPOCH_LAST) {
+    _zeroMapClear(visitTable->map, visitTable->mapBytes);
+    visitTable->epoch = 0;
+    for (i = 0; i < visitTable->nStates; i++) {
+      visitTable->rowEpochs[i] = 1;
+    }
+  }
+  visitTable->epoch++;
+}
+
+int
+VisitTable_get(VisitTable *visitTable, int statenum, int woffset)
+{
+  assert(visitTable->full);
+  if (visitTable->rowEpochs[statenum] != visitTable->epoch) {
+    return 0;
+  }
+  return visitTable->visitVectors[statenum][woffset];
+}
+
+void
+VisitTable_markFull(VisitTable *visitTable, int statenum, int woffset)
 {
   logMsg(LOG_VERBOSE, "Visit: Visiting <%d, %d>", statenum, woffset);
+
+  if (visitTable->rowEpochs[statenum] != visitTable->epoch) {
+    _zeroMapZeroRow(visitTable->visitVectors[statenum], sizeof(int) * visitTable->nChars, visitTable->rowStride);
+    visitTable->rowEpochs[statenum] = visitTable->epoch;
+  }
   
   if (visitTable->visitVectors[statenum][woffset] > 0)
     logMsg(LOG_WARN, "Hmm, already visited <%d, %d>", statenum, woffset);
@@ -221,15 +504,449 @@ markVisit(VisitTable *visitTable, int statenum, int woffset)
 void
 freeVisitTable(VisitTable vt)
 {
-  int i;
-  for (i = 0; i < vt.nStates; i++) {
-    free(vt.visitVectors[i]);
+  free(vt.visitsPerVertex);
+  if (vt.full) {
+    _zeroMapFree(vt.map, vt.mapBytes);
+    free(vt.visitVectors);
+    free(vt.rowEpochs);
   }
-  free(vt.visitVectors);
 }
 
 /* Memo table */
 
+/* ENCODING_BITMAP: one bit per <q, i>, packed into 64-bit words. */
+#define BITMAP_BITS_PER_WORD MEMO_BITMAP_BITS_PER_WORD
+#define BITMAP_NWORDS(nBits) ( ((nBits) + BITMAP_BITS_PER_WORD - 1) / BITMAP_BITS_PER_WORD )
+#define BITMAP_WORD(ix) ( (ix) / BITMAP_BITS_PER_WORD )
+#define BITMAP_MASK(ix) ( ((uint64_t) 1) << ((ix) % BITMAP_BITS_PER_WORD) )
+
+static inline int
+_bitmapTest(uint64_t *vec, int ix)
+{
+  return (vec[BITMAP_WORD(ix)] & BITMAP_MASK(ix)) != 0;
+}
+
+/* Set bit ix. Returns its previous value. */
+static inline int
+_bitmapTestAndSet(uint64_t *vec, int ix)
+{
+  uint64_t *word = &vec[BITMAP_WORD(ix)];
+  uint64_t mask = BITMAP_MASK(ix);
+  int wasSet = (*word & mask) != 0;
+
+  *word |= mask;
+  return wasSet;
+}
+
+/* ENCODING_ADAPTIVE: promote a state once its runs cost more than a bitmap would */
+#define ADAPTIVE_SHOULD_PROMOTE(memo, vec) ( RLEVector_maxBytes(vec) > (memo)->nWordsPerVector * sizeof(uint64_t) )
+
+/* Replace the state's RLE vector with an equivalent bitmap */
+static void
+_adaptivePromote(Memo *memo, int statenum)
+{
+  RLEVector *vec = memo->rleVectors[statenum];
+  uint64_t *bits = mal(sizeof(uint64_t) * BITMAP_NWORDS(memo->nCharsCapacity)); /* So Memo_reuse can keep it */
+  int i;
+
+  logMsg(LOG_DEBUG, "ADAPTIVE: promoting memo state %d to a bitmap (%d runs, %d bytes > %ld bytes)",
+    statenum, RLEVector_currSize(vec), RLEVector_maxBytes(vec), memo->nWordsPerVector * sizeof(uint64_t));
+
+  /* The finger makes this walk O(|w|) */
+  for (i = 0; i < memo->nChars; i++) {
+    if (RLEVector_get(vec, i)) {
+      _bitmapTestAndSet(bits, i);
+    }
+  }
+
+  memo->adaptiveSparseBytes[statenum] = RLEVector_maxBytes(vec);
+  memo->nAdaptivePromotions++;
+  /* A whole bitmap at once: measure right after this mark */
+  memo->nBudgetMarks += MEMO_BUDGET_CHECK_INTERVAL;
+  RLEVector_destroy(vec);
+  memo->rleVectors[statenum] = NULL;
+  memo->bitVectors[statenum] = bits;
+}
+
+/* Sliding window: NONE and BITMAP rows are stored in lazily-allocated blocks */
+static void
+_windowInit(Memo *memo, int blockBytes)
+{
+  int i;
+
+  memo->windowBlockBytes = blockBytes;
+  memo->nWindowBlocks = (memo->nChars + memo->windowBlockSize - 1) / memo->windowBlockSize;
+  memo->windowFreeBlocks = NULL;
+  memo->windowNFreeBlocks = 0;
+
+  /* mal zeroes: no blocks yet */
+  memo->windowBlocks = mal(sizeof(*memo->windowBlocks) * memo->nStates);
+  for (i = 0; i < memo->nStates; i++) {
+    memo->windowBlocks[i] = mal(sizeof(*memo->windowBlocks[i]) * memo->nWindowBlocks);
+  }
+  memo->windowLiveBlocks = mal(sizeof(*memo->windowLiveBlocks) * memo->nStates);
+  memo->windowPeakBlocks = mal(sizeof(*memo->windowPeakBlocks) * memo->nStates);
+
+  logMsg(LOG_INFO, "MEMO_TABLE: windowed, %d blocks of %d offsets (%d bytes) per state",
+    memo->nWindowBlocks, memo->windowBlockSize, memo->windowBlockBytes);
+}
+
+/* The block holding <q, i>, or NULL if it was never touched. With create, allocates it. */
+static inline void *
+_windowBlock(Memo *memo, int statenum, int woffset, int create)
+{
+  int b = woffset / memo->windowBlockSize;
+  void **slot = &memo->windowBlocks[statenum][b];
+
+  /* Memo_slideWindow was promised we would never come back here */
+  assert(b >= memo->windowLowBlock);
+
+  if (*slot == NULL && create) {
+    if (memo->windowFreeBlocks != NULL) {
+      *slot = memo->windowFreeBlocks;
+      memo->windowFreeBlocks = *(void **) *slot;
+      memo->windowNFreeBlocks--;
+      memset(*slot, 0, memo->windowBlockBytes);
+    } else {
+      *slot = mal(memo->windowBlockBytes);
+      /* A whole block at once: measure right after this mark */
+      memo->nBudgetMarks += MEMO_BUDGET_CHECK_INTERVAL;
+    }
+
+    memo->windowLiveBlocks[statenum]++;
+    if (memo->windowPeakBlocks[statenum] < memo->windowLiveBlocks[statenum]) {
+      memo->windowPeakBlocks[statenum] = memo->windowLiveBlocks[statenum];
+    }
+  }
+  return *slot;
+}
+
+/* Memory budget */
+
+/* The next narrower vertex selection. Each keeps a subset of the one before. */
+static int
+_budgetNextMode(int mode)
+{
+  switch (mode) {
+  case MEMO_FULL: return MEMO_IN_DEGREE_GT1;
+  case MEMO_IN_DEGREE_GT1: return MEMO_LOOP_DEST;
+  default: return MEMO_NONE;
+  }
+}
+
+/* Never past budgetFloorMode: narrower than that, backtracking is exponential again */
+static inline int
+_budgetCanNarrow(Memo *memo)
+{
+  return memo->budgetMode != MEMO_NONE && memo->budgetMode < memo->budgetFloorMode;
+}
+
+/* Still over budget, but narrowing will not help. Keep memoizing, and say so in the stats.
+ * Each attempt to get back under budget costs a pass over the table, so wait until it doubles. */
+static void
+_budgetExhausted(Memo *memo, long bytes)
+{
+  if (!memo->budgetExhausted) {
+    logMsg(LOG_WARN, "MEMO_TABLE: %ld bytes exceeds the budget of %ld, and narrowing further will not help -- budget exhausted", bytes, memo->budgetBytes);
+  }
+  memo->budgetExhausted = 1;
+  memo->budgetRetryBytes = 2 * bytes;
+}
+
+/* Selections narrow in enum order, so a state survives any selection up to its narrowest */
+static inline int
+_budgetKeeps(Memo *memo, int statenum, int mode)
+{
+  return mode != MEMO_NONE && memo->budgetNarrowestMode[statenum] >= mode;
+}
+
+/* Record what state q cost so far, then release its storage. Never marked again. */
+static void
+_budgetDropState(Memo *memo, int statenum)
+{
+  int asymptoticCost = 0, bytes = 0, b;
+
+  switch (memo->encoding) {
+  case ENCODING_NONE:
+  case ENCODING_BITMAP:
+    if (memo->windowed) {
+      asymptoticCost = memo->windowPeakBlocks[statenum] * memo->windowBlockSize;
+      bytes = memo->windowPeakBlocks[statenum] * memo->windowBlockBytes + memo->nWindowBlocks * sizeof(void *);
+      for (b = 0; b < memo->nWindowBlocks; b++) {
+        free(memo->windowBlocks[statenum][b]);
+        memo->windowBlocks[statenum][b] = NULL;
+      }
+      memo->windowLiveBlocks[statenum] = 0;
+    } else if (memo->encoding == ENCODING_NONE && memo->visitVectors[statenum] != NULL) {
+      asymptoticCost = memo->nChars;
+      bytes = memo->nChars * sizeof(int);
+      _zeroMapReleaseRow(memo->visitVectors[statenum], memo->rowStride);
+      memo->visitVectors[statenum] = NULL;
+    } else if (memo->encoding == ENCODING_BITMAP && memo->bitVectors[statenum] != NULL) {
+      asymptoticCost = memo->nChars;
+      bytes = memo->nWordsPerVector * sizeof(uint64_t);
+      _zeroMapReleaseRow(memo->bitVectors[statenum], memo->rowStride);
+      memo->bitVectors[statenum] = NULL;
+    }
+    break;
+  case ENCODING_NEGATIVE:
+    /* Its keys share one table; _budgetNarrow filters them out */
+    break;
+  case ENCODING_ADAPTIVE:
+    if (memo->bitVectors[statenum] != NULL) {
+      asymptoticCost = memo->nChars;
+      bytes = memo->nWordsPerVector * sizeof(uint64_t);
+      if (memo->adaptiveSparseBytes[statenum] > bytes) {
+        bytes = memo->adaptiveSparseBytes[statenum];
+      }
+      free(memo->bitVectors[statenum]);
+      memo->bitVectors[statenum] = NULL;
+      break;
+    }
+    /* Fall through */
+  case ENCODING_RLE:
+  case ENCODING_RLE_TUNED:
+    asymptoticCost = RLEVector_maxObservedSize(memo->rleVectors[statenum]);
+    bytes = RLEVector_maxBytes(memo->rleVectors[statenum]);
+    RLEVector_destroy(memo->rleVectors[statenum]);
+    memo->rleVectors[statenum] = NULL;
+    break;
+  default:
+    assert(!"_budgetDropState: Unexpected encoding");
+  }
+
+  memo->budgetDropped[statenum] = 1;
+  memo->budgetDroppedAsymptoticCost[statenum] = asymptoticCost;
+  memo->budgetDroppedBytes[statenum] = bytes;
+}
+
+static int
+_simPosKeyIsUndropped(const int *key, void *memo)
+{
+  return !((Memo *) memo)->budgetDropped[key[0]];
+}
+
+static int
+_simPosKeyIsLive(const int *key, void *memo)
+{
+  return key[1] >= ((Memo *) memo)->lowWater;
+}
+
+/* Narrow the vertex selection one step, releasing the states that fall out of it */
+static void
+_budgetNarrow(Memo *memo)
+{
+  int q, nDropped = 0;
+
+  memo->budgetMode = _budgetNextMode(memo->budgetMode);
+  memo->nBudgetNarrowings++;
+  for (q = 0; q < memo->nStates; q++) {
+    if (!memo->budgetDropped[q] && !_budgetKeeps(memo, q, memo->budgetMode)) {
+      _budgetDropState(memo, q);
+      nDropped++;
+    }
+  }
+  if (memo->encoding == ENCODING_NEGATIVE) {
+    SimPosTable_filter(memo->simPosTable, _simPosKeyIsUndropped, memo);
+  }
+
+  logMsg(LOG_INFO, "MEMO_TABLE: over budget -- narrowed vertex selection to mode %d, dropping %d states", memo->budgetMode, nDropped);
+}
+
+/* Discard the entries no query will reach again */
+static void
+_budgetEvict(Memo *memo)
+{
+  int q;
+
+  logMsg(LOG_INFO, "MEMO_TABLE: over budget -- evicting entries below offset %d", memo->lowWater);
+  memo->nBudgetEvictions++;
+  switch (memo->encoding) {
+  case ENCODING_NONE:
+  case ENCODING_BITMAP:
+    /* Windowed: the window already evicts. Give back the blocks cached for reuse.
+     * Otherwise the rows were allocated up front, and there is nothing to reclaim short of narrowing. */
+    while (memo->windowed && memo->windowFreeBlocks != NULL) {
+      void *block = memo->windowFreeBlocks;
+      memo->windowFreeBlocks = *(void **) block;
+      memo->windowNFreeBlocks--;
+      free(block);
+    }
+    break;
+  case ENCODING_NEGATIVE:
+    SimPosTable_filter(memo->simPosTable, _simPosKeyIsLive, memo);
+    break;
+  case ENCODING_RLE:
+  case ENCODING_RLE_TUNED:
+  case ENCODING_ADAPTIVE:
+    /* Bitmaps (ADAPTIVE) are all-or-nothing, but runs can go */
+    for (q = 0; q < memo->nStates; q++) {
+      if (memo->rleVectors[q] != NULL) {
+        RLEVector_trimBelow(memo->rleVectors[q], memo->lowWater);
+      }
+    }
+    break;
+  default:
+    assert(!"_budgetEvict: Unexpected encoding");
+  }
+}
+
+/* Back under budget: evict, then narrow until it fits.
+ * If LOOP does not fit, or a narrowing frees nothing, the budget is exhausted. */
+static void
+_budgetEnforce(Memo *memo)
+{
+  long bytes = Memo_bytes(memo), before;
+
+  memo->nBudgetMarks = 0;
+  if (memo->budgetPeakBytes < bytes) {
+    memo->budgetPeakBytes = bytes;
+  }
+  if (bytes <= memo->budgetBytes || bytes < memo->budgetRetryBytes) {
+    return;
+  }
+
+  logMsg(LOG_INFO, "MEMO_TABLE: %ld bytes exceeds the budget of %ld", bytes, memo->budgetBytes);
+  /* Nothing new has gone cold since the last eviction? Then go straight to narrowing */
+  if (memo->lowWater > memo->budgetEvictedBelow) {
+    _budgetEvict(memo);
+    memo->budgetEvictedBelow = memo->lowWater;
+    bytes = Memo_bytes(memo);
+  }
+  while (bytes > memo->budgetBytes && _budgetCanNarrow(memo)) {
+    before = bytes;
+    _budgetNarrow(memo);
+    bytes = Memo_bytes(memo);
+    if (bytes >= before) {
+      break;
+    }
+  }
+  logMsg(LOG_INFO, "MEMO_TABLE: now %ld bytes", bytes);
+  if (bytes > memo->budgetBytes) {
+    _budgetExhausted(memo, bytes);
+  }
+}
+
+/* Learn each state's narrowest selection. Call before allocating rows, so that
+ * if the rows allocated up front by NONE and BITMAP would not fit, we never allocate them. */
+static void
+_budgetInit(Memo *memo, Prog *prog, long rowBytes)
+{
+  int i, nLive;
+
+  memo->budgetPeakBytes = 0;
+  memo->budgetMode = memo->mode;
+  memo->nBudgetMarks = 0;
+  memo->nBudgetEvictions = 0;
+  memo->budgetEvictedBelow = 0;
+  memo->nBudgetNarrowings = 0;
+  memo->budgetExhausted = 0;
+  memo->budgetRetryBytes = 0;
+  /* Bounded repetition, expanded or counted, nests choices that no loop encloses, and LOOP memoizes none of them:
+   * it is exponential on (?:(?:a{,10}){,10}){,10}$. INDEG still memoizes their joins. */
+  memo->budgetFloorMode = prog->hasCurlies ? MEMO_IN_DEGREE_GT1 : MEMO_LOOP_DEST;
+  memo->budgetNarrowestMode = mal(sizeof(*memo->budgetNarrowestMode) * memo->nStates);
+  memo->budgetDropped = mal(sizeof(*memo->budgetDropped) * memo->nStates);
+  memo->budgetDroppedAsymptoticCost = mal(sizeof(*memo->budgetDroppedAsymptoticCost) * memo->nStates);
+  memo->budgetDroppedBytes = mal(sizeof(*memo->budgetDroppedBytes) * memo->nStates);
+
+  /* Prog_determineMemoNodes left inDegree and isAncestorLoopDestination on the selected vertices */
+  for (i = 0; i < prog->len - prog->nMemoChecks; i++) {
+    InstInfoForMemoSelPolicy *info = &prog->info[i].memoInfo;
+    if (info->shouldMemo) {
+      memo->budgetNarrowestMode[info->memoStateNum] =
+        info->isAncestorLoopDestination ? MEMO_LOOP_DEST
+        : (info->inDegree > 1) ? MEMO_IN_DEGREE_GT1
+        : MEMO_FULL;
+    }
+  }
+
+  /* Rows allocated up front */
+  nLive = memo->nStates;
+  while (nLive * rowBytes > memo->budgetBytes && _budgetCanNarrow(memo)) {
+    _budgetNarrow(memo);
+    for (i = 0, nLive = 0; i < memo->nStates; i++) {
+      nLive += !memo->budgetDropped[i];
+    }
+  }
+  if (nLive * rowBytes > memo->budgetBytes) {
+    _budgetExhausted(memo, nLive * rowBytes);
+  }
+  logMsg(LOG_INFO, "MEMO_TABLE: budget of %ld bytes, starting with mode %d", memo->budgetBytes, memo->budgetMode);
+}
+
+long
+Memo_bytes(Memo *memo)
+{
+  long bytes = 0;
+  int q;
+
+  if (memo->mode == MEMO_NONE) {
+    return 0;
+  }
+
+  switch (memo->encoding) {
+  case ENCODING_NONE:
+  case ENCODING_BITMAP:
+    if (memo->windowed) {
+      bytes = memo->windowNFreeBlocks * memo->windowBlockBytes;
+      for (q = 0; q < memo->nStates; q++) {
+        bytes += memo->windowLiveBlocks[q] * memo->windowBlockBytes + memo->nWindowBlocks * sizeof(void *);
+      }
+    } else {
+      long rowBytes = (memo->encoding == ENCODING_NONE) ? memo->nChars * sizeof(int) : memo->nWordsPerVector * sizeof(uint64_t);
+      void **rows = (memo->encoding == ENCODING_NONE) ? (void **) memo->visitVectors : (void **) memo->bitVectors;
+      for (q = 0; q < memo->nStates; q++) {
+        bytes += sizeof(void *) + (rows[q] != NULL ? rowBytes : 0);
+      }
+    }
+    break;
+  case ENCODING_NEGATIVE:
+    bytes = SimPosTable_overheadBytes(memo->simPosTable)
+      + (long) SimPosTable_count(memo->simPosTable) * SimPosTable_bytesPerEntry(memo->simPosTable);
+    break;
+  case ENCODING_RLE:
+  case ENCODING_RLE_TUNED:
+  case ENCODING_ADAPTIVE:
+    for (q = 0; q < memo->nStates; q++) {
+      bytes += sizeof(RLEVector *);
+      if (memo->rleVectors[q] != NULL) {
+        bytes += RLEVector_currBytes(memo->rleVectors[q]);
+      }
+      if (memo->encoding == ENCODING_ADAPTIVE) {
+        bytes += sizeof(uint64_t *) + (memo->bitVectors[q] != NULL ? memo->nWordsPerVector * sizeof(uint64_t) : 0);
+      }
+    }
+    break;
+  default:
+    assert(!"Memo_bytes: Unexpected encoding");
+  }
+
+  return bytes;
+}
+
+/* Each state keys on the counters of the loops around it */
+static void
+_counterMasksInit(Memo *memo, Prog *prog)
+{
+  int i;
+  for (i = 0; i < prog->len - prog->nMemoChecks; i++) {
+    if (prog->info[i].memoInfo.memoStateNum >= 0)
+      memo->counterMasks[ prog->info[i].memoInfo.memoStateNum ] = prog->info[i].memoInfo.counterMask;
+  }
+}
+
+/* Run length for the RLE vector of prog state j */
+static int
+_rleVisitInterval(Memo *memo, Prog *prog, int j)
+{
+  int visitInterval = (memo->encoding == ENCODING_RLE_TUNED) ? prog->info[j].memoInfo.visitInterval : 1;
+  if (visitInterval < 1)
+    visitInterval = 1;
+  //visitInterval = 60;
+  return visitInterval;
+}
+
 Memo
 initMemoTable(Prog *prog, int nChars)
 {
@@ -244,12 +961,44 @@ initMemoTable(Prog *prog, int nChars)
     prog->memoEncoding = ENCODING_NEGATIVE;
     //assert(prog->memoEncoding == ENCODING_NEGATIVE);
   }
+  if (usesCountedLoops(prog) && prog->memoMode != MEMO_NONE) {
+    /* Same story: the counters are part of the key */
+    logMsg(LOG_INFO, "Counted loops present and memo enabled -- coercing to ENCODING_NEGATIVE");
+    prog->memoEncoding = ENCODING_NEGATIVE;
+  }
 
   memo.mode = prog->memoMode;
   memo.encoding = prog->memoEncoding;
   memo.nStates = nStatesToTrack;
   memo.nChars = nChars;
+  memo.nCharsCapacity = nChars;
+  memo.epoch = 1; /* Fresh cells are zero, so unmarked */
+  memo.rowEpochs = NULL;
   memo.backrefs = usesBackreferences(prog);
+  memo.nCounters = (prog->memoMode != MEMO_NONE) ? prog->nCounters : 0;
+  memo.counterMasks = NULL;
+
+  memo.windowed = 0;
+  memo.windowBlockSize = prog->memoWindow;
+  memo.windowLowBlock = 0;
+  memo.lowWater = 0;
+
+  memo.budgetBytes = (memo.mode != MEMO_NONE) ? prog->memoBudget : 0;
+  memo.budgetDropped = NULL;
+  memo.nBudgetMarks = 0;
+  if (prog->memoWindow > 0 && memo.mode != MEMO_NONE) {
+    switch (memo.encoding) {
+    case ENCODING_NONE:
+    case ENCODING_BITMAP:
+    case ENCODING_RLE:
+    case ENCODING_RLE_TUNED:
+      assert(memo.windowBlockSize % 64 == 0);
+      memo.windowed = 1;
+      break;
+    default:
+      logMsg(LOG_INFO, "%s: No sliding window for encoding %d -- keeping the whole table", prefix, memo.encoding);
+    }
+  }
 
   if (memo.backrefs) {
     /* Create CG <-> Memo Ix mappings for accessing the table later */
@@ -261,6 +1010,11 @@ initMemoTable(Prog *prog, int nChars)
       logMsg(LOG_DEBUG, "CG num %d memo %d", CG_BR[i], i);
     }
   }
+
+  if (memo.nCounters > 0) {
+    memo.counterMasks = mal(sizeof(*memo.counterMasks) * nStatesToTrack);
+    _counterMasksInit(&memo, prog);
+  }
   
   if (memo.mode != MEMO_NONE) {
     switch(memo.encoding){
@@ -269,20 +1023,79 @@ initMemoTable(Prog *prog, int nChars)
       logMsg(LOG_INFO, "%s: Initializing with encoding NONE", prefix);
       logMsg(LOG_INFO, "%s: cardQ = %d, Phi_memo = %d", prefix, cardQ, nStatesToTrack);
 
+      if (memo.windowed) {
+        _windowInit(&memo, sizeof(int) * memo.windowBlockSize);
+        break;
+      }
+
       /* Visit vectors */
       memo.visitVectors = mal(sizeof(*memo.visitVectors) * nStatesToTrack);
+      if (memo.budgetBytes > 0) {
+        _budgetInit(&memo, prog, sizeof(int) * nChars);
+      }
 
       logMsg(LOG_INFO, "%s: %d visit vectors x %d chars for each", prefix, nStatesToTrack, nChars);
+      memo.rowMap = _zeroMapRows((void **) memo.visitVectors, nStatesToTrack, sizeof(int) * nChars, &memo.rowStride, &memo.rowMapBytes);
+      for (i = 0; i < nStatesToTrack; i++) {
+        if (memo.budgetDropped != NULL && memo.budgetDropped[i]) {
+          memo.visitVectors[i] = NULL;
+        }
+      }
+      break;
+    case ENCODING_BITMAP:
+      assert(!memo.backrefs);
+      logMsg(LOG_INFO, "%s: Initializing with encoding BITMAP", prefix);
+      logMsg(LOG_INFO, "%s: cardQ = %d, Phi_memo = %d", prefix, cardQ, nStatesToTrack);
+
+      if (memo.windowed) {
+        _windowInit(&memo, sizeof(uint64_t) * BITMAP_NWORDS(memo.windowBlockSize));
+        break;
+      }
+
+      /* Bit vectors -- demand-zero */
+      memo.nWordsPerVector = BITMAP_NWORDS(nChars);
+      memo.bitVectors = mal(sizeof(*memo.bitVectors) * nStatesToTrack);
+      if (memo.budgetBytes > 0) {
+        _budgetInit(&memo, prog, sizeof(uint64_t) * memo.nWordsPerVector);
+      }
+
+      logMsg(LOG_INFO, "%s: %d bit vectors x %d words for each", prefix, nStatesToTrack, memo.nWordsPerVector);
+      memo.rowMap = _zeroMapRows((void **) memo.bitVectors, nStatesToTrack, sizeof(uint64_t) * memo.nWordsPerVector, &memo.rowStride, &memo.rowMapBytes);
+      memo.rowEpochs = mal(sizeof(*memo.rowEpochs) * nStatesToTrack);
+      for (i = 0; i < nStatesToTrack; i++) {
+        memo.rowEpochs[i] = memo.epoch;
+        if (memo.budgetDropped != NULL && memo.budgetDropped[i]) {
+          memo.bitVectors[i] = NULL;
+        }
+      }
+      break;
+    case ENCODING_ADAPTIVE:
+      assert(!memo.backrefs);
+      logMsg(LOG_INFO, "%s: Initializing with encoding ADAPTIVE", prefix);
+
+      /* Every state starts as an RLE vector. bitVectors[q] is set once q is promoted. */
+      memo.nWordsPerVector = BITMAP_NWORDS(nChars);
+      memo.rleVectors = mal(sizeof(*memo.rleVectors) * nStatesToTrack);
+      memo.bitVectors = mal(sizeof(*memo.bitVectors) * nStatesToTrack);
+      memo.adaptiveSparseBytes = mal(sizeof(*memo.adaptiveSparseBytes) * nStatesToTrack);
+      memo.nAdaptivePromotions = 0;
       for (i = 0; i < nStatesToTrack; i++) {
-        memo.visitVectors[i] = mal(sizeof(int) * nChars);
-        for (j = 0; j < nChars; j++) {
-          memo.visitVectors[i][j] = 0;
+        memo.rleVectors[i] = RLEVector_create(1, 0 /* Do not auto-validate */);
+        memo.bitVectors[i] = NULL;
+        /* On short inputs, even an empty RLE vector outweighs a bitmap */
+        if (ADAPTIVE_SHOULD_PROMOTE(&memo, memo.rleVectors[i])) {
+          _adaptivePromote(&memo, i);
         }
       }
+      logMsg(LOG_INFO, "%s: %d of %d states start out dense", prefix, memo.nAdaptivePromotions, nStatesToTrack);
       break;
     case ENCODING_NEGATIVE:
       logMsg(LOG_INFO, "%s: Initializing with encoding NEGATIVE", prefix);
-      memo.simPosTable = NULL;
+      memo.simPosKeyLen = (memo.backrefs ? 2 + 2*nCG_BR : 2) + memo.nCounters;
+      /* With a budget, leave most of it for the entries */
+      memo.simPosTable = (memo.budgetBytes > 0)
+        ? SimPosTable_createWithin(memo.simPosKeyLen, memo.budgetBytes / 4)
+        : SimPosTable_create(memo.simPosKeyLen);
       break;
     case ENCODING_RLE:
     case ENCODING_RLE_TUNED:
@@ -298,13 +1111,10 @@ initMemoTable(Prog *prog, int nChars)
       j = -1;
       for (i = 0; i < nStatesToTrack; i++) {
         /* Find the corresponding states so we know the run lengths to use */
-        while (j < prog->len) {
+        while (j < prog->len - prog->nMemoChecks) {
           j++;
-          if (prog->start[j].memoInfo.shouldMemo) {
-            int visitInterval = (memo.encoding == ENCODING_RLE_TUNED) ? prog->start[j].memoInfo.visitInterval : 1;
-            if (visitInterval < 1)
-              visitInterval = 1;
-            //visitInterval = 60;
+          if (prog->info[j].memoInfo.shouldMemo) {
+            int visitInterval = _rleVisitInterval(&memo, prog, j);
             logMsg(LOG_INFO, "%s: state %d (memo state %d) will use visitInterval %d", prefix, j, i, visitInterval);
             memo.rleVectors[i] = RLEVector_create(visitInterval, 0 /* Do not auto-validate */);
             break;
@@ -316,117 +1126,419 @@ initMemoTable(Prog *prog, int nChars)
       logMsg(LOG_INFO, "%s: Unexpected encoding %d", prefix, memo.encoding);
       assert(0);
     }
+
+    if (memo.budgetBytes > 0) {
+      /* The other encodings start out small, and grow as we mark */
+      if (memo.budgetDropped == NULL) {
+        _budgetInit(&memo, prog, 0);
+      }
+      _budgetEnforce(&memo);
+    }
   }
 
   logMsg(LOG_INFO, "%s: initialized", prefix);
   return memo;
 }
 
+/* Build the SimPosTable key for <q, i> (plus the CG vector, with backrefs; plus the counters, with counted loops).
+ * key must have room for SIMPOS_MAX_KEYLEN ints. */
+static void
+_simPosKey(Memo *memo, int statenum, int woffset, Sub *sub, int *key)
+{
+  key[0] = statenum;
+  key[1] = woffset;
+
+  if (memo->backrefs) {
+    int *cgStarts = key + 2, *cgEnds = key + 2 + nCG_BR;
+    char printStr[256];
+    int cgIx;
+
+    printStr[0] = '\0';
+    sprintf(printStr + strlen(printStr), "_simPosKey: < <%d, %d> -> [", statenum, woffset);
+    for (cgIx = 0; cgIx < nCG_BR; cgIx++) {
+      logMsg(LOG_DEBUG, "cgIx %d CG%d startp %p start %p", cgIx, CG_BR_memo2num[cgIx], MEMOCGID_TO_STARTP(sub, cgIx), sub->start);
+      if (isgroupset(sub, CG_BR_memo2num[cgIx])) {
+        cgStarts[cgIx] = (int) (MEMOCGID_TO_STARTP(sub, cgIx) - sub->start);
+        cgEnds[cgIx] = (int) (MEMOCGID_TO_ENDP(sub, cgIx) - sub->start);
+      } else {
+        cgStarts[cgIx] = 0;
+        cgEnds[cgIx] = 0;
+      }
+      sprintf(printStr + strlen(printStr), "CG%d (%d, %d), ", CG_BR_memo2num[cgIx], cgStarts[cgIx], cgEnds[cgIx]);
+    }
+    sprintf(printStr + strlen(printStr), "]");
+    logMsg(LOG_DEBUG, "%s", printStr);
+
+    /* Sanity check */
+    for (cgIx = 0; cgIx < nCG_BR; cgIx++) {
+      assert(0 <= cgStarts[cgIx]);
+      assert(cgStarts[cgIx] <= cgEnds[cgIx]);
+      assert(cgEnds[cgIx] <= strlen(sub->start));
+    }
+  }
+
+  if (memo->nCounters > 0) {
+    /* A loop q is not inside has left a stale count behind (or none yet). Its next RepeatStart zeroes it. */
+    int *counters = key + (memo->backrefs ? 2 + 2*nCG_BR : 2);
+    int k;
+    for (k = 0; k < memo->nCounters; k++) {
+      counters[k] = (memo->counterMasks[statenum] & (1 << k)) ? sub->counter[k] : 0;
+    }
+  }
+}
+
 int
 isMarked(Memo *memo, int statenum /* PC's memoStateNum */, int woffset, Sub *sub)
 {
   logMsg(LOG_VERBOSE, "  isMarked: querying <%d, %d>", statenum, woffset);
 
+  if (memo->budgetDropped != NULL && memo->budgetDropped[statenum]) {
+    return 0;
+  }
+
   switch(memo->encoding){
   default: assert(!"isMarked: Unexpected encoding");
   case ENCODING_NONE:
-    return memo->visitVectors[statenum][woffset] == 1;
+    if (memo->windowed) {
+      int *block = _windowBlock(memo, statenum, woffset, 0);
+      return block != NULL && block[woffset % memo->windowBlockSize] == memo->epoch;
+    }
+    return memo->visitVectors[statenum][woffset] == memo->epoch;
+  case ENCODING_BITMAP:
+    if (memo->windowed) {
+      uint64_t *block = _windowBlock(memo, statenum, woffset, 0);
+      return block != NULL && _bitmapTest(block, woffset % memo->windowBlockSize);
+    }
+    if (memo->rowEpochs[statenum] != memo->epoch) {
+      return 0;
+    }
+    return _bitmapTest(memo->bitVectors[statenum], woffset);
   case ENCODING_NEGATIVE:
   {
-    // Easy to support backreferences in this scheme -- just add more info to the SimPosTable entry
+    // Easy to support backreferences in this scheme -- just add more info to the SimPosTable key
     // For the other schemes we would have to allocate stupendous amounts of memory (NONE) or perhaps be creative (RLE)
-    SimPosTable entry;
-    SimPosTable *p;
-
-    memset(&entry, 0, sizeof(SimPosTable));
-    entry.key.stateNum = statenum;
-    entry.key.stringIndex = woffset;
-    if (memo->backrefs) {
-      char printStr[256];
-      printStr[0] = '\0';
-      sprintf(printStr + strlen(printStr), "isMarked: marking < <%d, %d> -> [", statenum, woffset);
-      int cgIx;
-      for (cgIx = 0; cgIx < nCG_BR; cgIx++) {
-        logMsg(LOG_DEBUG, "cgIx %d CG%d startp %p start %p", cgIx, CG_BR_memo2num[cgIx], MEMOCGID_TO_STARTP(sub, cgIx), sub->start);
-        if (isgroupset(sub, CG_BR_memo2num[cgIx])) {
-          entry.key.cgStarts[cgIx] = (int) (MEMOCGID_TO_STARTP(sub, cgIx) - sub->start);
-          entry.key.cgEnds[cgIx] = (int) (MEMOCGID_TO_ENDP(sub, cgIx) - sub->start);
-        } else {
-          entry.key.cgStarts[cgIx] = 0;
-          entry.key.cgEnds[cgIx] = 0;
-        }
-        sprintf(printStr + strlen(printStr), "CG%d (%d, %d), ", CG_BR_memo2num[cgIx], entry.key.cgStarts[cgIx], entry.key.cgEnds[cgIx]);
-      }
-      sprintf(printStr + strlen(printStr), "]");
-      logMsg(LOG_DEBUG, printStr);
-
-      /* Sanity check */
-      for (cgIx = 0; cgIx < nCG_BR; cgIx++) {
-        assert(0 <= entry.key.cgStarts[cgIx]);
-        assert(entry.key.cgStarts[cgIx] <= entry.key.cgEnds[cgIx]);
-        assert(entry.key.cgEnds[cgIx] <= strlen(sub->start));
-      }
+    int key[SIMPOS_MAX_KEYLEN];
+    _simPosKey(memo, statenum, woffset, sub, key);
+    return SimPosTable_contains(memo->simPosTable, key);
+  }
+  case ENCODING_RLE:
+  case ENCODING_RLE_TUNED:
+    return RLEVector_get(memo->rleVectors[statenum], woffset) != 0;
+  case ENCODING_ADAPTIVE:
+    if (memo->bitVectors[statenum] != NULL) {
+      return _bitmapTest(memo->bitVectors[statenum], woffset);
     }
+    return RLEVector_get(memo->rleVectors[statenum], woffset) != 0;
+  }
+
+  assert(!"Unreachable");
+  return -1;
+}
 
-    HASH_FIND(hh, memo->simPosTable, &entry.key, sizeof(SimPos), p);
-    return p != NULL;
+static inline int
+_testAndMark(Memo *memo, int statenum, int woffset, Sub *sub)
+{
+  switch(memo->encoding) {
+  case ENCODING_NONE:
+  {
+    int wasMarked, *cell;
+    assert(statenum < memo->nStates);
+    assert(woffset < memo->nChars);
+    assert(!memo->backrefs);
+    if (!memo->windowed) {
+      return Memo_testAndMarkArray(memo, statenum, woffset);
+    }
+    cell = &((int *) _windowBlock(memo, statenum, woffset, 1))[woffset % memo->windowBlockSize];
+    wasMarked = (*cell == memo->epoch);
+    *cell = memo->epoch;
+    return wasMarked;
   }
+  case ENCODING_BITMAP:
+    assert(statenum < memo->nStates);
+    assert(woffset < memo->nChars);
+    if (!memo->windowed) {
+      return Memo_testAndMarkBitmap(memo, statenum, woffset);
+    }
+    return _bitmapTestAndSet(_windowBlock(memo, statenum, woffset, 1), woffset % memo->windowBlockSize);
+  case ENCODING_NEGATIVE:
+    if (memo->backrefs || memo->nCounters > 0) {
+      return Memo_testAndMarkHashBackrefs(memo, statenum, woffset, sub);
+    }
+    return Memo_testAndMarkHash(memo, statenum, woffset);
   case ENCODING_RLE:
   case ENCODING_RLE_TUNED:
-    return RLEVector_get(memo->rleVectors[statenum], woffset) != 0;
+    assert(!memo->backrefs);
+    return RLEVector_testAndSet(memo->rleVectors[statenum], woffset);
+  case ENCODING_ADAPTIVE:
+    assert(!memo->backrefs);
+    if (memo->bitVectors[statenum] != NULL) {
+      return _bitmapTestAndSet(memo->bitVectors[statenum], woffset);
+    }
+    if (RLEVector_testAndSet(memo->rleVectors[statenum], woffset)) {
+      return 1;
+    }
+    /* Only a new mark can add runs */
+    if (ADAPTIVE_SHOULD_PROMOTE(memo, memo->rleVectors[statenum])) {
+      _adaptivePromote(memo, statenum);
+    }
+    return 0;
+  default:
+    assert(!"Unknown encoding\n");
   }
 
   assert(!"Unreachable");
   return -1;
 }
 
+int
+Memo_testAndMarkHashBackrefs(Memo *memo, int statenum, int woffset, Sub *sub)
+{
+  int key[SIMPOS_MAX_KEYLEN];
+  _simPosKey(memo, statenum, woffset, sub, key);
+  return SimPosTable_insert(memo->simPosTable, key);
+}
+
+void
+Memo_zeroBitmapRow(Memo *memo, int statenum)
+{
+  _zeroMapZeroRow(memo->bitVectors[statenum], sizeof(uint64_t) * memo->nWordsPerVector, memo->rowStride);
+  memo->rowEpochs[statenum] = memo->epoch;
+}
+
+int
+Memo_kind(Memo *memo)
+{
+  /* No MemoChecks will run, so any kind would do */
+  if (memo->mode == MEMO_NONE) {
+    return MEMO_KIND_ARRAY;
+  }
+  /* Both may move or drop rows mid-match */
+  if (memo->windowed || memo->budgetBytes > 0) {
+    return MEMO_KIND_GENERIC;
+  }
+
+  switch (memo->encoding) {
+  case ENCODING_NONE:
+    return MEMO_KIND_ARRAY;
+  case ENCODING_BITMAP:
+    return MEMO_KIND_BITMAP;
+  case ENCODING_NEGATIVE:
+    return (memo->backrefs || memo->nCounters > 0) ? MEMO_KIND_HASH_BR : MEMO_KIND_HASH;
+  default:
+    /* RLE and ADAPTIVE are out of line anyway */
+    return MEMO_KIND_GENERIC;
+  }
+}
+
+int
+Memo_testAndMark(Memo *memo, int statenum, int woffset, Sub *sub)
+{
+  int wasMarked;
+
+  logMsg(LOG_VERBOSE, "Memo: test-and-mark <%d, %d>", statenum, woffset);
+
+  if (memo->budgetDropped == NULL) {
+    return _testAndMark(memo, statenum, woffset, sub);
+  }
+
+  /* Budgeted */
+  if (memo->budgetDropped[statenum]) {
+    return 0;
+  }
+  wasMarked = _testAndMark(memo, statenum, woffset, sub);
+  if (!wasMarked && ++memo->nBudgetMarks >= MEMO_BUDGET_CHECK_INTERVAL) {
+    _budgetEnforce(memo);
+  }
+  return wasMarked;
+}
+
 void
 markMemo(Memo *memo, int statenum, int woffset, Sub *sub)
 {
   logMsg(LOG_VERBOSE, "Memo: Marking <%d, %d>", statenum, woffset);
 
-  if (isMarked(memo, statenum, woffset, sub)) {
+  if (Memo_testAndMark(memo, statenum, woffset, sub)) {
     logMsg(LOG_WARN, "\n****\n\n   Hmm, already marked s%d c%d\n\n*****\n\n", statenum, woffset);
   }
+}
 
-  switch(memo->encoding) {
+void
+Memo_slideWindow(Memo *memo, int lowWater)
+{
+  int q, b, lowBlock;
+
+  memo->lowWater = lowWater;
+  if (!memo->windowed) {
+    return;
+  }
+  lowBlock = lowWater / memo->windowBlockSize;
+  if (lowBlock <= memo->windowLowBlock) {
+    return;
+  }
+
+  logMsg(LOG_DEBUG, "Memo: window slides from block %d to block %d (low water %d)", memo->windowLowBlock, lowBlock, lowWater);
+  switch (memo->encoding) {
   case ENCODING_NONE:
-    assert(statenum < memo->nStates);
-    assert(woffset < memo->nChars);
-    assert(!memo->backrefs);
-    memo->visitVectors[statenum][woffset] = 1;
-    break;
-  case ENCODING_NEGATIVE:
-  {
-    SimPosTable *entry = mal(sizeof(*entry));
-    memset(entry, 0, sizeof(*entry));
-    entry->key.stateNum = statenum;
-    entry->key.stringIndex = woffset;
-
-    if (memo->backrefs) {
-      int cgIx;
-      for (cgIx = 0; cgIx < nCG_BR; cgIx++) {
-        if (isgroupset(sub, CG_BR_memo2num[cgIx])) {
-          entry->key.cgStarts[cgIx] = (int) (MEMOCGID_TO_STARTP(sub, cgIx) - sub->start);
-          entry->key.cgEnds[cgIx] = (int) (MEMOCGID_TO_ENDP(sub, cgIx) - sub->start);
-        } else {
-          entry->key.cgStarts[cgIx] = 0;
-          entry->key.cgEnds[cgIx] = 0;
+  case ENCODING_BITMAP:
+    /* Recycle the blocks we passed */
+    for (q = 0; q < memo->nStates; q++) {
+      for (b = memo->windowLowBlock; b < lowBlock; b++) {
+        void *block = memo->windowBlocks[q][b];
+        if (block != NULL) {
+          *(void **) block = memo->windowFreeBlocks;
+          memo->windowFreeBlocks = block;
+          memo->windowNFreeBlocks++;
+          memo->windowBlocks[q][b] = NULL;
+          memo->windowLiveBlocks[q]--;
         }
       }
     }
-
-    HASH_ADD(hh, memo->simPosTable, key, sizeof(SimPos), entry);
     break;
-  }
   case ENCODING_RLE:
   case ENCODING_RLE_TUNED:
-    assert(!memo->backrefs);
-    RLEVector_set(memo->rleVectors[statenum], woffset);
+    for (q = 0; q < memo->nStates; q++) {
+      if (memo->rleVectors[q] != NULL) {
+        RLEVector_trimBelow(memo->rleVectors[q], lowBlock * memo->windowBlockSize);
+      }
+    }
     break;
   default:
-    assert(!"Unknown encoding\n");
+    assert(!"Memo_slideWindow: Unexpected encoding");
   }
+
+  memo->windowLowBlock = lowBlock;
+}
+
+/* Rows allocated up front for |w| hold any input up to that long. Tables that grow with use hold any input,
+ * as long as they were laid out for prog the same way. */
+static int
+_memoCanReuse(Memo *memo, Prog *prog, int nChars)
+{
+  int i, j;
+
+  if (memo->mode != prog->memoMode || memo->encoding != prog->memoEncoding || memo->nStates != prog->nMemoizedStates) {
+    return 0;
+  }
+  if (memo->mode == MEMO_NONE) {
+    return 1;
+  }
+  if (memo->windowed || memo->budgetBytes > 0) {
+    return 0;
+  }
+
+  switch (memo->encoding) {
+  case ENCODING_NONE:
+  case ENCODING_BITMAP:
+  case ENCODING_ADAPTIVE:
+    return nChars <= memo->nCharsCapacity;
+  case ENCODING_NEGATIVE:
+    /* Backreference keys follow CG_BR, which only initMemoTable sets up */
+    return !memo->backrefs && !usesBackreferences(prog) && memo->nCounters == prog->nCounters;
+  case ENCODING_RLE:
+  case ENCODING_RLE_TUNED:
+    for (i = 0, j = 0; j < prog->len - prog->nMemoChecks; j++) {
+      if (prog->info[j].memoInfo.shouldMemo
+       && RLEVector_runSize(memo->rleVectors[i++]) != _rleVisitInterval(memo, prog, j)) {
+        return 0;
+      }
+    }
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Memo_reuse for ENCODING_ADAPTIVE. Promoted states keep their bitmaps: they are likely to be dense again. */
+static void
+_adaptiveReuse(Memo *memo)
+{
+  int q;
+
+  memo->nWordsPerVector = BITMAP_NWORDS(memo->nChars);
+  for (q = 0; q < memo->nStates; q++) {
+    if (memo->bitVectors[q] != NULL) {
+      memset(memo->bitVectors[q], 0, sizeof(uint64_t) * memo->nWordsPerVector);
+      continue;
+    }
+    RLEVector_clear(memo->rleVectors[q]);
+    /* As in initMemoTable: on a short input, even an empty RLE vector outweighs a bitmap */
+    if (ADAPTIVE_SHOULD_PROMOTE(memo, memo->rleVectors[q])) {
+      _adaptivePromote(memo, q);
+    }
+  }
+}
+
+void
+Memo_reuse(Memo *memo, Prog *prog, int nChars)
+{
+  int q;
+
+  if (memo->epoch == 0 || !_memoCanReuse(memo, prog, nChars)) {
+    if (memo->epoch != 0) {
+      logMsg(LOG_DEBUG, "Memo_reuse: rebuilding (capacity %d chars, need %d)", memo->nCharsCapacity, nChars);
+      freeMemoTable(*memo);
+    }
+    *memo = initMemoTable(prog, nChars);
+    return;
+  }
+
+  memo->nChars = nChars;
+  if (memo->mode != MEMO_NONE) {
+    switch (memo->encoding) {
+    case ENCODING_BITMAP:
+      memo->nWordsPerVector = BITMAP_NWORDS(nChars);
+      break;
+    case ENCODING_NEGATIVE:
+      SimPosTable_clear(memo->simPosTable);
+      if (memo->nCounters > 0) {
+        _counterMasksInit(memo, prog);
+      }
+      break;
+    case ENCODING_RLE:
+    case ENCODING_RLE_TUNED:
+      for (q = 0; q < memo->nStates; q++) {
+        RLEVector_clear(memo->rleVectors[q]);
+      }
+      break;
+    case ENCODING_ADAPTIVE:
+      _adaptiveReuse(memo);
+      break;
+    }
+  }
+
+  if (memo->epoch == EPOCH_LAST) {
+    logMsg(LOG_DEBUG, "Memo_reuse: epoch wraps, zeroing the table");
+    _zeroMapClear(memo->rowMap, memo->rowMapBytes);
+    memo->epoch = 0;
+    for (q = 0; memo->rowEpochs != NULL && q < memo->nStates; q++) {
+      memo->rowEpochs[q] = 1;
+    }
+  }
+  memo->epoch++;
+}
+
+static void
+_windowFree(Memo *memo)
+{
+  int q, b;
+  void *block = NULL;
+
+  for (q = 0; q < memo->nStates; q++) {
+    for (b = 0; b < memo->nWindowBlocks; b++) {
+      free(memo->windowBlocks[q][b]);
+    }
+    free(memo->windowBlocks[q]);
+  }
+  free(memo->windowBlocks);
+
+  while (memo->windowFreeBlocks != NULL) {
+    block = memo->windowFreeBlocks;
+    memo->windowFreeBlocks = *(void **) block;
+    free(block);
+  }
+
+  free(memo->windowLiveBlocks);
+  free(memo->windowPeakBlocks);
 }
 
 void freeMemoTable(Memo memo)
@@ -438,31 +1550,55 @@ void freeMemoTable(Memo memo)
 
     switch(memo.encoding) {
     case ENCODING_NONE:
-        for (i = 0; i < memo.nStates; i++) {
-            free(memo.visitVectors[i]);
+        if (memo.windowed) {
+            _windowFree(&memo);
+            break;
         }
+        _zeroMapFree(memo.rowMap, memo.rowMapBytes);
         free(memo.visitVectors);
         break;
-    case ENCODING_NEGATIVE:
-    {
-        SimPosTable *n, *tmp = NULL;
-        HASH_ITER(hh, memo.simPosTable, n, tmp) {
-          HASH_DEL(memo.simPosTable, n);
-          free(n);
+    case ENCODING_BITMAP:
+        if (memo.windowed) {
+            _windowFree(&memo);
+            break;
         }
-        HASH_CLEAR(hh, memo.simPosTable);
+        _zeroMapFree(memo.rowMap, memo.rowMapBytes);
+        free(memo.bitVectors);
+        free(memo.rowEpochs);
+        break;
+    case ENCODING_NEGATIVE:
+        SimPosTable_destroy(memo.simPosTable);
         break;
-    }
     case ENCODING_RLE:
+    case ENCODING_RLE_TUNED:
         logMsg(LOG_DEBUG, "Freeing %d vectors", memo.nStates);
         for (i = 0; i < memo.nStates; i++) {
-            RLEVector_destroy(memo.rleVectors[i]);
+            if (memo.rleVectors[i] != NULL)
+                RLEVector_destroy(memo.rleVectors[i]);
         }
         free(memo.rleVectors);
         break;
+    case ENCODING_ADAPTIVE:
+        for (i = 0; i < memo.nStates; i++) {
+            if (memo.rleVectors[i] != NULL)
+                RLEVector_destroy(memo.rleVectors[i]);
+            free(memo.bitVectors[i]);
+        }
+        free(memo.rleVectors);
+        free(memo.bitVectors);
+        free(memo.adaptiveSparseBytes);
+        break;
     default:
         assert(!"free table: Unknown encoding");
     }
+
+    if (memo.budgetDropped != NULL) {
+        free(memo.budgetNarrowestMode);
+        free(memo.budgetDropped);
+        free(memo.budgetDroppedAsymptoticCost);
+        free(memo.budgetDroppedBytes);
+    }
+    free(memo.counterMasks);
 }
 
 static int
@@ -478,14 +1614,14 @@ backrefdCGs(Prog *prog, int *list)
       /* Is it a new CG or one we've already seen? */
       newCG = 1;
       for (j = 0; j < n; j++) {
-        if (pc->cgNum == list[j]) {
+        if (pc->n == list[j]) {
           newCG = 0;
         }
       }
 
       if (newCG) {
-        list[n] = pc->cgNum;
-        logMsg(LOG_DEBUG, "backrefdCGs: CG %d has CGBR ix %d (%d)", pc->cgNum, n, list[n]);
+        list[n] = pc->n;
+        logMsg(LOG_DEBUG, "backrefdCGs: CG %d has CGBR ix %d (%d)", pc->n, n, list[n]);
         n++;
       }
     }
@@ -7,64 +7,138 @@
 
 #include "regexp.h"
 #include "rle.h"
+#include "simpostable.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 /* Memoization-related compilation phase. */
 
+/* Select the vertices to memoize, number them 0 to |Phi_memo|-1, and insert a MemoCheck before each.
+ * Edges into a selected vertex then lead to its MemoCheck. Call once, after Prog_assertNoInfiniteLoops. */
 void Prog_determineMemoNodes(Prog *p, int memoMode);
 
 /* Memoization-related simulation. */
 
 typedef struct VisitTable VisitTable;
 typedef struct Memo Memo;
-typedef struct SimPos SimPos;
-typedef struct SimPosTable SimPosTable;
+
+/* Build with -DVISIT_TABLE=0 to compile the full visit table out. Only the counters remain. */
+#ifndef VISIT_TABLE
+#define VISIT_TABLE 1
+#endif
 
 // Used to evaluate whether memoization guarantees have failed.
 struct VisitTable
 {
-  int **visitVectors; /* Counters */
   int nStates; /* |Q| */
   int nChars;  /* |w| */
-};
+  int epoch; /* 0: never built */
 
-struct SimPos
-{
-    /* Relevant regex engine state: <vertex, w index> */
-	int stateNum;
-	int stringIndex;
-	/* At vertices corresponding to backreferences, also track the CG vector. */
-	int cgStarts[MAXSUB/2];
-	int cgEnds[MAXSUB/2];
-};
+  /* Always kept */
+  long nTotalVisits;
+  int *visitsPerVertex; /* Per state, summed over all offsets */
 
-/* For hashing */
-struct SimPosTable
-{
-	SimPos key;
-	UT_hash_handle hh; /* Makes this structure hashable */
+  /* The full table, one counter per search state <q, i>. Only with Prog.fullVisitTable. */
+  int full;
+  int **visitVectors; /* Counters. Rows are demand-zero slices of map. */
+  void *map;
+  size_t mapBytes;
+  size_t rowStride;
+  int nCharsCapacity; /* The longest input the rows can hold */
+  int *rowEpochs; /* visitVectors[q] is current iff rowEpochs[q] == epoch */
 };
 
+/* ENCODING_NEGATIVE keys: < q, i [, cgStarts, cgEnds ] [, counters ] >.
+ * At vertices corresponding to backreferences, we also track the CG vector.
+ * Inside counted loops, we also track the loops' counters. */
+#define SIMPOS_MAX_KEYLEN (2 + 2*(MAXSUB/2) + MAXCOUNTERS)
+
 /* Declare here so visible for selecting vertices during compilation */
 struct Memo
 {
 	int nStates; /* |Phi| */
 	int nChars;  /* |w| */
+	int nCharsCapacity; /* The longest input the table can hold (see Memo_reuse) */
+	int epoch; /* 0: never built */
 	int mode;
 	int encoding;
 	int backrefs; /* Backrefs present? */
+	int nCounters; /* Counter slots in each key: Prog.nCounters. 0 without counted loops. */
+	int *counterMasks; /* Per state: the counters its key includes (InstInfoForMemoSelPolicy.counterMask) */
 
 	/* Structures for each encoding scheme. */
 
 	/* ENCODING_NONE */
-	int **visitVectors; /* Booleans: visitVector[q][i] */
+	int **visitVectors; /* Marked iff visitVector[q][i] == epoch */
+
+	/* ENCODING_BITMAP */
+	uint64_t **bitVectors; /* Packed booleans: bit i%64 of bitVectors[q][i/64] */
+	int nWordsPerVector;
+
+	/* ENCODING_NONE, ENCODING_BITMAP: rows are demand-zero slices of one mapping, rowStride bytes apart */
+	void *rowMap;
+	size_t rowMapBytes;
+	size_t rowStride;
+	int *rowEpochs; /* ENCODING_BITMAP: bitVectors[q] is current iff rowEpochs[q] == epoch */
 
 	/* ENCODING_NEGATIVE */
 	SimPosTable *simPosTable; /* Tuples: < q, i [, backrefs ] > */
+	int simPosKeyLen; /* 2, plus 2*|CG_BR| with backrefs, plus nCounters */
 
 	/* ENCODING_RLE, ENCODING_RLE_TUNED */
 	RLEVector **rleVectors;
+
+	/* ENCODING_ADAPTIVE: state q uses rleVectors[q] until it is promoted, then bitVectors[q] */
+	int *adaptiveSparseBytes; /* Peak bytes of rleVectors[q], recorded at promotion */
+	int nAdaptivePromotions;
+
+	/* Sliding window (see Memo_slideWindow).
+	 * ENCODING_NONE and ENCODING_BITMAP rows are split into blocks of windowBlockSize offsets,
+	 * allocated on first touch and recycled once the frontier passes them.
+	 * The RLE encodings instead trim their leading runs. */
+	int windowed;
+	int windowBlockSize; /* Offsets per block */
+	int windowLowBlock; /* Blocks below this have been discarded */
+	int nWindowBlocks; /* Per state */
+	int windowBlockBytes;
+	void ***windowBlocks; /* windowBlocks[q][b], or NULL */
+	void *windowFreeBlocks; /* Recycled blocks, linked through their first word */
+	int *windowLiveBlocks; /* Per state */
+	int *windowPeakBlocks; /* Per state, high water mark */
+	int windowNFreeBlocks;
+
+	/* Search offsets below this will not be queried again (see Memo_slideWindow) */
+	int lowWater;
+
+	/* Memory budget (see _budgetEnforce).
+	 * Over budget, we first evict the entries behind lowWater, then narrow the vertex selection
+	 * one step at a time: FULL -> INDEG -> LOOP. Dropped states are never marked.
+	 * We never narrow past budgetFloorMode, nor once narrowing stops freeing anything.
+	 * Then the budget is exhausted: the table outgrows it, but the match stays linear. */
+	long budgetBytes; /* 0: unlimited */
+	long budgetPeakBytes; /* Largest footprint we measured */
+	int budgetMode; /* Vertex selection still in force */
+	int nBudgetMarks; /* New marks since the last check */
+	int nBudgetEvictions;
+	int budgetEvictedBelow; /* lowWater at the last eviction */
+	int nBudgetNarrowings;
+	int budgetFloorMode; /* Narrowest selection we will narrow to: LOOP, or INDEG if the regex had curlies */
+	int budgetExhausted; /* Over budget with nothing left to give up */
+	long budgetRetryBytes; /* Once exhausted, do not try again below this */
+	int *budgetNarrowestMode; /* Per state: the narrowest selection that keeps it */
+	char *budgetDropped; /* Per state: 1 once narrowed away. NULL if unlimited. */
+	int *budgetDroppedAsymptoticCost; /* Per state: its cost when it was dropped */
+	int *budgetDroppedBytes;
 };
 
+/* Default for --window. A multiple of 64, so blocks hold whole bitmap words. */
+#define MEMO_WINDOW_DEFAULT_BLOCK 4096
+
+/* With a budget, measure the table after this many new marks */
+#define MEMO_BUDGET_CHECK_INTERVAL 256
+
 enum /* Memo.mode */
 {
 	MEMO_NONE,
@@ -79,15 +153,119 @@ enum /* Memo.encoding */
 	ENCODING_NEGATIVE,  /* Hash table */
 	ENCODING_RLE,       /* Run-length encoding */
 	ENCODING_RLE_TUNED, /* DO NOT USE -- RLE, tuned for language lengths -- DO NOT USE */
+	ENCODING_BITMAP,    /* Like NONE, but one bit per <q, i> */
+	ENCODING_ADAPTIVE,  /* Per state: RLE, promoted to BITMAP once dense */
 };
 
 VisitTable initVisitTable(Prog *prog, int nChars);
-void markVisit(VisitTable *visitTable, int statenum, int woffset);
+/* Ready visitTable for another match of prog, on an input of nChars.
+ * A zeroed VisitTable is empty. If the rows are long enough, this clears them in O(1); otherwise it rebuilds. */
+void VisitTable_reuse(VisitTable *visitTable, Prog *prog, int nChars);
+/* Visits to <q, i>. Requires the full table. */
+int VisitTable_get(VisitTable *visitTable, int statenum, int woffset);
+void VisitTable_markFull(VisitTable *visitTable, int statenum, int woffset);
+/* Called on every step of the simulation: counters inline, the full table out of line */
+static inline void
+markVisit(VisitTable *visitTable, int statenum, int woffset)
+{
+  visitTable->nTotalVisits++;
+  visitTable->visitsPerVertex[statenum]++;
+#if VISIT_TABLE
+  if (visitTable->full)
+    VisitTable_markFull(visitTable, statenum, woffset);
+#endif
+}
+/* markVisit for n consecutive offsets of one state, from woffset: the run a CharLoop consumed */
+static inline void
+markVisits(VisitTable *visitTable, int statenum, int woffset, int n)
+{
+  visitTable->nTotalVisits += n;
+  visitTable->visitsPerVertex[statenum] += n;
+#if VISIT_TABLE
+  if (visitTable->full) {
+    int i;
+    for (i = 0; i < n; i++)
+      VisitTable_markFull(visitTable, statenum, woffset + i);
+  }
+#endif
+}
 void freeVisitTable(VisitTable vt);
 
 Memo initMemoTable(Prog *prog, int nChars);
+/* Ready memo for another match of prog, on an input of nChars. A zeroed Memo is empty.
+ * NONE and BITMAP tables that are long enough are cleared in O(1) by advancing the epoch.
+ * NEGATIVE and RLE tables are emptied in place, in time proportional to what the last match stored;
+ * ADAPTIVE does both, per state. Windowed and budgeted tables, a longer input, or NEGATIVE keys
+ * with backreferences are rebuilt. */
+void Memo_reuse(Memo *memo, Prog *prog, int nChars);
+/* No query will ever again fall below offset lowWater; reclaim the memo storage behind it.
+ * With a budget, lowWater also tells eviction what is cold. */
+void Memo_slideWindow(Memo *memo, int lowWater);
+/* Bytes the memo table occupies right now */
+long Memo_bytes(Memo *memo);
 int isMarked(Memo *memo, int statenum /* PC's memoStateNum */, int woffset, Sub *sub);
 void markMemo(Memo *memo, int statenum, int woffset, Sub *sub);
+/* Mark <q, i> and return whether it was already marked. One probe, for the simulation's hot path. */
+int Memo_testAndMark(Memo *memo, int statenum, int woffset, Sub *sub);
+
+/* Memo_testAndMark for one table layout, without the dispatch on encoding.
+ * backtrack picks its simulation by Memo_kind and calls the matching one directly.
+ * Only for tables with neither a window nor a budget. */
+
+/* Memo_kind. Macros, not an enum: backtrack-core.h tests them in #if. */
+#define MEMO_KIND_GENERIC 0  /* Anything: Memo_testAndMark */
+#define MEMO_KIND_ARRAY   1  /* ENCODING_NONE */
+#define MEMO_KIND_BITMAP  2  /* ENCODING_BITMAP */
+#define MEMO_KIND_HASH    3  /* ENCODING_NEGATIVE, keys < q, i > */
+#define MEMO_KIND_HASH_BR 4  /* ENCODING_NEGATIVE, keys < q, i, CG vector, counters > */
+#define MEMO_NKINDS       5
+
+/* Which of the specialized test-and-marks memo can use. Call after Memo_reuse. */
+int Memo_kind(Memo *memo);
+
+static inline int
+Memo_testAndMarkArray(Memo *memo, int statenum, int woffset)
+{
+  int *cell = &memo->visitVectors[statenum][woffset];
+  int wasMarked = (*cell == memo->epoch);
+
+  *cell = memo->epoch;
+  return wasMarked;
+}
+
+#define MEMO_BITMAP_BITS_PER_WORD 64
+
+/* Zero a BITMAP row left over from an earlier match, and bring it into this one.
+ * Once per row per match, so out of line. */
+void Memo_zeroBitmapRow(Memo *memo, int statenum);
+
+static inline int
+Memo_testAndMarkBitmap(Memo *memo, int statenum, int woffset)
+{
+  uint64_t *word, mask;
+  int wasSet;
+
+  if (memo->rowEpochs[statenum] != memo->epoch) {
+    /* First mark in this row since Memo_reuse */
+    Memo_zeroBitmapRow(memo, statenum);
+  }
+  word = &memo->bitVectors[statenum][woffset / MEMO_BITMAP_BITS_PER_WORD];
+  mask = ((uint64_t) 1) << (woffset % MEMO_BITMAP_BITS_PER_WORD);
+  wasSet = (*word & mask) != 0;
+  *word |= mask;
+  return wasSet;
+}
+
+static inline int
+Memo_testAndMarkHash(Memo *memo, int statenum, int woffset)
+{
+  int key[2] = { statenum, woffset };
+  return SimPosTable_insert(memo->simPosTable, key);
+}
+
+/* The CG vector and the counters are gathered out of line */
+int Memo_testAndMarkHashBackrefs(Memo *memo, int statenum, int woffset, Sub *sub);
+
 void freeMemoTable(Memo memo);
 
 #endif /* MEMOIZE_H */
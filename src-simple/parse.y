@@ -130,6 +130,19 @@ repeat:
 		$$ = reg(Quest, $1, nil);
 		$$->n = 1;
 	}
+	// Possessive: A*+ is (?>A*)
+|	single '*' '+'
+	{
+		$$ = reg(Atomic, reg(Star, $1, nil), nil);
+	}
+|	single '+' '+'
+	{
+		$$ = reg(Atomic, reg(Plus, $1, nil), nil);
+	}
+|	single '?' '+'
+	{
+		$$ = reg(Atomic, reg(Quest, $1, nil), nil);
+	}
 |	single curly
 	{
 		$$ = $2;
@@ -141,6 +154,11 @@ repeat:
 		$$->left = $1;
 		$$->n = 1;
 	}
+|	single curly '+'
+	{
+		$2->left = $1;
+		$$ = reg(Atomic, $2, nil);
+	}
 ;
 
 curly:
@@ -239,6 +257,11 @@ escape:
 		$$ = reg(CharEscape, nil, nil);
 		$$->ch = '=';
 	}
+|	'\\' '>'
+	{
+		$$ = reg(CharEscape, nil, nil);
+		$$->ch = '>';
+	}
 |	'\\' '.'
 	{
 		$$ = reg(CharEscape, nil, nil);
@@ -302,6 +325,10 @@ single:
 		$$ = reg(Lookahead, $5, nil);
 		DISABLE_CAPTURES = 0;
 	}
+|	'(' '?' '>' alt ')'
+	{
+		$$ = reg(Atomic, $4, nil);
+	}
 |	escape
 	{
 		$$ = $1;
@@ -316,6 +343,11 @@ single:
 		$$ = reg(Lit, nil, nil);
 		$$->ch = '=';
 	}
+|	'>'
+	{
+		$$ = reg(Lit, nil, nil);
+		$$->ch = '>';
+	}
 |	ccc
 	{
 		$$ = $1;
@@ -440,6 +472,11 @@ charRangeChar:
 		$$ = reg(Lit, nil, nil);
 		$$->ch = '=';
 	}
+|   '>'
+	{
+		$$ = reg(Lit, nil, nil);
+		$$->ch = '>';
+	}
 |   '*'
 	{
 		$$ = reg(Lit, nil, nil);
@@ -498,7 +535,7 @@ yylex(void)
 	if (input == NULL || *input == 0)
 		return EOL;
 	c = *input++;
-	if (strchr("^|*+?(){}:=.\\[^-]$", c))
+	if (strchr("^|*+?(){}:=>.\\[^-]$", c))
 		return c;
 	yylval.c = c;
 	return CHAR;
@@ -643,9 +680,11 @@ parse(char *s)
 	if(parsed_regexp == nil)
 		yyerror("parser nil");
 	
-	logMsg(LOG_INFO, "parsed_regexp\n"); 
-	printre(parsed_regexp);
-	printf("\n");
+	if (shouldLog(LOG_DEBUG)) {
+		logMsg(LOG_DEBUG, "parsed_regexp:");
+		printre(parsed_regexp);
+		printf("\n");
+	}
 		
 	r = reg(Paren, parsed_regexp, nil);	// $0 parens
 
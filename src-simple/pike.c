@@ -32,13 +32,13 @@ threadlist(int n)
 }
 
 static void
-addthread(ThreadList *l, Thread t, char *sp)
+addthread(Prog *prog, ThreadList *l, Thread t, char *sp)
 {
-	if(t.pc->gen == gen) {
+	if(INST_INFO(prog, t.pc)->gen == gen) {
 		decref(t.sub);
 		return;	// already on list
 	}
-	t.pc->gen = gen;
+	INST_INFO(prog, t.pc)->gen = gen;
 	
 	switch(t.pc->opcode) {
 	default:
@@ -46,14 +46,14 @@ addthread(ThreadList *l, Thread t, char *sp)
 		l->n++;
 		break;
 	case Jmp:
-		addthread(l, thread(t.pc->x, t.sub), sp);
+		addthread(prog, l, thread(t.pc->x, t.sub), sp);
 		break;
 	case Split:
-		addthread(l, thread(t.pc->x, incref(t.sub)), sp);
-		addthread(l, thread(t.pc->y, t.sub), sp);
+		addthread(prog, l, thread(t.pc->x, incref(t.sub)), sp);
+		addthread(prog, l, thread(t.pc->y, t.sub), sp);
 		break;
 	case Save:
-		addthread(l, thread(t.pc+1, update(t.sub, t.pc->n, sp)), sp);
+		addthread(prog, l, thread(t.pc+1, update(t.sub, t.pc->n, sp)), sp);
 		break;
 	}
 }
@@ -79,7 +79,7 @@ pikevm(Prog *prog, char *input, char **subp, int nsubp)
 	nlist = threadlist(len);
 	
 	gen++;
-	addthread(clist, thread(prog->start, sub), input);
+	addthread(prog, clist, thread(prog->start, sub), input);
 	matched = 0;
 	for(sp=input;; sp++) {
 		if(clist->n == 0)
@@ -101,7 +101,7 @@ pikevm(Prog *prog, char *input, char **subp, int nsubp)
 					decref(sub);
 					break;
 				}
-				addthread(nlist, thread(pc+1, sub), sp+1);
+				addthread(prog, nlist, thread(pc+1, sub), sp+1);
 				break;
 			case Match:
 				if(matched)
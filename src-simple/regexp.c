@@ -202,6 +202,12 @@ printre(Regexp *r)
 		printre(r->left);
 		printf(")");
 		break;
+
+	case Atomic:
+		printf("Atomic(");
+		printre(r->left);
+		printf(")");
+		break;
 	
 	case InlineZWA:
 		printf("InlineZWA(%c)", r->ch);
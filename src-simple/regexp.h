@@ -12,6 +12,7 @@
 #include <assert.h>
 #include "uthash.h"
 #include "rle.h"
+#include "charclass.h"
 
 #define nil ((void*)0)
 #define nelem(x) (sizeof(x)/sizeof((x)[0]))
@@ -19,7 +20,9 @@
 typedef struct Regexp Regexp;
 typedef struct Prog Prog;
 typedef struct Inst Inst;
-typedef struct InstCharRange InstCharRange;
+typedef struct InstEdges InstEdges;
+typedef struct InstRepeat InstRepeat;
+typedef struct InstInfo InstInfo;
 typedef struct LanguageLengthInfo LanguageLengthInfo;
 typedef struct InstInfoForMemoSelPolicy InstInfoForMemoSelPolicy;
 
@@ -50,6 +53,9 @@ struct Regexp
 	int bolAnchor;
 	int eolAnchor;
 
+	/* Did the pattern have any A{m,n} before transform rewrote them? (applied to the root Regexp) */
+	int hasCurlies;
+
 	/* CustomCharClass */
 	int plusDash; // Is an unescaped '-' part of the CCC, e.g. [-a] or [a-]?
 	int ccInvert;
@@ -98,6 +104,7 @@ enum	/* Regexp.type */
 	Backref, /* \1 */
 	Lookahead, /* (?=A) */
 	InlineZWA, /* ^, \A, \b, \B, $, \z, \Z */
+	Atomic,  /* (?>A), and the possessive A*+ A++ A?+ A{}+ */
 };
 
 // Used to support InlineZWA: \b \B 
@@ -118,17 +125,44 @@ struct Prog
 	int len;
 	int memoMode; /* Memo.mode */
 	int memoEncoding; /* Memo.encoding */
+	int memoWindow; /* Memo.windowBlockSize, or 0 to keep the whole table */
+	long memoBudget; /* Memo.budgetBytes, or 0 for no limit */
+	int fullVisitTable; /* Keep the |Q| x |w| VisitTable (research runs), not just its counters */
 	int nMemoizedStates;
+	int nMemoChecks; /* MemoCheck Insts. The other len - nMemoChecks Insts are the automaton's vertices. */
 	int eolAnchor;
+	int hasCurlies; /* Regexp.hasCurlies */
+	int dispatch; /* DISPATCH_* -- how backtrack runs the Insts */
+	void **handlers; /* DISPATCH_THREADED: the simulation's handler table that Inst.handler was resolved from, or NULL */
+
+	/* Side tables. The Inst array holds only what every step needs; these hold the rest. */
+	InstCharClass *charClasses; /* CharClass operands, by Inst.n */
+	int nCharClasses;
+	InstEdges *edgeLists; /* SplitMany operands, by Inst.n */
+	int nEdgeLists;
+	InstRepeat *repeats; /* CharRepeat and counted-loop operands, by Inst.n */
+	int nRepeats;
+	int nCounters; /* Counter slots the counted loops use: their deepest nesting */
+	int nEpsilonSccs; /* Components found by Prog_findEpsilonCycles */
+	InstInfo *info; /* Per vertex, by Inst.stateNum: analyses the simulation never reads */
 };
 
-struct InstCharRange
+/* The cold data for pc's vertex. A MemoCheck shares its vertex's. */
+#define INST_INFO(prog, pc) (&(prog)->info[(pc)->stateNum])
+
+/* Direct-threaded dispatch needs computed goto (GCC, clang). Build with -DCOMPUTED_GOTO=0 to leave it out. */
+#ifndef COMPUTED_GOTO
+#if defined(__GNUC__)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+#endif
+
+enum	/* Prog.dispatch */
 {
-	// Big enough to hold any built-in char classes
-	int lows[5];
-	int highs[5]; // Inclusive
-	int count;
-	int invert; // For \W, \S, \D
+	DISPATCH_SWITCH = 0, /* Portable */
+	DISPATCH_THREADED,   /* Needs COMPUTED_GOTO */
 };
 
 struct InstInfoForMemoSelPolicy
@@ -137,6 +171,7 @@ struct InstInfoForMemoSelPolicy
 	int inDegree;
 	int isAncestorLoopDestination;
 	int memoStateNum; /* -1 if "don't memo", else 0 to |Phi_memo| */
+	int counterMask; /* Bit k: inside the counted loop with counter slot k, so the search state includes Sub.counter[k] */
 
 	/*  (NOT WORKING). These are the intervals at which this vertex may be visited
 	 *    during the automaton simulation.
@@ -145,35 +180,50 @@ struct InstInfoForMemoSelPolicy
 	int visitInterval;
 };
 
+/* One instruction. Kept small, so the simulation's working set stays in cache:
+ * operands that do not fit are in Prog's side tables, by n. */
 struct Inst
 {
 	int opcode; /* Instruction. Determined by the corresponding Regex node */
-	int c; /* For Lit or Boundary: The literal character */
-	int n; /* Quant: 1 means greedy. Save: 2*n and 2*n + 1 are paired. */
-	int stateNum; /* 0 to Prog->len-1 */
+	int c; /* For Lit or Boundary: The literal character. CharLoop: the loop's memo state number, or -1. */
+	int n; /* Save: 2*n and 2*n + 1 are paired. MemoCheck: memo state number. StringCompare: CG number.
+	        * CharClass, CharLoop: index in Prog.charClasses. SplitMany: index in Prog.edgeLists.
+	        * CharRepeat, RepeatStart, RepeatTest, RepeatNext: index in Prog.repeats. */
+	int stateNum; /* The automaton vertex, 0 to |Q|-1. A MemoCheck shares the number of the vertex it guards. */
+	void *handler; /* DISPATCH_THREADED: where backtrack runs this Inst. Depends on its opcode and the simulation running it. */
 	Inst *x; /* Outgoing edge -- destination 1 (default option) */
-	Inst *y; /* Outgoing edge -- destination 2 (backup) */
-	int gen;	// global state, oooh!
+	Inst *y; /* Outgoing edge -- destination 2 (backup). CharLoop, CharRepeat: where the shorter runs go, or NULL if possessive. */
+};
 
-	Inst **edges; /* Outgoing edges for case of *-arity */
+/* SplitMany operand: outgoing edges for case of *-arity */
+struct InstEdges
+{
+	Inst **edges;
 	int arity;
-	
-	/* For CharClass */
-	InstCharRange charRanges[32];
-	int charRangeCounts; /* Number of used slots */
-	int invert;
+};
 
-	/* For StringCompare */
-	int cgNum;
+/* Operand of a bounded repetition A{min,max} */
+struct InstRepeat
+{
+	int min;
+	int max; /* -1 if unbounded (counted loops only) */
+	int greedy;
+	int counter; /* Counted loops: the Sub.counter slot, i.e. the loop's nesting depth among counted loops */
+	int cc; /* CharRepeat: index in Prog.charClasses */
+};
+
+/* Per-vertex data off the simulation's path */
+struct InstInfo
+{
+	int gen;	// global state, oooh!
 
-	/* Debug */
-	int startMark;
-	int visitMark;
+	/* Prog_findEpsilonCycles */
+	int epsilonScc; /* Strongly connected component over the edges that consume nothing. Numbered in reverse topological order. */
+	int inEpsilonCycle; /* Can return to itself without consuming: an infinite loop */
 
 	InstInfoForMemoSelPolicy memoInfo;
 };
 
-
 enum	/* Inst.opcode */
 {
 	Char = 1,
@@ -188,9 +238,25 @@ enum	/* Inst.opcode */
 	StringCompare,
 	InlineZeroWidthAssertion,
 	RecursiveZeroWidthAssertion,
+	MemoCheck, /* Inserted by Prog_determineMemoNodes: test-and-mark <n, sp> in the memo table, dying if marked */
+	CharLoop, /* Greedy x* for a single character x: consume the run of class n, then go to the next Inst.
+	           * Backtracking takes the shorter runs, longest first, to y. Possessive (y == NULL): no shorter runs. */
+	Barrier, /* Enter an atomic group: push a barrier onto the backtracking stack */
+	Cut, /* Leave an atomic group: discard the threads above the most recent barrier, and the barrier */
+	CharRepeat, /* Greedy x{min,max} for a single character x: consume up to max of class repeats[n].cc, then go to the next Inst.
+	             * Fewer than min is a failure. As CharLoop, the shorter runs (down to min) go to y. */
+	RepeatStart, /* Enter a counted loop A{min,max}: zero its counter, go to the next Inst (the loop's RepeatTest) */
+	RepeatTest, /* Top of a counted loop: by its counter, go around again (x), leave (y), or try both in the loop's order */
+	RepeatNext, /* Bottom of a counted loop: count the iteration, go back to the RepeatTest (x) */
 };
 
 Prog *compile(Regexp*, int);
+/* Make each CharLoop possessive if its shorter runs can never lead to a match. Call before Prog_determineMemoNodes. */
+void Prog_possessify(Prog *p);
+/* Find the strongly connected components of the edges that consume nothing (InstInfo.epsilonScc) in O(|Q| + |E|), iteratively.
+ * Returns how many vertices lie on a cycle of them. Call before Prog_determineMemoNodes. */
+int Prog_findEpsilonCycles(Prog *p);
+/* Reject p (as a syntax error) if it has such a cycle. Fills in the components as Prog_findEpsilonCycles. */
 void Prog_assertNoInfiniteLoops(Prog *p);
 void printprog(Prog*);
 
@@ -201,6 +267,11 @@ enum {
 	MAXSUB = 20
 };
 
+/* Counted loops nested deeper than this are expanded instead */
+enum {
+	MAXCOUNTERS = 8
+};
+
 typedef struct Sub Sub;
 struct Sub
 {
@@ -208,6 +279,7 @@ struct Sub
 	int nsub;
 	char *start; /* Easy way to calculate w[i] vs. char * */
 	char *sub[MAXSUB]; /* Two slots for each CG, \0 (whole string) - \9 */
+	int counter[MAXCOUNTERS]; /* Iterations of the enclosing counted loops, by InstRepeat.counter */
 };
 
 Sub *newsub(int n, char *start);
@@ -215,11 +287,29 @@ Sub *incref(Sub*);
 Sub *copy(Sub*);
 Sub *update(Sub*, int, char*);
 void decref(Sub*);
+
+/* Free list of Subs. newsub, update and decref use a shared one; a matcher may keep its own. */
+typedef struct SubPool SubPool;
+struct SubPool
+{
+	Sub *free; /* Linked through sub[0] */
+};
+Sub *SubPool_newsub(SubPool*, int n, char *start);
+Sub *SubPool_update(SubPool*, Sub*, int, char*);
+Sub *SubPool_setCounter(SubPool*, Sub*, int, int);
+void SubPool_decref(SubPool*, Sub*);
+void SubPool_free(SubPool*); /* Release the free list */
 int isgroupset(Sub*, int);
 
 /* Backreference helpers */
 int usesBackreferences(Prog *p);
 
+/* Does p have an atomic group? (A possessive x* or x+ needs none.) We do not memoize inside them. */
+int usesAtomicGroups(Prog *p);
+
+/* Does p have a counted loop? Its counters are part of the search state, so it needs the Subs and keyed memo entries. */
+int usesCountedLoops(Prog *p);
+
 // Given a CGID, which sub are we looking at?
 #define CGID_TO_SUB_STARTP_IX(cgid) (2*(cgid))
 #define CGID_TO_SUB_ENDP_IX(cgid) (2*(cgid) + 1)
@@ -229,6 +319,13 @@ int usesBackreferences(Prog *p);
 
 /* (Extended-)NFA simulations */
 int backtrack(Prog*, char*, char**, int);
+/* Per-worker scratch space for backtrack: the backtracking stacks, a Sub free list, and the memo and visit tables.
+ * Each keeps its high-water capacity from one match to the next, so a warm scratch does not allocate.
+ * Allocate one per thread; never share one between concurrent matches. */
+typedef struct BacktrackScratch BacktrackScratch;
+BacktrackScratch *BacktrackScratch_create(void);
+void BacktrackScratch_destroy(BacktrackScratch*);
+int backtrackWithScratch(Prog*, char*, char**, int, BacktrackScratch*);
 int pikevm(Prog*, char*, char**, int);
 int recursiveloopprog(Prog*, char*, char**, int);
 int recursiveprog(Prog*, char*, char**, int);
@@ -0,0 +1,530 @@
+/*
+Copyright (c) 2020, James Davis http://people.cs.vt.edu/davisjam/
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* RLEVector backend: a gap-buffered sorted array of runs.
+ *
+ * Same API and same run semantics as rle.c, but the runs live inline in one
+ * array instead of in individually malloc'd AVL nodes. Lookups binary-search
+ * the array; updates splice a handful of runs at the gap, which we move to
+ * the update site. The memo's accesses are local, so the gap rarely travels far.
+ * The array is the node pool: runs are never malloc'd or freed individually. */
+
+#include "rle.h"
+#include "rle-kernel.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Offset within a k-bit run. [0, bitsPerRun). */
+#define RUN_OFFSET(ix, bitsPerRun) ( (ix) % (bitsPerRun) )
+/* Run number within a repeating sequence of k-bit runs. [0, nRuns). */
+#define RUN_NUMBER(ix, rleStart, bitsPerRun) ( ( (ix) - (rleStart) ) / (bitsPerRun) )
+
+#define RLEARRAY_INITIAL_CAPACITY 8
+
+/* Internal API: RLERun */
+typedef struct RLERun RLERun;
+
+/* 16 bytes -- four to a cache line */
+struct RLERun
+{
+  int offset;
+  int nRuns;
+
+  /* A bit representation of the run sequence (see rle-kernel.h).
+   * The run owns its kernel. */
+  RLEKernel run;
+};
+
+static RLERun
+RLERun_make(int offset, int nRuns, RLEKernel run)
+{
+  RLERun r;
+  r.offset = offset;
+  r.nRuns = nRuns;
+  r.run = run;
+  return r;
+}
+
+/* First index not captured in this run */
+static int
+RLERun_end(const RLERun *r, int nBitsInRun)
+{
+  return r->offset + r->nRuns * nBitsInRun;
+}
+
+static int
+RLERun_contains(const RLERun *r, int ix, int nBitsInRun)
+{
+  return r->offset <= ix && ix < RLERun_end(r, nBitsInRun);
+}
+
+/* External API: RLEVector */
+
+struct RLEVector
+{
+  /* Runs in offset order occupy [0, gapStart) and [gapEnd, capacity).
+   * Logical index i is at runs[i] before the gap and runs[i + gap size] after it. */
+  RLERun *runs;
+  int capacity;
+  int gapStart;
+  int gapEnd;
+
+  int currNEntries;
+  int mostNEntries; /* High water mark */
+  int nBitsInRun; /* Length of the runs we encode */
+  int autoValidate; /* Validate after every API usage. This can be wildly expensive. */
+  RLEKernelPool kernels;
+
+  /* Finger: logical index of the last run we touched. Accesses are local,
+   * so we try it and its neighbors before binary searching. */
+  int finger;
+  long nFingerLookups;
+  long nFingerHits;
+};
+
+static void _RLEVector_validate(RLEVector *vec);
+
+static inline RLERun *
+_RLEVector_at(RLEVector *vec, int i)
+{
+  return &vec->runs[ i < vec->gapStart ? i : i + (vec->gapEnd - vec->gapStart) ];
+}
+
+/* Is i the last run with offset <= ix? i may be -1. */
+static inline int
+_RLEVector_isPred(RLEVector *vec, int i, int ix)
+{
+  return (i < 0 || _RLEVector_at(vec, i)->offset <= ix)
+      && (i + 1 >= vec->currNEntries || ix < _RLEVector_at(vec, i + 1)->offset);
+}
+
+/* Logical index of the last run with offset <= ix, or -1 if there is none */
+static int
+_RLEVector_findPred(RLEVector *vec, int ix)
+{
+  int lo = 0, hi = vec->currNEntries; /* Answer + 1 lies in [lo, hi] */
+  int f = vec->finger;
+
+  vec->nFingerLookups++;
+  if (0 <= f && f < vec->currNEntries) {
+    if (_RLEVector_isPred(vec, f, ix)) {
+      vec->nFingerHits++;
+      return f;
+    }
+    if (_RLEVector_isPred(vec, f - 1, ix)) {
+      vec->nFingerHits++;
+      return f - 1;
+    }
+    if (f + 1 < vec->currNEntries && _RLEVector_isPred(vec, f + 1, ix)) {
+      vec->nFingerHits++;
+      return f + 1;
+    }
+  }
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (_RLEVector_at(vec, mid)->offset <= ix) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo - 1;
+}
+
+/* Move the gap so that it begins at logical index pos */
+static void
+_RLEVector_moveGap(RLEVector *vec, int pos)
+{
+  int n;
+  if (pos < vec->gapStart) {
+    n = vec->gapStart - pos;
+    memmove(&vec->runs[vec->gapEnd - n], &vec->runs[pos], n * sizeof(RLERun));
+    vec->gapStart -= n;
+    vec->gapEnd -= n;
+  } else if (pos > vec->gapStart) {
+    n = pos - vec->gapStart;
+    memmove(&vec->runs[vec->gapStart], &vec->runs[vec->gapEnd], n * sizeof(RLERun));
+    vec->gapStart += n;
+    vec->gapEnd += n;
+  }
+}
+
+/* Grow until the gap holds at least minGap runs */
+static void
+_RLEVector_grow(RLEVector *vec, int minGap)
+{
+  int newCapacity = vec->capacity;
+  int nAfterGap = vec->capacity - vec->gapEnd;
+  RLERun *newRuns = NULL;
+
+  while (newCapacity - vec->currNEntries < minGap) {
+    newCapacity *= 2;
+  }
+  logMsg(LOG_DEBUG, "RLEVector_grow: vec %p capacity %d -> %d", vec, vec->capacity, newCapacity);
+
+  newRuns = malloc(newCapacity * sizeof(RLERun));
+  assert(newRuns != NULL);
+  memcpy(newRuns, vec->runs, vec->gapStart * sizeof(RLERun));
+  memcpy(&newRuns[newCapacity - nAfterGap], &vec->runs[vec->gapEnd], nAfterGap * sizeof(RLERun));
+  free(vec->runs);
+
+  vec->runs = newRuns;
+  vec->capacity = newCapacity;
+  vec->gapEnd = newCapacity - nAfterGap;
+}
+
+/* Replace the runs at logical indices [lo, lo + nRemove) with ins[0, nIns) */
+static void
+_RLEVector_splice(RLEVector *vec, int lo, int nRemove, const RLERun *ins, int nIns)
+{
+  _RLEVector_moveGap(vec, lo);
+  vec->gapEnd += nRemove;
+  vec->currNEntries -= nRemove;
+
+  if (nIns == 0) {
+    return;
+  }
+  if (vec->gapEnd - vec->gapStart < nIns) {
+    _RLEVector_grow(vec, nIns);
+  }
+  memcpy(&vec->runs[vec->gapStart], ins, nIns * sizeof(RLERun));
+  vec->gapStart += nIns;
+  vec->currNEntries += nIns;
+
+  if (vec->mostNEntries < vec->currNEntries) {
+    vec->mostNEntries = vec->currNEntries;
+  }
+}
+
+/* Merge adjacent identical runs in place. Returns the new count. */
+static int
+_RLEVector_mergeRuns(RLEVector *vec, RLERun *runs, int n)
+{
+  int i, out = 0;
+  for (i = 0; i < n; i++) {
+    if (out > 0 && RLEKernel_equal(&vec->kernels, runs[out-1].run, runs[i].run)
+     && RLERun_end(&runs[out-1], vec->nBitsInRun) == runs[i].offset) {
+      logMsg(LOG_DEBUG, "merge: (%d,%d,%llu) absorbs (%d,%d)", runs[out-1].offset, runs[out-1].nRuns, RLEKernel_lowWord(&vec->kernels, runs[out-1].run), runs[i].offset, runs[i].nRuns);
+      runs[out-1].nRuns += runs[i].nRuns;
+      RLEKernel_release(&vec->kernels, runs[i].run);
+    } else {
+      runs[out++] = runs[i];
+    }
+  }
+  return out;
+}
+
+RLEVector *
+RLEVector_create(int runLength, int autoValidate)
+{
+  RLEVector *vec = malloc(sizeof *vec);
+  assert(vec != NULL);
+
+  vec->capacity = RLEARRAY_INITIAL_CAPACITY;
+  vec->runs = malloc(vec->capacity * sizeof(RLERun));
+  assert(vec->runs != NULL);
+  vec->gapStart = 0;
+  vec->gapEnd = vec->capacity;
+
+  vec->finger = -1;
+  vec->nFingerLookups = 0;
+  vec->nFingerHits = 0;
+  vec->currNEntries = 0;
+  vec->mostNEntries = 0;
+  vec->nBitsInRun = runLength;
+
+  if (runLength > RLE_KERNEL_MAX_BITS) {
+    logMsg(LOG_INFO, "RLEVector_create: Need %d bits, only support %d", runLength, RLE_KERNEL_MAX_BITS);
+    vec->nBitsInRun = 1;
+  }
+  vec->autoValidate = autoValidate;
+  RLEKernelPool_init(&vec->kernels, vec->nBitsInRun);
+
+  logMsg(LOG_VERBOSE, "RLEVector_create: vec %p nBitsInRun %d, autoValidate %d (array backend)", vec, vec->nBitsInRun, vec->autoValidate);
+
+  return vec;
+}
+
+/* Performs a full walk of the array looking for fishy business. O(n) steps. */
+static void
+_RLEVector_validate(RLEVector *vec)
+{
+  RLERun *prev = NULL, *curr = NULL;
+  int i;
+
+  assert(vec != NULL);
+  logMsg(LOG_DEBUG, "  _RLEVector_validate: Validating vec %p (size %d, runs of length %d)", vec, vec->currNEntries, vec->nBitsInRun);
+
+  assert(0 <= vec->gapStart && vec->gapStart <= vec->gapEnd && vec->gapEnd <= vec->capacity);
+  assert(vec->currNEntries == vec->capacity - (vec->gapEnd - vec->gapStart));
+
+  for (i = 0; i < vec->currNEntries; i++) {
+    curr = _RLEVector_at(vec, i);
+    assert(curr->nRuns > 0);
+    assert(curr->offset % vec->nBitsInRun == 0); /* Aligned */
+    if (prev != NULL) {
+      logMsg(LOG_DEBUG, "rleVector_validate: prev (%d,%d,%llu) curr (%d,%d,%llu)", prev->offset, prev->nRuns, RLEKernel_lowWord(&vec->kernels, prev->run), curr->offset, curr->nRuns, RLEKernel_lowWord(&vec->kernels, curr->run));
+      assert(RLERun_end(prev, vec->nBitsInRun) <= curr->offset); /* In-order, disjoint */
+      if (RLERun_end(prev, vec->nBitsInRun) == curr->offset && RLEKernel_equal(&vec->kernels, prev->run, curr->run)) {
+        /* Adjacent identical runs should have been merged */
+        assert(!"rleVector_validate: Adjacent identical runs are not merged");
+      }
+    }
+    prev = curr;
+  }
+}
+
+int
+RLEVector_runSize(RLEVector *vec)
+{
+  return vec->nBitsInRun;
+}
+
+/* Set the bit at ix, given the logical index of the last run beginning <= ix.
+ * The bit must not be set already.
+ * Invariant: always returns with vec fully merged; validate() should pass.
+ */
+static void
+_RLEVector_setWithPred(RLEVector *vec, int ix, int pred)
+{
+  /* Left neighbor, [prefix,] new run, [suffix,] right neighbor */
+  RLERun pieces[5];
+  int nPieces = 0, i;
+  int lo, hi; /* We replace the logical range [lo, hi) */
+  int k = vec->nBitsInRun;
+  int roundedIx = ix - RUN_OFFSET(ix, k);
+  int splits = (pred >= 0 && RLERun_contains(_RLEVector_at(vec, pred), ix, k));
+
+  lo = splits ? pred : pred + 1;
+  hi = pred + 1;
+
+  /* Include the neighbors so we can merge with them */
+  if (lo > 0) {
+    lo--;
+    pieces[nPieces++] = *_RLEVector_at(vec, lo);
+  }
+
+  if (splits) {
+    /* Case: splits a run */
+    RLERun old = *_RLEVector_at(vec, pred);
+    int nRunsInPrefix = RUN_NUMBER(ix, old.offset, k);
+    int nRunsInSuffix = old.nRuns - (nRunsInPrefix + 1);
+    RLEKernel newRunKernel = RLEKernel_copy(&vec->kernels, old.run);
+    RLEKernel_set(&vec->kernels, &newRunKernel, RUN_OFFSET(ix, k));
+
+    logMsg(LOG_DEBUG, "%d: Splitting the run (%d,%d,%llu)", ix, old.offset, old.nRuns, RLEKernel_lowWord(&vec->kernels, old.run));
+    /* The prefix inherits the old kernel, so the suffix needs its own copy unless there was no prefix */
+    if (nRunsInPrefix > 0) {
+      pieces[nPieces++] = RLERun_make(old.offset, nRunsInPrefix, old.run);
+    }
+    pieces[nPieces++] = RLERun_make(roundedIx, 1, newRunKernel);
+    if (nRunsInSuffix > 0) {
+      pieces[nPieces++] = RLERun_make(roundedIx + k, nRunsInSuffix,
+        (nRunsInPrefix > 0) ? RLEKernel_copy(&vec->kernels, old.run) : old.run);
+    }
+    if (nRunsInPrefix == 0 && nRunsInSuffix == 0) {
+      RLEKernel_release(&vec->kernels, old.run);
+    }
+  } else {
+    /* Case: creates a run */
+    RLEKernel newRunKernel = RLEKernel_new(&vec->kernels);
+    RLEKernel_set(&vec->kernels, &newRunKernel, RUN_OFFSET(ix, k));
+    logMsg(LOG_DEBUG, "%d: Creating a run", ix);
+    pieces[nPieces++] = RLERun_make(roundedIx, 1, newRunKernel);
+  }
+
+  if (hi < vec->currNEntries) {
+    pieces[nPieces++] = *_RLEVector_at(vec, hi);
+    hi++;
+  }
+
+  nPieces = _RLEVector_mergeRuns(vec, pieces, nPieces);
+  _RLEVector_splice(vec, lo, hi - lo, pieces, nPieces);
+
+  /* Point the finger at the run that now holds ix */
+  for (i = 0; i < nPieces; i++) {
+    if (RLERun_contains(&pieces[i], ix, k)) {
+      vec->finger = lo + i;
+      break;
+    }
+  }
+
+  if (vec->autoValidate)
+    _RLEVector_validate(vec);
+}
+
+static int
+_RLEVector_getWithPred(RLEVector *vec, int ix, int pred)
+{
+  RLERun *r = NULL;
+  if (pred < 0) {
+    return 0;
+  }
+  r = _RLEVector_at(vec, pred);
+  if (!RLERun_contains(r, ix, vec->nBitsInRun)) {
+    return 0;
+  }
+  return RLEKernel_isSet(&vec->kernels, r->run, RUN_OFFSET(ix, vec->nBitsInRun));
+}
+
+void
+RLEVector_set(RLEVector *vec, int ix)
+{
+  int pred;
+
+  logMsg(LOG_VERBOSE, "RLEVector_set: %d", ix);
+
+  if (vec->autoValidate)
+    _RLEVector_validate(vec);
+
+  pred = _RLEVector_findPred(vec, ix);
+  assert(!_RLEVector_getWithPred(vec, ix, pred)); /* Shouldn't be set already */
+  _RLEVector_setWithPred(vec, ix, pred);
+}
+
+int
+RLEVector_testAndSet(RLEVector *vec, int ix)
+{
+  int pred;
+
+  logMsg(LOG_VERBOSE, "RLEVector_testAndSet: %d", ix);
+
+  if (vec->autoValidate)
+    _RLEVector_validate(vec);
+
+  pred = _RLEVector_findPred(vec, ix);
+  if (_RLEVector_getWithPred(vec, ix, pred)) {
+    vec->finger = pred;
+    return 1;
+  }
+  _RLEVector_setWithPred(vec, ix, pred);
+  return 0;
+}
+
+int
+RLEVector_get(RLEVector *vec, int ix)
+{
+  int pred;
+
+  logMsg(LOG_DEBUG, "RLEVector_get: %d", ix);
+
+  if (vec->autoValidate)
+    _RLEVector_validate(vec);
+
+  pred = _RLEVector_findPred(vec, ix);
+  if (pred >= 0) {
+    vec->finger = pred;
+  }
+  return _RLEVector_getWithPred(vec, ix, pred);
+}
+
+void
+RLEVector_trimBelow(RLEVector *vec, int ix)
+{
+  int nTrimmed = 0;
+
+  while (nTrimmed < vec->currNEntries && RLERun_end(_RLEVector_at(vec, nTrimmed), vec->nBitsInRun) <= ix) {
+    RLEKernel_release(&vec->kernels, _RLEVector_at(vec, nTrimmed)->run);
+    nTrimmed++;
+  }
+  if (nTrimmed == 0) {
+    return;
+  }
+
+  _RLEVector_splice(vec, 0, nTrimmed, NULL, 0);
+  vec->finger = (vec->finger >= nTrimmed) ? vec->finger - nTrimmed : -1;
+
+  logMsg(LOG_DEBUG, "RLEVector_trimBelow: vec %p trimmed %d runs below %d", vec, nTrimmed, ix);
+  if (vec->autoValidate)
+    _RLEVector_validate(vec);
+}
+
+/* The array keeps its capacity */
+void
+RLEVector_clear(RLEVector *vec)
+{
+  logMsg(LOG_DEBUG, "RLEVector_clear: vec %p dropping %d runs", vec, vec->currNEntries);
+  RLEKernelPool_reset(&vec->kernels);
+
+  vec->gapStart = 0;
+  vec->gapEnd = vec->capacity;
+  vec->finger = -1;
+  vec->nFingerLookups = 0;
+  vec->nFingerHits = 0;
+  vec->currNEntries = 0;
+  vec->mostNEntries = 0;
+}
+
+int
+RLEVector_currSize(RLEVector *vec)
+{
+  return vec->currNEntries;
+}
+
+int
+RLEVector_maxObservedSize(RLEVector *vec)
+{
+  return vec->mostNEntries;
+}
+
+long
+RLEVector_nFingerLookups(RLEVector *vec)
+{
+  return vec->nFingerLookups;
+}
+
+long
+RLEVector_nFingerHits(RLEVector *vec)
+{
+  return vec->nFingerHits;
+}
+
+/* Counted per run, like the AVL backend, so the two are comparable.
+ * The array itself may hold up to 2x this many slots. */
+int
+RLEVector_currBytes(RLEVector *vec)
+{
+  return sizeof(RLEVector) \
+    + (sizeof(RLERun) + RLEKernelPool_kernelBytes(&vec->kernels)) * RLEVector_currSize(vec) \
+    ;
+}
+
+int
+RLEVector_maxBytes(RLEVector *vec)
+{
+  return sizeof(RLEVector) /* Internal overhead */ \
+    + (sizeof(RLERun) + RLEKernelPool_kernelBytes(&vec->kernels)) * RLEVector_maxObservedSize(vec) /* Cost per run */ \
+    ;
+}
+
+void
+RLEVector_destroy(RLEVector *vec)
+{
+  free(vec->runs);
+  RLEKernelPool_destroy(&vec->kernels); /* Frees the kernels too */
+  free(vec);
+}
@@ -0,0 +1,153 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef RLE_KERNEL_H
+#define RLE_KERNEL_H
+
+/* Run kernels, shared by the RLEVector backends.
+ *
+ * A kernel is the bit pattern of one run, nBitsInRun bits wide.
+ * We look at bits 0, 1, 2, 3, ... (right-to-left).
+ *   - Up to 64 bits, the kernel is stored inline.
+ *   - Wider kernels point to an array of words drawn from the vector's
+ *     RLEKernelPool. Each run owns its array; released arrays are recycled.
+ * Every operation takes the pool, which knows the width. */
+
+#include "arena.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define RLE_KERNEL_WORD_BITS 64
+/* Wider runs are not worth it -- RLEVector_create falls back to 1-bit runs */
+#define RLE_KERNEL_MAX_BITS 4096
+#define RLE_KERNEL_NWORDS(nBits) ( ((nBits) + RLE_KERNEL_WORD_BITS - 1) / RLE_KERNEL_WORD_BITS )
+
+typedef union RLEKernel RLEKernel;
+union RLEKernel
+{
+  unsigned long long word;   /* nWords == 1 */
+  unsigned long long *words; /* nWords > 1 */
+};
+
+typedef struct RLEKernelPool RLEKernelPool;
+struct RLEKernelPool
+{
+  int nWords;
+  void *freeList; /* Released arrays, linked through their first word */
+  Arena *arena;   /* NULL if kernels are inline */
+  int nArrays;    /* High water mark of arrays handed out */
+};
+
+static inline void
+RLEKernelPool_init(RLEKernelPool *pool, int nBitsInRun)
+{
+  pool->nWords = RLE_KERNEL_NWORDS(nBitsInRun);
+  pool->freeList = NULL;
+  pool->arena = (pool->nWords > 1) ? Arena_create(64 * pool->nWords * sizeof(unsigned long long)) : NULL;
+  pool->nArrays = 0;
+}
+
+static inline void
+RLEKernelPool_destroy(RLEKernelPool *pool)
+{
+  if (pool->arena != NULL) {
+    Arena_destroy(pool->arena);
+  }
+}
+
+/* Forget every kernel handed out, keeping the arena to draw from again */
+static inline void
+RLEKernelPool_reset(RLEKernelPool *pool)
+{
+  pool->freeList = NULL;
+  pool->nArrays = 0;
+  if (pool->arena != NULL) {
+    Arena_reset(pool->arena);
+  }
+}
+
+/* Bytes per kernel, inline or not */
+static inline int
+RLEKernelPool_kernelBytes(RLEKernelPool *pool)
+{
+  return (pool->nWords == 1) ? 0 : pool->nWords * sizeof(unsigned long long);
+}
+
+/* All zeros */
+static inline RLEKernel
+RLEKernel_new(RLEKernelPool *pool)
+{
+  RLEKernel k;
+  if (pool->nWords == 1) {
+    k.word = 0;
+  } else if (pool->freeList != NULL) {
+    k.words = pool->freeList;
+    pool->freeList = *(void **) pool->freeList;
+    memset(k.words, 0, pool->nWords * sizeof(unsigned long long));
+  } else {
+    k.words = Arena_alloc(pool->arena, pool->nWords * sizeof(unsigned long long));
+    pool->nArrays++;
+  }
+  return k;
+}
+
+static inline void
+RLEKernel_release(RLEKernelPool *pool, RLEKernel k)
+{
+  if (pool->nWords > 1) {
+    *(void **) k.words = pool->freeList;
+    pool->freeList = k.words;
+  }
+}
+
+static inline RLEKernel
+RLEKernel_copy(RLEKernelPool *pool, RLEKernel k)
+{
+  RLEKernel copy;
+  if (pool->nWords == 1) {
+    return k;
+  }
+  copy = RLEKernel_new(pool);
+  memcpy(copy.words, k.words, pool->nWords * sizeof(unsigned long long));
+  return copy;
+}
+
+static inline int
+RLEKernel_isSet(RLEKernelPool *pool, RLEKernel k, int bit)
+{
+  if (pool->nWords == 1) {
+    return (k.word & (1ULL << bit)) != 0;
+  }
+  return (k.words[bit / RLE_KERNEL_WORD_BITS] & (1ULL << (bit % RLE_KERNEL_WORD_BITS))) != 0;
+}
+
+/* In place */
+static inline void
+RLEKernel_set(RLEKernelPool *pool, RLEKernel *k, int bit)
+{
+  if (pool->nWords == 1) {
+    k->word |= (1ULL << bit);
+  } else {
+    k->words[bit / RLE_KERNEL_WORD_BITS] |= (1ULL << (bit % RLE_KERNEL_WORD_BITS));
+  }
+}
+
+static inline int
+RLEKernel_equal(RLEKernelPool *pool, RLEKernel a, RLEKernel b)
+{
+  if (pool->nWords == 1) {
+    return a.word == b.word;
+  }
+  return a.words == b.words || memcmp(a.words, b.words, pool->nWords * sizeof(unsigned long long)) == 0;
+}
+
+/* For log messages: the first 64 bits */
+static inline unsigned long long
+RLEKernel_lowWord(RLEKernelPool *pool, RLEKernel k)
+{
+  return (pool->nWords == 1) ? k.word : k.words[0];
+}
+
+#endif /* RLE_KERNEL_H */
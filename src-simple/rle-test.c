@@ -28,6 +28,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "rle.h"
 
@@ -104,6 +105,167 @@ void testRuns() {
     assert(RLEVector_currSize(vec) == 1);
   }
 
+  /* Runs wider than 64 bits compress too */
+  logMsg(LOG_INFO, "  runs of length 70 work");
+  vec = RLEVector_create(70, 1);
+  for (i = 0; i < 7000; i += 70) {
+    RLEVector_set(vec, i);
+    RLEVector_set(vec, i + 69);
+    assert(RLEVector_currSize(vec) == 1);
+  }
+  assert(RLEVector_get(vec, 6999) == 1);
+  assert(RLEVector_get(vec, 6998) == 0);
+  assert(RLEVector_get(vec, 7000) == 0);
+
+  logMsg(LOG_INFO, "...test passed");
+}
+
+void testTestAndSet() {
+  logMsg(LOG_INFO, "Test begins: testTestAndSet");
+  int i;
+  RLEVector *vec;
+
+  logMsg(LOG_INFO, "  first call sets, second call reports");
+  vec = RLEVector_create(1, 1);
+  assert(RLEVector_testAndSet(vec, 5) == 0);
+  assert(RLEVector_get(vec, 5) == 1);
+  assert(RLEVector_testAndSet(vec, 5) == 1);
+  assert(RLEVector_currSize(vec) == 1);
+
+  logMsg(LOG_INFO, "  splits and merges match RLEVector_set");
+  vec = RLEVector_create(3, 1);
+  for (i = 0; i < 99; i += 3) {
+    assert(RLEVector_testAndSet(vec, i) == 0);
+  }
+  assert(RLEVector_currSize(vec) == 1);
+  assert(RLEVector_testAndSet(vec, 31) == 0); /* Splits the run */
+  assert(RLEVector_currSize(vec) == 3);
+  assert(RLEVector_testAndSet(vec, 30) == 1);
+  assert(RLEVector_testAndSet(vec, 31) == 1);
+  assert(RLEVector_get(vec, 32) == 0);
+
+  logMsg(LOG_INFO, "...test passed");
+}
+
+void testFinger() {
+  logMsg(LOG_INFO, "Test begins: testFinger");
+  int i;
+  RLEVector *vec;
+
+  logMsg(LOG_INFO, "  local accesses hit the finger");
+  vec = RLEVector_create(1, 0);
+  for (i = 0; i < 1000; i += 2) {
+    RLEVector_testAndSet(vec, i);
+    assert(RLEVector_get(vec, i + 1) == 0);
+  }
+  logMsg(LOG_INFO, "  %ld of %ld lookups hit", RLEVector_nFingerHits(vec), RLEVector_nFingerLookups(vec));
+  assert(RLEVector_nFingerLookups(vec) == 1000);
+  assert(RLEVector_nFingerHits(vec) >= 990);
+
+  logMsg(LOG_INFO, "  a far jump misses but still answers correctly");
+  assert(RLEVector_get(vec, 10) == 1);
+  assert(RLEVector_get(vec, 11) == 0);
+  RLEVector_destroy(vec);
+
+  logMsg(LOG_INFO, "...test passed");
+}
+
+void testTrimBelow() {
+  logMsg(LOG_INFO, "Test begins: testTrimBelow");
+  int i;
+  RLEVector *vec;
+
+  logMsg(LOG_INFO, "  leading runs are discarded, the rest survive");
+  vec = RLEVector_create(1, 1);
+  for (i = 0; i < 100; i += 2) {
+    RLEVector_set(vec, i);
+  }
+  assert(RLEVector_currSize(vec) == 50);
+  RLEVector_trimBelow(vec, 50);
+  assert(RLEVector_currSize(vec) == 25);
+  for (i = 50; i < 100; i++) {
+    assert(RLEVector_get(vec, i) == (i % 2 == 0));
+  }
+
+  logMsg(LOG_INFO, "  a run straddling the boundary is kept");
+  RLEVector_set(vec, 61);
+  RLEVector_trimBelow(vec, 61);
+  assert(RLEVector_get(vec, 61) == 1);
+  assert(RLEVector_testAndSet(vec, 63) == 0);
+  assert(RLEVector_get(vec, 62) == 1);
+
+  logMsg(LOG_INFO, "  trimming everything leaves an empty vector");
+  RLEVector_trimBelow(vec, 1000);
+  assert(RLEVector_currSize(vec) == 0);
+  assert(RLEVector_testAndSet(vec, 2000) == 0);
+  assert(RLEVector_get(vec, 2000) == 1);
+  RLEVector_destroy(vec);
+
+  logMsg(LOG_INFO, "...test passed");
+}
+
+void testClear() {
+  logMsg(LOG_INFO, "Test begins: testClear");
+  int i, r;
+  int runLengths[] = { 1, 3, 70 }; /* Including multi-word kernels */
+  RLEVector *vec;
+
+  for (r = 0; r < sizeof(runLengths) / sizeof(runLengths[0]); r++) {
+    logMsg(LOG_INFO, "  runs of length %d: a cleared vector is empty, and fills up like a new one", runLengths[r]);
+    vec = RLEVector_create(runLengths[r], 1);
+    for (i = 0; i < 1000; i += 3) {
+      RLEVector_set(vec, i);
+    }
+    assert(RLEVector_currSize(vec) > 0);
+    RLEVector_clear(vec);
+    assert(RLEVector_currSize(vec) == 0);
+    assert(RLEVector_maxObservedSize(vec) == 0);
+    assert(RLEVector_nFingerLookups(vec) == 0);
+    for (i = 0; i < 1000; i++) {
+      assert(RLEVector_get(vec, i) == 0);
+    }
+
+    for (i = 1; i < 1000; i += 3) {
+      assert(RLEVector_testAndSet(vec, i) == 0);
+    }
+    for (i = 0; i < 1000; i++) {
+      assert(RLEVector_get(vec, i) == (i % 3 == 1));
+    }
+    RLEVector_destroy(vec);
+  }
+
+  logMsg(LOG_INFO, "...test passed");
+}
+
+/* Compare against a plain array under scattered, mostly-local updates */
+void testAgainstBitArray() {
+  logMsg(LOG_INFO, "Test begins: testAgainstBitArray");
+  int i, ix, r, runLength, len = 2000;
+  int runLengths[] = { 1, 4, 16, 64, 70, 200 }; /* Including multi-word kernels */
+  char *ref = malloc(len);
+  RLEVector *vec;
+
+  srand(1);
+  for (r = 0; r < sizeof(runLengths) / sizeof(runLengths[0]); r++) {
+    runLength = runLengths[r];
+    logMsg(LOG_INFO, "  runs of length %d", runLength);
+    vec = RLEVector_create(runLength, 0);
+    memset(ref, 0, len);
+    ix = 0;
+    for (i = 0; i < 4 * len; i++) {
+      /* Mostly short hops, occasionally a long jump */
+      ix = (i % 50 == 0) ? rand() % len : (ix + rand() % 7) % len;
+      assert(RLEVector_get(vec, ix) == ref[ix]);
+      assert(RLEVector_testAndSet(vec, ix) == ref[ix]);
+      ref[ix] = 1;
+    }
+    for (ix = 0; ix < len; ix++) {
+      assert(RLEVector_get(vec, ix) == ref[ix]);
+    }
+    RLEVector_destroy(vec);
+  }
+
+  free(ref);
   logMsg(LOG_INFO, "...test passed");
 }
 
@@ -112,6 +274,11 @@ int main(int argc, char** argv) {
 
   testSetGet();
   testRuns();
+  testTestAndSet();
+  testFinger();
+  testTrimBelow();
+  testClear();
+  testAgainstBitArray();
 
   return 0;
 }
\ No newline at end of file
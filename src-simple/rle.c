@@ -22,6 +22,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "rle.h"
+#include "rle-kernel.h"
 #include "log.h"
 #include "vendor/avl_tree.h"
 
@@ -29,11 +30,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <stdio.h>
 
-#define BIT_ISSET(x, i) ( ( (x) & ( (1) << (i) ) ) != 0 )
-#define BIT_SET(x, i) ( (x) | ( (1) << (i) ) ) /* Returns with bit set */
 /* Offset within a k-bit run. [0, bitsPerRun). */
 #define RUN_OFFSET(ix, bitsPerRun) ( (ix) % (bitsPerRun) ) 
-#define MASK_FOR(ix, bitsPerRun) ( BIT_SET(0, RUN_OFFSET(ix, bitsPerRun)) )
 /* Run number within a repeating sequence of k-bit runs. [0, nRuns). */
 #define RUN_NUMBER(ix, rleStart, bitsPerRun) ( ( (ix) - (rleStart) ) / (bitsPerRun) )
 
@@ -50,9 +48,9 @@ struct RLENode
   int offset; /* Key */
   int nRuns;  
 
-  /* A bit representation of the run sequence.
-   * We look at bits 0, 1, 2, 3, ... (right-to-left).  */
-  unsigned long long run; /* 64 bits -- does this need to be longer? */
+  /* A bit representation of the run sequence (see rle-kernel.h).
+   * The node owns its kernel. */
+  RLEKernel run;
   int nBitsInRun; /* How many bits to look at */
 
   struct avl_tree_node node;
@@ -78,9 +76,9 @@ RLENode_contains(RLENode *node, int ix)
 }
 
 static int
-RLENode_canMerge(RLENode *l, RLENode *r)
+RLENode_canMerge(RLEKernelPool *pool, RLENode *l, RLENode *r)
 {
-  return (l->run == r->run) && \
+  return RLEKernel_equal(pool, l->run, r->run) && \
     RLENode_end(l) == r->offset;
 }
 
@@ -104,7 +102,7 @@ RLENode_avl_tree_cmp(const struct avl_tree_node *target, const struct avl_tree_n
 }
 
 static RLENode *
-RLENode_create(int offset, int nRuns, unsigned long long run, int nBitsInRun)
+RLENode_create(int offset, int nRuns, RLEKernel run, int nBitsInRun)
 {
   RLENode *node = malloc(sizeof *node);
   node->offset = offset;
@@ -124,23 +122,33 @@ struct RLEVector
   int mostNEntries; /* High water mark */
   int nBitsInRun; /* Length of the runs we encode */
   int autoValidate; /* Validate after every API usage. This can be wildly expensive. */
+  RLEKernelPool kernels;
+
+  /* Finger: the last run we touched. Accesses are local, so we try it and its
+   * in-order neighbors before searching from the root. */
+  RLENode *finger;
+  long nFingerLookups;
+  long nFingerHits;
 };
 
 RLEVector *
 RLEVector_create(int runLength, int autoValidate)
 {
-  RLENode node;
   RLEVector *vec = malloc(sizeof *vec);
   vec->root = NULL;
+  vec->finger = NULL;
+  vec->nFingerLookups = 0;
+  vec->nFingerHits = 0;
   vec->currNEntries = 0;
   vec->mostNEntries = 0;
   vec->nBitsInRun = runLength;
 
-  if (runLength > 8 * sizeof(node.run)) {
-    logMsg(LOG_INFO, "RLEVector_create: Need %d bits, only have %llu", runLength, 8llu * sizeof(node.run));
+  if (runLength > RLE_KERNEL_MAX_BITS) {
+    logMsg(LOG_INFO, "RLEVector_create: Need %d bits, only support %d", runLength, RLE_KERNEL_MAX_BITS);
     vec->nBitsInRun = 1;
   }
   vec->autoValidate = autoValidate;
+  RLEKernelPool_init(&vec->kernels, vec->nBitsInRun);
 
   logMsg(LOG_VERBOSE, "RLEVector_create: vec %p nBitsInRun %d, autoValidate %d", vec, vec->nBitsInRun, vec->autoValidate);
 
@@ -170,10 +178,10 @@ _RLEVector_validate(RLEVector *vec)
     }
 
     while (prev != NULL && curr != NULL) {
-      logMsg(LOG_DEBUG, "rleVector_validate: prev (%d,%d,%llu) curr (%d,%d,%llu)", prev->offset, prev->nRuns, prev->run, curr->offset, curr->nRuns, curr->run);
+      logMsg(LOG_DEBUG, "rleVector_validate: prev (%d,%d,%llu) curr (%d,%d,%llu)", prev->offset, prev->nRuns, RLEKernel_lowWord(&vec->kernels, prev->run), curr->offset, curr->nRuns, RLEKernel_lowWord(&vec->kernels, curr->run));
       assert(prev->offset < curr->offset); /* In-order */
 			if (RLENode_end(prev) == curr->offset) {
-				if (prev->run == curr->run){ 
+				if (RLEKernel_equal(&vec->kernels, prev->run, curr->run)){ 
           /* Adjacent identical runs should have been merged */
           assert(!"rleVector_validate: Adjacent identical runs are not merged");
         }
@@ -196,6 +204,59 @@ struct RLENodeNeighbors
   RLENode *c; /* Successor -- first after */
 };
 
+/* Try to resolve the neighbors of ix from the finger and its in-order neighbors.
+ * Returns 1 on success, 0 if we need a search from the root. */
+static int
+_RLEVector_fingerNeighbors(RLEVector *vec, int ix, RLENodeNeighbors *rnn)
+{
+  RLENode *f = vec->finger, *p = NULL, *n = NULL;
+
+  if (f == NULL) {
+    return 0;
+  }
+
+  if (RLENode_contains(f, ix)) {
+    rnn->a = avl_tree_entry(avl_tree_prev_in_order(&f->node), RLENode, node);
+    rnn->b = f;
+    rnn->c = avl_tree_entry(avl_tree_next_in_order(&f->node), RLENode, node);
+    return 1;
+  }
+
+  if (ix < f->offset) {
+    /* Left of the finger: ix lies in p, between p and f, or further left */
+    p = avl_tree_entry(avl_tree_prev_in_order(&f->node), RLENode, node);
+    if (p == NULL || RLENode_end(p) <= ix) {
+      rnn->a = p;
+      rnn->b = NULL;
+      rnn->c = f;
+      return 1;
+    }
+    if (RLENode_contains(p, ix)) {
+      rnn->a = avl_tree_entry(avl_tree_prev_in_order(&p->node), RLENode, node);
+      rnn->b = p;
+      rnn->c = f;
+      return 1;
+    }
+  } else {
+    /* Right of the finger: ix lies between f and n, in n, or further right */
+    n = avl_tree_entry(avl_tree_next_in_order(&f->node), RLENode, node);
+    if (n == NULL || ix < n->offset) {
+      rnn->a = f;
+      rnn->b = NULL;
+      rnn->c = n;
+      return 1;
+    }
+    if (RLENode_contains(n, ix)) {
+      rnn->a = f;
+      rnn->b = n;
+      rnn->c = avl_tree_entry(avl_tree_next_in_order(&n->node), RLENode, node);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 static RLENodeNeighbors
 RLEVector_getNeighbors(RLEVector *vec, int ix)
 {
@@ -205,6 +266,13 @@ RLEVector_getNeighbors(RLEVector *vec, int ix)
   rnn.b = NULL;
   rnn.c = NULL;
 
+  vec->nFingerLookups++;
+  if (_RLEVector_fingerNeighbors(vec, ix, &rnn)) {
+    vec->nFingerHits++;
+    logMsg(LOG_DEBUG, "rnn (finger): a %p b %p c %p\n", rnn.a, rnn.b, rnn.c);
+    return rnn;
+  }
+
   target.offset = ix;
   target.nRuns = -1;
 
@@ -233,8 +301,9 @@ RLEVector_getNeighbors(RLEVector *vec, int ix)
 	return rnn;
 }
 
-/* Given a populated RNN, merge a-b and b-c if possible. */
-static void
+/* Given a populated RNN, merge a-b and b-c if possible.
+ * Returns the run that now holds b. */
+static RLENode *
 _RLEVector_mergeNeighbors(RLEVector *vec, RLENodeNeighbors rnn)
 {
   logMsg(LOG_DEBUG, "mergeNeighbors: begins");
@@ -243,23 +312,25 @@ _RLEVector_mergeNeighbors(RLEVector *vec, RLENodeNeighbors rnn)
 
   /* Because rnn are adjacent, we can directly manipulate offsets without
    * breaking the BST property. */
-  if (rnn.a != NULL && rnn.b != NULL && RLENode_canMerge(rnn.a, rnn.b)) {
+  if (rnn.a != NULL && rnn.b != NULL && RLENode_canMerge(&vec->kernels, rnn.a, rnn.b)) {
     _RLEVector_removeRun(vec, rnn.b);
 
     rnn.a->nRuns += rnn.b->nRuns;
 
-    logMsg(LOG_DEBUG, "merge: Removed (%d,%d), merged with now-(%d,%d,%llu)", rnn.b->offset, rnn.b->nRuns, rnn.a->offset, rnn.a->nRuns, rnn.a->run);
+    logMsg(LOG_DEBUG, "merge: Removed (%d,%d), merged with now-(%d,%d,%llu)", rnn.b->offset, rnn.b->nRuns, rnn.a->offset, rnn.a->nRuns, RLEKernel_lowWord(&vec->kernels, rnn.a->run));
+    RLEKernel_release(&vec->kernels, rnn.b->run);
     free(rnn.b);
 
     /* Set b to a, so that the next logic will work. */
     rnn.b = rnn.a;
   }
-  if (rnn.b != NULL && rnn.c != NULL && RLENode_canMerge(rnn.b, rnn.c)) {
+  if (rnn.b != NULL && rnn.c != NULL && RLENode_canMerge(&vec->kernels, rnn.b, rnn.c)) {
     _RLEVector_removeRun(vec, rnn.c);
 
     rnn.b->nRuns += rnn.c->nRuns;
-    logMsg(LOG_DEBUG, "merge: Removed (%d,%d), merged with now-(%d,%d,%llu)", rnn.c->offset, rnn.c->nRuns, rnn.b->offset, rnn.b->nRuns, rnn.b->run);
+    logMsg(LOG_DEBUG, "merge: Removed (%d,%d), merged with now-(%d,%d,%llu)", rnn.c->offset, rnn.c->nRuns, rnn.b->offset, rnn.b->nRuns, RLEKernel_lowWord(&vec->kernels, rnn.b->run));
 
+    RLEKernel_release(&vec->kernels, rnn.c->run);
     free(rnn.c);
   }
 
@@ -267,6 +338,8 @@ _RLEVector_mergeNeighbors(RLEVector *vec, RLENodeNeighbors rnn)
 
   if (vec->autoValidate)
     _RLEVector_validate(vec);
+
+  return rnn.b;
 }
 
 int
@@ -275,33 +348,25 @@ RLEVector_runSize(RLEVector *vec)
   return vec->nBitsInRun;
 }
 
-/* Set the bit at ix.
+/* Set the bit at ix, given its neighbors from RLEVector_getNeighbors.
+ * The bit must not be set already.
  * Invariant: always returns with vec fully merged; validate() should pass.
  */
-void
-RLEVector_set(RLEVector *vec, int ix)
+static void
+_RLEVector_setWithNeighbors(RLEVector *vec, int ix, RLENodeNeighbors rnn)
 {
-  RLENodeNeighbors rnn;
   RLENode *newRun = NULL;
-  int oldRunKernel = 0, newRunKernel = 0;
+  RLEKernel oldRunKernel, newRunKernel;
 	int roundedIx = ix - RUN_OFFSET(ix, vec->nBitsInRun);
 
-  logMsg(LOG_VERBOSE, "RLEVector_set: %d", ix);
-
-  if (vec->autoValidate)
-    _RLEVector_validate(vec);
-
-  assert(RLEVector_get(vec, ix) == 0); /* Shouldn't be set already */
-
-  rnn = RLEVector_getNeighbors(vec, ix);
-
   /* Handle the "new" and "split" cases.
    * Update rnn.{a,b,c} as we go. */
   if (rnn.b == NULL) {
     /* Case: creates a run */
     logMsg(LOG_DEBUG, "%d: Creating a run", ix);
 
-    newRunKernel = MASK_FOR(ix, vec->nBitsInRun);
+    newRunKernel = RLEKernel_new(&vec->kernels);
+    RLEKernel_set(&vec->kernels, &newRunKernel, RUN_OFFSET(ix, vec->nBitsInRun));
     newRun = RLENode_create(roundedIx, 1, newRunKernel, vec->nBitsInRun);
 
     _RLEVector_addRun(vec, newRun);
@@ -311,12 +376,13 @@ RLEVector_set(RLEVector *vec, int ix)
     RLENode *prefixRun = NULL, *oldRun = NULL, *suffixRun = NULL;
     int ixRunNumber = 0, nRunsInPrefix = 0, nRunsInSuffix = 0;
 
-    logMsg(LOG_DEBUG, "%d: Splitting the run (%d,%d,%llu)", ix, rnn.b->offset, rnn.b->nRuns, rnn.b->run);
+    logMsg(LOG_DEBUG, "%d: Splitting the run (%d,%d,%llu)", ix, rnn.b->offset, rnn.b->nRuns, RLEKernel_lowWord(&vec->kernels, rnn.b->run));
 
     /* Calculate the run kernels */
     oldRun = rnn.b;
     oldRunKernel = oldRun->run;
-    newRunKernel = oldRunKernel | MASK_FOR(ix, vec->nBitsInRun);
+    newRunKernel = RLEKernel_copy(&vec->kernels, oldRunKernel);
+    RLEKernel_set(&vec->kernels, &newRunKernel, RUN_OFFSET(ix, vec->nBitsInRun));
 
     /* Remove the affected run */
     _RLEVector_removeRun(vec, oldRun);
@@ -334,6 +400,7 @@ RLEVector_set(RLEVector *vec, int ix)
 
     if (nRunsInPrefix > 0) {
       logMsg(LOG_DEBUG, "adding prefix");
+      /* The prefix inherits the old kernel */
       prefixRun = RLENode_create(oldRun->offset, nRunsInPrefix, oldRunKernel, vec->nBitsInRun);
       _RLEVector_addRun(vec, prefixRun);
 
@@ -341,19 +408,25 @@ RLEVector_set(RLEVector *vec, int ix)
     }
     if (nRunsInSuffix > 0) {
       logMsg(LOG_DEBUG, "adding suffix");
-      suffixRun = RLENode_create(roundedIx + vec->nBitsInRun, nRunsInSuffix, oldRunKernel, vec->nBitsInRun);
+      /* ...so the suffix needs its own copy, unless there was no prefix */
+      suffixRun = RLENode_create(roundedIx + vec->nBitsInRun, nRunsInSuffix,
+        (nRunsInPrefix > 0) ? RLEKernel_copy(&vec->kernels, oldRunKernel) : oldRunKernel,
+        vec->nBitsInRun);
       _RLEVector_addRun(vec, suffixRun);
 
       rnn.c = suffixRun;
     }
 
     /* Clean up */
+    if (nRunsInPrefix == 0 && nRunsInSuffix == 0) {
+      RLEKernel_release(&vec->kernels, oldRunKernel);
+    }
     free(oldRun);
   }
 
-  logMsg(LOG_DEBUG, "Before merge: run is (%d,%d,%llu)", rnn.b->offset, rnn.b->nRuns, rnn.b->run);
+  logMsg(LOG_DEBUG, "Before merge: run is (%d,%d,%llu)", rnn.b->offset, rnn.b->nRuns, RLEKernel_lowWord(&vec->kernels, rnn.b->run));
 
-  _RLEVector_mergeNeighbors(vec, rnn);
+  vec->finger = _RLEVector_mergeNeighbors(vec, rnn);
   /* After merging, rnn.{a,b,c} is untrustworthy. */
   
   if (vec->autoValidate)
@@ -362,10 +435,48 @@ RLEVector_set(RLEVector *vec, int ix)
   return;
 }
 
+void
+RLEVector_set(RLEVector *vec, int ix)
+{
+  RLENodeNeighbors rnn;
+
+  logMsg(LOG_VERBOSE, "RLEVector_set: %d", ix);
+
+  if (vec->autoValidate)
+    _RLEVector_validate(vec);
+
+  rnn = RLEVector_getNeighbors(vec, ix);
+  /* Shouldn't be set already */
+  assert(rnn.b == NULL || !RLEKernel_isSet(&vec->kernels, rnn.b->run, RUN_OFFSET(ix, vec->nBitsInRun)));
+
+  _RLEVector_setWithNeighbors(vec, ix, rnn);
+}
+
+int
+RLEVector_testAndSet(RLEVector *vec, int ix)
+{
+  RLENodeNeighbors rnn;
+
+  logMsg(LOG_VERBOSE, "RLEVector_testAndSet: %d", ix);
+
+  if (vec->autoValidate)
+    _RLEVector_validate(vec);
+
+  /* One descent finds the run containing ix (if any) and the neighbors we would merge with */
+  rnn = RLEVector_getNeighbors(vec, ix);
+  if (rnn.b != NULL && RLEKernel_isSet(&vec->kernels, rnn.b->run, RUN_OFFSET(ix, vec->nBitsInRun))) {
+    vec->finger = rnn.b;
+    return 1;
+  }
+
+  _RLEVector_setWithNeighbors(vec, ix, rnn);
+  return 0;
+}
+
 int
 RLEVector_get(RLEVector *vec, int ix)
 {
-  RLENode target;
+  RLENodeNeighbors rnn;
   RLENode *match = NULL;
 
   logMsg(LOG_DEBUG, "RLEVector_get: %d", ix);
@@ -373,18 +484,52 @@ RLEVector_get(RLEVector *vec, int ix)
   if (vec->autoValidate)
     _RLEVector_validate(vec);
 
-  target.offset = ix;
-  target.nRuns = -1;
-  match = avl_tree_entry(
-    avl_tree_lookup_node(vec->root, &target.node, RLENode_avl_tree_cmp),
-    RLENode, node);
+  rnn = RLEVector_getNeighbors(vec, ix);
+  match = rnn.b;
+  /* Leave the finger nearby even if we missed */
+  vec->finger = (rnn.b != NULL) ? rnn.b : (rnn.a != NULL) ? rnn.a : rnn.c;
 
   if (match == NULL) {
     return 0;
   }
 
   logMsg(LOG_DEBUG, "match: %p", match);
-  return BIT_ISSET(match->run, ix % match->nBitsInRun);
+  return RLEKernel_isSet(&vec->kernels, match->run, RUN_OFFSET(ix, vec->nBitsInRun));
+}
+
+void
+RLEVector_trimBelow(RLEVector *vec, int ix)
+{
+  RLENode *first = NULL;
+  int nTrimmed = 0;
+
+  while ((first = avl_tree_entry(avl_tree_first_in_order(vec->root), RLENode, node)) != NULL
+      && RLENode_end(first) <= ix) {
+    _RLEVector_removeRun(vec, first);
+    RLEKernel_release(&vec->kernels, first->run);
+    free(first);
+    nTrimmed++;
+  }
+
+  logMsg(LOG_DEBUG, "RLEVector_trimBelow: vec %p trimmed %d runs below %d", vec, nTrimmed, ix);
+}
+
+void
+RLEVector_clear(RLEVector *vec)
+{
+  RLENode *node = NULL;
+
+  logMsg(LOG_DEBUG, "RLEVector_clear: vec %p dropping %d runs", vec, vec->currNEntries);
+  avl_tree_for_each_in_postorder(node, vec->root, RLENode, node)
+    free(node);
+  RLEKernelPool_reset(&vec->kernels);
+
+  vec->root = NULL;
+  vec->finger = NULL;
+  vec->nFingerLookups = 0;
+  vec->nFingerHits = 0;
+  vec->currNEntries = 0;
+  vec->mostNEntries = 0;
 }
 
 int
@@ -399,11 +544,31 @@ RLEVector_maxObservedSize(RLEVector *vec)
   return vec->mostNEntries;
 }
 
+long
+RLEVector_nFingerLookups(RLEVector *vec)
+{
+  return vec->nFingerLookups;
+}
+
+long
+RLEVector_nFingerHits(RLEVector *vec)
+{
+  return vec->nFingerHits;
+}
+
+int
+RLEVector_currBytes(RLEVector *vec)
+{
+  return sizeof(RLEVector) \
+    + (sizeof(RLENode) + RLEKernelPool_kernelBytes(&vec->kernels)) * RLEVector_currSize(vec) \
+    ;
+}
+
 int
 RLEVector_maxBytes(RLEVector *vec)
 {
   return sizeof(RLEVector) /* Internal overhead */ \
-    + sizeof(RLENode) * RLEVector_maxObservedSize(vec) /* Cost per node */ \
+    + (sizeof(RLENode) + RLEKernelPool_kernelBytes(&vec->kernels)) * RLEVector_maxObservedSize(vec) /* Cost per node */ \
     ;
 }
 
@@ -413,6 +578,7 @@ RLEVector_destroy(RLEVector *vec)
   RLENode *node = NULL;
   avl_tree_for_each_in_postorder(node, vec->root, RLENode, node)
     free(node);
+  RLEKernelPool_destroy(&vec->kernels); /* Frees the kernels too */
   free(vec);
 
   return;
@@ -420,7 +586,7 @@ RLEVector_destroy(RLEVector *vec)
 
 static void _RLEVector_addRun(RLEVector *vec, RLENode *node)
 {
-  logMsg(LOG_DEBUG, "Adding run (%d,%d,%llu)", node->offset, node->nRuns, node->run);
+  logMsg(LOG_DEBUG, "Adding run (%d,%d,%llu)", node->offset, node->nRuns, RLEKernel_lowWord(&vec->kernels, node->run));
 
 	assert(avl_tree_insert(&vec->root, &node->node, RLENode_avl_tree_cmp) == NULL);
   vec->currNEntries++;
@@ -431,10 +597,13 @@ static void _RLEVector_addRun(RLEVector *vec, RLENode *node)
 
 static void _RLEVector_removeRun(RLEVector *vec, RLENode *node)
 {
-	logMsg(LOG_DEBUG, "Removing run (%d,%d,%llu)", node->offset, node->nRuns, node->run);
+	logMsg(LOG_DEBUG, "Removing run (%d,%d,%llu)", node->offset, node->nRuns, RLEKernel_lowWord(&vec->kernels, node->run));
 
 	avl_tree_remove(&vec->root, &node->node);
   vec->currNEntries--;
+  if (vec->finger == node) {
+    vec->finger = NULL;
+  }
 
   if (vec->autoValidate)
     _RLEVector_validate(vec);
@@ -38,6 +38,21 @@ RLEVector_set(RLEVector *vec, int ix);
 int
 RLEVector_get(RLEVector *vec, int ix);
 
+/* Set this ix to 1. Returns its previous value (0 or 1).
+ * Costs one lookup, vs. two for get-then-set. */
+int
+RLEVector_testAndSet(RLEVector *vec, int ix);
+
+/* Discard the runs that lie entirely below ix.
+ * The caller promises not to query below ix again. */
+void
+RLEVector_trimBelow(RLEVector *vec, int ix);
+
+/* Back to all zeros, with a fresh high water mark and finger counts.
+ * Keeps the run length, and whatever storage can be reused. */
+void
+RLEVector_clear(RLEVector *vec);
+
 /* Size of the runs in use */
 int
 RLEVector_runSize(RLEVector *vec);
@@ -50,6 +65,18 @@ RLEVector_currSize(RLEVector *vec);
 int 
 RLEVector_maxObservedSize(RLEVector *vec);
 
+/* Lookups, and how many of them the finger (the last run touched)
+ * resolved without a search from the root */
+long
+RLEVector_nFingerLookups(RLEVector *vec);
+
+long
+RLEVector_nFingerHits(RLEVector *vec);
+
+/* How many bytes to represent this RLE vector now? */
+int
+RLEVector_currBytes(RLEVector *vec);
+
 // How many bytes to represent this RLE vector at its peak? 
 int
 RLEVector_maxBytes(RLEVector *vec);
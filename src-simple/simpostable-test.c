@@ -0,0 +1,265 @@
+/*
+Copyright (c) 2020, James Davis http://people.cs.vt.edu/davisjam/
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "simpostable.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Enough to grow the table (initially 1024 slots) several times */
+#define N_KEYS 20000
+
+/* Key n of keyLen ints: < q, i, ... >. Distinct for distinct n, and non-negative. */
+static void
+makeKey(int n, int keyLen, int *key)
+{
+  int j;
+  key[0] = n % 37;
+  key[1] = n / 37;
+  for (j = 2; j < keyLen; j++)
+    key[j] = (n * j) % 101; /* Determined by n, but shared by many keys */
+}
+
+static int
+keepEven(const int *key, void *arg)
+{
+  int keyLen = *(int *) arg;
+  assert(keyLen >= 2);
+  return (key[1] * 37 + key[0]) % 2 == 0;
+}
+
+static int
+keepNone(const int *key, void *arg)
+{
+  return 0;
+}
+
+void testInsertContains(int keyLen) {
+  logMsg(LOG_INFO, "Test begins: testInsertContains (keyLen %d)", keyLen);
+  SimPosTable *table = SimPosTable_create(keyLen);
+  long emptyOverhead = SimPosTable_overheadBytes(table);
+  int key[16];
+  int n;
+
+  logMsg(LOG_INFO, "  empty");
+  makeKey(0, keyLen, key);
+  assert(!SimPosTable_contains(table, key));
+  assert(SimPosTable_count(table) == 0);
+
+  logMsg(LOG_INFO, "  insert %d keys, growing across resizes", N_KEYS);
+  for (n = 0; n < N_KEYS; n++) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_insert(table, key) == 0);
+    assert(SimPosTable_contains(table, key));
+  }
+  assert(SimPosTable_count(table) == N_KEYS);
+  assert(SimPosTable_overheadBytes(table) > emptyOverhead); /* It grew */
+
+  logMsg(LOG_INFO, "  every key survived the resizes");
+  for (n = 0; n < N_KEYS; n++) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_contains(table, key));
+  }
+
+  logMsg(LOG_INFO, "  reinserting is a hit, and adds nothing");
+  for (n = 0; n < N_KEYS; n += 7) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_insert(table, key) == 1);
+  }
+  assert(SimPosTable_count(table) == N_KEYS);
+
+  logMsg(LOG_INFO, "  absent keys");
+  for (n = N_KEYS; n < 2 * N_KEYS; n++) {
+    makeKey(n, keyLen, key);
+    assert(!SimPosTable_contains(table, key));
+  }
+
+  SimPosTable_destroy(table);
+  logMsg(LOG_INFO, "...test passed");
+}
+
+void testWideKeys() {
+  logMsg(LOG_INFO, "Test begins: testWideKeys");
+  SimPosTable *table = SimPosTable_create(4);
+  int a[4] = { 3, 5, 0, 2 }, b[4] = { 3, 5, 0, 1 }, c[4] = { 3, 5, 1, 2 };
+
+  logMsg(LOG_INFO, "  keys that share <q, i> are distinct by their tails");
+  assert(SimPosTable_insert(table, a) == 0);
+  assert(!SimPosTable_contains(table, b));
+  assert(!SimPosTable_contains(table, c));
+  assert(SimPosTable_insert(table, b) == 0);
+  assert(SimPosTable_insert(table, c) == 0);
+  assert(SimPosTable_insert(table, a) == 1);
+  assert(SimPosTable_count(table) == 3);
+  assert(SimPosTable_bytesPerEntry(table) >= 4 * sizeof(int));
+
+  logMsg(LOG_INFO, "  the table copies the key");
+  a[3] = 9;
+  assert(!SimPosTable_contains(table, a));
+  a[3] = 2;
+  assert(SimPosTable_contains(table, a));
+
+  SimPosTable_destroy(table);
+  logMsg(LOG_INFO, "...test passed");
+}
+
+void testFilter(int keyLen) {
+  logMsg(LOG_INFO, "Test begins: testFilter (keyLen %d)", keyLen);
+  SimPosTable *table = SimPosTable_create(keyLen);
+  int key[16];
+  int n;
+
+  for (n = 0; n < N_KEYS; n++) {
+    makeKey(n, keyLen, key);
+    SimPosTable_insert(table, key);
+  }
+
+  logMsg(LOG_INFO, "  keep the even keys");
+  SimPosTable_filter(table, keepEven, &keyLen);
+  assert(SimPosTable_count(table) == N_KEYS / 2);
+  for (n = 0; n < N_KEYS; n++) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_contains(table, key) == (n % 2 == 0));
+  }
+
+  logMsg(LOG_INFO, "  reinsert: the dropped keys are new, the kept ones are hits");
+  for (n = 0; n < N_KEYS; n++) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_insert(table, key) == (n % 2 == 0));
+  }
+  assert(SimPosTable_count(table) == N_KEYS);
+
+  logMsg(LOG_INFO, "  filter again, and refill the rebuilt table");
+  SimPosTable_filter(table, keepEven, &keyLen);
+  assert(SimPosTable_count(table) == N_KEYS / 2);
+  for (n = 1; n < N_KEYS; n += 2) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_insert(table, key) == 0);
+  }
+  assert(SimPosTable_count(table) == N_KEYS);
+
+  SimPosTable_destroy(table);
+  logMsg(LOG_INFO, "...test passed");
+}
+
+void testCreateWithin(int keyLen) {
+  logMsg(LOG_INFO, "Test begins: testCreateWithin (keyLen %d)", keyLen);
+  SimPosTable *table = SimPosTable_createWithin(keyLen, 1024);
+  long overhead = SimPosTable_overheadBytes(table);
+  int key[16];
+  int n;
+
+  logMsg(LOG_INFO, "  starts within the limit (%ld bytes)", overhead);
+  assert(overhead <= 1024);
+
+  logMsg(LOG_INFO, "  grows past it as usual");
+  for (n = 0; n < 1000; n++) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_insert(table, key) == 0);
+  }
+  assert(SimPosTable_overheadBytes(table) > overhead);
+
+  logMsg(LOG_INFO, "  a filter starts over from the small table");
+  SimPosTable_filter(table, keepEven, &keyLen);
+  for (n = 0; n < 1000; n++) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_contains(table, key) == (n % 2 == 0));
+  }
+  for (n = 0; n < 1000; n += 2) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_insert(table, key) == 1);
+  }
+  SimPosTable_filter(table, keepNone, NULL);
+  assert(SimPosTable_count(table) == 0);
+  assert(SimPosTable_overheadBytes(table) == overhead);
+
+  logMsg(LOG_INFO, "  there is a floor");
+  SimPosTable_destroy(table);
+  table = SimPosTable_createWithin(keyLen, 0);
+  assert(SimPosTable_overheadBytes(table) > 0);
+  makeKey(0, keyLen, key);
+  assert(SimPosTable_insert(table, key) == 0);
+  assert(SimPosTable_contains(table, key));
+
+  SimPosTable_destroy(table);
+  logMsg(LOG_INFO, "...test passed");
+}
+
+void testClear(int keyLen) {
+  logMsg(LOG_INFO, "Test begins: testClear (keyLen %d)", keyLen);
+  SimPosTable *table = SimPosTable_create(keyLen);
+  long overhead;
+  int key[16];
+  int n, round;
+
+  for (round = 0; round < 3; round++) {
+    logMsg(LOG_INFO, "  round %d: fill, clear, and nothing is left", round);
+    for (n = round; n < N_KEYS; n += 2) {
+      makeKey(n, keyLen, key);
+      assert(SimPosTable_insert(table, key) == 0);
+    }
+    overhead = SimPosTable_overheadBytes(table);
+    SimPosTable_clear(table);
+    assert(SimPosTable_count(table) == 0);
+    assert(SimPosTable_overheadBytes(table) == overhead); /* Keeps its slots */
+    for (n = 0; n < N_KEYS; n++) {
+      makeKey(n, keyLen, key);
+      assert(!SimPosTable_contains(table, key));
+    }
+  }
+
+  logMsg(LOG_INFO, "  a cleared table fills up like a new one");
+  for (n = 0; n < N_KEYS; n++) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_insert(table, key) == 0);
+  }
+  for (n = 0; n < N_KEYS; n += 3) {
+    makeKey(n, keyLen, key);
+    assert(SimPosTable_insert(table, key) == 1);
+  }
+  assert(SimPosTable_count(table) == N_KEYS);
+
+  SimPosTable_destroy(table);
+  logMsg(LOG_INFO, "...test passed");
+}
+
+int main(int argc, char** argv) {
+  logMsg(LOG_INFO, "Running the SimPosTable unit test suite...");
+
+  /* Packed <q, i> keys; wide keys as for one CG, and for two CGs plus a counter */
+  testInsertContains(2);
+  testInsertContains(4);
+  testInsertContains(7);
+  testWideKeys();
+  testFilter(2);
+  testFilter(5);
+  testCreateWithin(2);
+  testCreateWithin(5);
+  testClear(2);
+  testClear(5);
+
+  return 0;
+}
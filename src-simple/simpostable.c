@@ -0,0 +1,321 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "simpostable.h"
+#include "arena.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPT_INITIAL_CAPACITY 1024 /* Power of 2 */
+#define SPT_MIN_CAPACITY 16
+#define SPT_ARENA_CHUNK_BYTES (64 * 1024)
+/* Keys are non-negative, so a packed key can never be all ones */
+#define SPT_EMPTY UINT64_MAX
+/* Grow once more than 3/4 full */
+#define SPT_SHOULD_GROW(count, capacity) ( 4 * (count) > 3 * (capacity) )
+/* So this many keys fit before we grow */
+#define SPT_MAX_COUNT(capacity) ( (capacity) / 4 * 3 )
+
+typedef struct WideSlot WideSlot;
+struct WideSlot
+{
+  uint64_t hash;
+  int *key; /* NULL if empty. Points into the arena. */
+};
+
+struct SimPosTable
+{
+  int keyLen; /* ints per key */
+  int count;
+  int capacity; /* Power of 2 */
+  int initialCapacity; /* SimPosTable_filter starts over from here */
+  int *used; /* Slot of each key, in insertion order. SimPosTable_clear empties just these. */
+
+  /* keyLen == 2 */
+  uint64_t *slots;
+
+  /* keyLen > 2 */
+  WideSlot *wideSlots;
+  Arena *arena;
+};
+
+/* splitmix64 finalizer -- cheap, and good enough to spread sequential offsets */
+static uint64_t
+_mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t
+_pack(const int *key)
+{
+  return ((uint64_t) (uint32_t) key[0] << 32) | (uint32_t) key[1];
+}
+
+static uint64_t
+_hashWide(const int *key, int keyLen)
+{
+  uint64_t h = 0;
+  int i;
+  for (i = 0; i < keyLen; i++) {
+    h = _mix64(h ^ (uint32_t) key[i]);
+  }
+  return h;
+}
+
+/* Slot holding packed, or the empty slot where it belongs */
+static int
+_probePacked(SimPosTable *table, uint64_t packed)
+{
+  int mask = table->capacity - 1;
+  int ix = _mix64(packed) & mask;
+  while (table->slots[ix] != SPT_EMPTY && table->slots[ix] != packed) {
+    ix = (ix + 1) & mask;
+  }
+  return ix;
+}
+
+static int
+_probeWide(SimPosTable *table, const int *key, uint64_t hash)
+{
+  int mask = table->capacity - 1;
+  int ix = hash & mask;
+  while (table->wideSlots[ix].key != NULL) {
+    if (table->wideSlots[ix].hash == hash
+     && memcmp(table->wideSlots[ix].key, key, table->keyLen * sizeof(int)) == 0) {
+      break;
+    }
+    ix = (ix + 1) & mask;
+  }
+  return ix;
+}
+
+static long
+_overheadBytes(int keyLen, int capacity)
+{
+  int slotBytes = (keyLen == 2) ? sizeof(uint64_t) : sizeof(WideSlot);
+  return sizeof(SimPosTable) + (long) capacity * slotBytes + (long) SPT_MAX_COUNT(capacity) * sizeof(int);
+}
+
+static void
+_allocSlots(SimPosTable *table, int capacity)
+{
+  table->capacity = capacity;
+  table->used = malloc(SPT_MAX_COUNT(capacity) * sizeof(*table->used));
+  assert(table->used != NULL);
+  if (table->keyLen == 2) {
+    table->slots = malloc(capacity * sizeof(*table->slots));
+    assert(table->slots != NULL);
+    memset(table->slots, 0xff, capacity * sizeof(*table->slots)); /* SPT_EMPTY */
+  } else {
+    table->wideSlots = calloc(capacity, sizeof(*table->wideSlots));
+    assert(table->wideSlots != NULL);
+  }
+}
+
+/* Double the capacity and re-insert, in the order of the used log. Wide keys stay where they are in the arena. */
+static void
+_grow(SimPosTable *table)
+{
+  int i, ix, oldCapacity = table->capacity;
+  uint64_t *oldSlots = table->slots;
+  WideSlot *oldWideSlots = table->wideSlots;
+  int *oldUsed = table->used;
+
+  logMsg(LOG_DEBUG, "SimPosTable %p: growing from %d to %d slots (%d keys)", table, oldCapacity, 2 * oldCapacity, table->count);
+  _allocSlots(table, 2 * oldCapacity);
+
+  if (table->keyLen == 2) {
+    for (i = 0; i < table->count; i++) {
+      ix = _probePacked(table, oldSlots[ oldUsed[i] ]);
+      table->slots[ix] = oldSlots[ oldUsed[i] ];
+      table->used[i] = ix;
+    }
+    free(oldSlots);
+  } else {
+    for (i = 0; i < table->count; i++) {
+      ix = _probeWide(table, oldWideSlots[ oldUsed[i] ].key, oldWideSlots[ oldUsed[i] ].hash);
+      table->wideSlots[ix] = oldWideSlots[ oldUsed[i] ];
+      table->used[i] = ix;
+    }
+    free(oldWideSlots);
+  }
+  free(oldUsed);
+}
+
+static SimPosTable *
+_create(int keyLen, int capacity)
+{
+  SimPosTable *table = malloc(sizeof *table);
+  assert(table != NULL);
+  assert(keyLen >= 2);
+
+  table->keyLen = keyLen;
+  table->count = 0;
+  table->initialCapacity = capacity;
+  table->slots = NULL;
+  table->wideSlots = NULL;
+  table->arena = (keyLen == 2) ? NULL : Arena_create(SPT_ARENA_CHUNK_BYTES);
+  _allocSlots(table, capacity);
+
+  logMsg(LOG_DEBUG, "SimPosTable_create: table %p keyLen %d capacity %d", table, keyLen, capacity);
+  return table;
+}
+
+SimPosTable *
+SimPosTable_create(int keyLen)
+{
+  return _create(keyLen, SPT_INITIAL_CAPACITY);
+}
+
+SimPosTable *
+SimPosTable_createWithin(int keyLen, long maxOverheadBytes)
+{
+  int capacity = SPT_INITIAL_CAPACITY;
+
+  while (capacity > SPT_MIN_CAPACITY && _overheadBytes(keyLen, capacity) > maxOverheadBytes) {
+    capacity /= 2;
+  }
+  return _create(keyLen, capacity);
+}
+
+int
+SimPosTable_contains(SimPosTable *table, const int *key)
+{
+  if (table->keyLen == 2) {
+    return table->slots[ _probePacked(table, _pack(key)) ] != SPT_EMPTY;
+  } else {
+    return table->wideSlots[ _probeWide(table, key, _hashWide(key, table->keyLen)) ].key != NULL;
+  }
+}
+
+int
+SimPosTable_insert(SimPosTable *table, const int *key)
+{
+  int ix;
+
+  if (SPT_SHOULD_GROW(table->count + 1, table->capacity)) {
+    _grow(table);
+  }
+
+  if (table->keyLen == 2) {
+    uint64_t packed = _pack(key);
+    ix = _probePacked(table, packed);
+    if (table->slots[ix] != SPT_EMPTY) {
+      return 1;
+    }
+    table->slots[ix] = packed;
+  } else {
+    uint64_t hash = _hashWide(key, table->keyLen);
+    ix = _probeWide(table, key, hash);
+    if (table->wideSlots[ix].key != NULL) {
+      return 1;
+    }
+    table->wideSlots[ix].hash = hash;
+    table->wideSlots[ix].key = Arena_alloc(table->arena, table->keyLen * sizeof(int));
+    memcpy(table->wideSlots[ix].key, key, table->keyLen * sizeof(int));
+  }
+
+  table->used[table->count++] = ix;
+  return 0;
+}
+
+void
+SimPosTable_filter(SimPosTable *table, int (*keep)(const int *key, void *arg), void *arg)
+{
+  SimPosTable *kept = _create(table->keyLen, table->initialCapacity);
+  int i, key[2];
+
+  if (table->keyLen == 2) {
+    for (i = 0; i < table->capacity; i++) {
+      if (table->slots[i] == SPT_EMPTY) {
+        continue;
+      }
+      key[0] = (int) (table->slots[i] >> 32);
+      key[1] = (int) (uint32_t) table->slots[i];
+      if (keep(key, arg)) {
+        SimPosTable_insert(kept, key);
+      }
+    }
+  } else {
+    for (i = 0; i < table->capacity; i++) {
+      if (table->wideSlots[i].key != NULL && keep(table->wideSlots[i].key, arg)) {
+        SimPosTable_insert(kept, table->wideSlots[i].key);
+      }
+    }
+  }
+
+  logMsg(LOG_DEBUG, "SimPosTable_filter: table %p kept %d of %d keys", table, kept->count, table->count);
+
+  /* Swap the rebuilt innards into table, then discard the old ones */
+  free(table->used);
+  free(table->slots);
+  free(table->wideSlots);
+  if (table->arena != NULL) {
+    Arena_destroy(table->arena);
+  }
+  *table = *kept;
+  free(kept);
+}
+
+void
+SimPosTable_clear(SimPosTable *table)
+{
+  int i;
+
+  logMsg(LOG_DEBUG, "SimPosTable_clear: table %p dropping %d keys, keeping %d slots", table, table->count, table->capacity);
+  if (table->keyLen == 2) {
+    for (i = 0; i < table->count; i++) {
+      table->slots[ table->used[i] ] = SPT_EMPTY;
+    }
+  } else {
+    for (i = 0; i < table->count; i++) {
+      table->wideSlots[ table->used[i] ].key = NULL;
+    }
+    Arena_reset(table->arena);
+  }
+  table->count = 0;
+}
+
+int
+SimPosTable_count(SimPosTable *table)
+{
+  return table->count;
+}
+
+long
+SimPosTable_overheadBytes(SimPosTable *table)
+{
+  return _overheadBytes(table->keyLen, table->capacity);
+}
+
+int
+SimPosTable_bytesPerEntry(SimPosTable *table)
+{
+  if (table->keyLen == 2) {
+    return 0;
+  }
+  return ARENA_ROUND_UP(table->keyLen * sizeof(int));
+}
+
+void
+SimPosTable_destroy(SimPosTable *table)
+{
+  free(table->used);
+  free(table->slots);
+  free(table->wideSlots);
+  if (table->arena != NULL) {
+    Arena_destroy(table->arena);
+  }
+  free(table);
+}
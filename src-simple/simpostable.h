@@ -0,0 +1,60 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef SIMPOSTABLE_H
+#define SIMPOSTABLE_H
+
+/* Set of simulation positions (ENCODING_NEGATIVE).
+ *
+ * A key is a vector of keyLen non-negative ints: < q, i [, CG vector ] >.
+ * Open addressing with linear probing.
+ *   - keyLen == 2: Keys are packed into the 64-bit slots themselves.
+ *   - keyLen > 2 (backreferences): Slots hold a hash and a pointer to the key,
+ *     which is copied into an arena.
+ * Everything is released at once by SimPosTable_destroy, or in bulk by SimPosTable_filter or SimPosTable_clear. */
+
+typedef struct SimPosTable SimPosTable;
+
+/* Starts empty */
+SimPosTable *
+SimPosTable_create(int keyLen);
+
+/* Starts empty, and smaller if need be so that SimPosTable_overheadBytes fits in maxOverheadBytes.
+ * There is a floor of 16 slots. */
+SimPosTable *
+SimPosTable_createWithin(int keyLen, long maxOverheadBytes);
+
+/* Returns 1 if key is present, else 0 */
+int
+SimPosTable_contains(SimPosTable *table, const int *key);
+
+/* Add key. Returns 1 if key was already present, else 0. One probe sequence either way. */
+int
+SimPosTable_insert(SimPosTable *table, const int *key);
+
+/* Keep only the keys for which keep(key, arg) is non-zero.
+ * Rebuilds the table at its initial capacity, so wide keys move to a fresh arena and the old one is released. */
+void
+SimPosTable_filter(SimPosTable *table, int (*keep)(const int *key, void *arg), void *arg);
+
+/* Remove every key, but keep the slots for the next use. Costs O(keys), not O(slots). */
+void
+SimPosTable_clear(SimPosTable *table);
+
+/* Number of keys */
+int
+SimPosTable_count(SimPosTable *table);
+
+/* Bytes for the table itself (slots + the used log + bookkeeping), excluding key storage */
+long
+SimPosTable_overheadBytes(SimPosTable *table);
+
+/* Bytes of arena storage per entry (0 if keys live in the slots) */
+int
+SimPosTable_bytesPerEntry(SimPosTable *table);
+
+void
+SimPosTable_destroy(SimPosTable *table);
+
+#endif /* SIMPOSTABLE_H */
@@ -1,8 +1,8 @@
 #include "statistics.h"
 #include "log.h"
-#include "uthash.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
 #include <math.h>
 
@@ -29,7 +29,37 @@ vec_strcat(char **dest, int *dAlloc, char *src)
   return;
 }
 
+/* Budgeted tables: a state that was narrowed away reports what it cost until then */
+static int
+_isDropped(Memo *memo, int statenum)
+{
+  return memo->budgetDropped != NULL && memo->budgetDropped[statenum];
+}
+
 /* Prints human-readable to stdout, and JSON to stderr */
+/* Sliding-window NONE and BITMAP tables: each state paid for the blocks it had live at its peak,
+ * plus its block table */
+static void
+_appendWindowedCosts(Memo *memo, char **asymptotes, int *asymptotesLen, char **bytes, int *bytesLen)
+{
+  char numBufForSprintf[128];
+  int i;
+
+  logMsg(LOG_INFO, "STATS: Windowed table, blocks of %d offsets", memo->windowBlockSize);
+  for (i = 0; i < memo->nStates; i++) {
+    sprintf(numBufForSprintf, "%d", memo->windowPeakBlocks[i] * memo->windowBlockSize);
+    vec_strcat(asymptotes, asymptotesLen, numBufForSprintf);
+
+    sprintf(numBufForSprintf, "%zu", memo->windowPeakBlocks[i] * memo->windowBlockBytes + memo->nWindowBlocks * sizeof(void *));
+    vec_strcat(bytes, bytesLen, numBufForSprintf);
+
+    if (i + 1 != memo->nStates) {
+      vec_strcat(asymptotes, asymptotesLen, ",");
+      vec_strcat(bytes, bytesLen, ",");
+    }
+  }
+}
+
 void
 printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, Sub *sub)
 {
@@ -46,8 +76,8 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
   /* Sum over all offsets */
   int maxVisitsPerVertex = -1;
   int mostVisitedVertex = -1;
-  int *visitsPerVertex = NULL; /* Per-vertex sum of visits over all offsets */
-  int nTotalVisits = 0;
+  int *visitsPerVertex = visitTable->visitsPerVertex; /* Per-vertex sum of visits over all offsets */
+  long nTotalVisits = visitTable->nTotalVisits;
 
   char *prefix = "STATS";
 
@@ -63,6 +93,11 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
   char *csv_maxObservedMemoryBytesPerMemoizedVertex = mal(csv_memoryBytesLen * sizeof(char));
   vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, "");
 
+  /* Encoding-specific fields for "results", each preceded by ", " */
+  int encodingResultsLen = 2;
+  char *encodingResults = mal(encodingResultsLen * sizeof(char));
+  vec_strcat(&encodingResults, &encodingResultsLen, "");
+
   switch (memo->mode) {
   case MEMO_NONE:
     strcpy(memoConfig_vertexSelection, "\"NONE\"");
@@ -92,6 +127,12 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
   case ENCODING_RLE_TUNED:
     strcpy(memoConfig_encoding, "\"RLE_TUNED\"");
     break;
+  case ENCODING_BITMAP:
+    strcpy(memoConfig_encoding, "\"BITMAP\"");
+    break;
+  case ENCODING_ADAPTIVE:
+    strcpy(memoConfig_encoding, "\"ADAPTIVE\"");
+    break;
   default:
     logMsg(LOG_ERROR, "Encoding %d", memo->encoding);
     assert(!"Unknown encoding\n");
@@ -104,37 +145,41 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
     visitTable->nChars);
 
   /* Most-visited vertex */
-  visitsPerVertex = mal(sizeof(int) * visitTable->nStates);
   for (i = 0; i < visitTable->nStates; i++) {
-    visitsPerVertex[i] = 0;
-    for (j = 0; j < visitTable->nChars; j++) {
-      /* Running sums */
-      visitsPerVertex[i] += visitTable->visitVectors[i][j];
-      nTotalVisits += visitTable->visitVectors[i][j];
-
-      /* Largest individual visits over all search states? */
-      if (visitTable->visitVectors[i][j] > maxVisitsPerSimPos) {
-        maxVisitsPerSimPos = visitTable->visitVectors[i][j];
-        vertexWithMostVisitedSimPos = i;
-        mostVisitedOffset = j;
-      }
-    }
-
-    /* Largest overall visits per vertex? */
-    if (visitsPerVertex[i]  > maxVisitsPerVertex) {
+    if (visitsPerVertex[i] > maxVisitsPerVertex) {
       maxVisitsPerVertex = visitsPerVertex[i];
       mostVisitedVertex = i;
     }
   }
 
-  logMsg(LOG_INFO, "%s: Most-visited search state: <%d, %d> (%d visits)", prefix, vertexWithMostVisitedSimPos, mostVisitedOffset, maxVisitsPerSimPos);
+  /* Most-visited search state -- only the full table knows */
+  if (visitTable->full) {
+    for (i = 0; i < visitTable->nStates; i++) {
+      for (j = 0; j < visitTable->nChars; j++) {
+        int nVisits = VisitTable_get(visitTable, i, j);
+        if (nVisits > maxVisitsPerSimPos) {
+          maxVisitsPerSimPos = nVisits;
+          vertexWithMostVisitedSimPos = i;
+          mostVisitedOffset = j;
+        }
+      }
+    }
+    logMsg(LOG_INFO, "%s: Most-visited search state: <%d, %d> (%d visits)", prefix, vertexWithMostVisitedSimPos, mostVisitedOffset, maxVisitsPerSimPos);
+  }
   logMsg(LOG_INFO, "%s: Most-visited vertex: %d (%d visits over all its search states)", prefix, mostVisitedVertex, maxVisitsPerVertex);
+
   /* Info about simulation */
-  fprintf(stderr, ", \"simulationInfo\": { \"nTotalVisits\": %d, \"nPossibleTotalVisitsWithMemoization\": %d, \"visitsToMostVisitedSimPos\": %d, \"visitsToMostVisitedVertex\": %d, \"simTimeUS\": %llu }",
-    nTotalVisits, visitTable->nStates * visitTable->nChars, maxVisitsPerSimPos, maxVisitsPerVertex, elapsed_US);
+  fprintf(stderr, ", \"simulationInfo\": { \"nTotalVisits\": %ld, \"nPossibleTotalVisitsWithMemoization\": %d, \"visitsToMostVisitedVertex\": %d, \"simTimeUS\": %llu",
+    nTotalVisits, visitTable->nStates * visitTable->nChars, maxVisitsPerVertex, (unsigned long long) elapsed_US);
+  if (visitTable->full) {
+    fprintf(stderr, ", \"visitsToMostVisitedSimPos\": %d", maxVisitsPerSimPos);
+  }
+  fprintf(stderr, " }");
 
-  if (memo->mode == MEMO_FULL || memo->mode == MEMO_IN_DEGREE_GT1) {
-    if (maxVisitsPerSimPos > 1 && !usesBackreferences(prog)) {
+  /* Narrowing under a budget gives up the guarantee, and so do atomic groups: we do not memoize inside them.
+   * In a counted loop, <q, i> is many search states, one per count. Without the full table there is nothing to check. */
+  if ((memo->mode == MEMO_FULL || memo->mode == MEMO_IN_DEGREE_GT1) && (memo->budgetDropped == NULL || memo->nBudgetNarrowings == 0)) {
+    if (maxVisitsPerSimPos > 1 && !usesBackreferences(prog) && !usesAtomicGroups(prog) && !usesCountedLoops(prog)) {
       /* I have proved this is impossible. */
       assert(!"Error, too many visits per search state\n");
     }
@@ -142,21 +187,63 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
 
   switch (memo->encoding) {
   case ENCODING_NONE:
+    if (memo->windowed) {
+      _appendWindowedCosts(memo, &csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen,
+        &csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen);
+      break;
+    }
     /* All memoized states cost |w| */
     logMsg(LOG_INFO, "%s: No encoding, so all memoized vertices paid the full cost of |w| = %d slots", prefix, memo->nChars);
     for (i = 0; i < memo->nStates; i++) {
 
       // Asymptotically, cost of 1 (bit or byte) * |w|
-      sprintf(numBufForSprintf, "%d", memo->nChars);
+      sprintf(numBufForSprintf, "%d", _isDropped(memo, i) ? memo->budgetDroppedAsymptoticCost[i] : memo->nChars);
       vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
       if (i + 1 != memo->nStates) {
         vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
       }
 
-      // In our actual implementation, we use one byte for each record.
+      // In our actual implementation, we use one int for each record.
       // We actually need only one bit, not one byte.
       // So we divide by 8 to indicate an optimal bit-based implementation.
-      sprintf(numBufForSprintf, "%d", (memo->nChars + 7) / 8);
+      sprintf(numBufForSprintf, "%d", ((_isDropped(memo, i) ? memo->budgetDroppedAsymptoticCost[i] : memo->nChars) + 7) / 8);
+      vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
+      }
+    }
+
+    /* What the ints really cost, to compare with ENCODING_BITMAP */
+    vec_strcat(&encodingResults, &encodingResultsLen, ", \"intMemoryBytesPerMemoizedVertex\": [");
+    for (i = 0; i < memo->nStates; i++) {
+      sprintf(numBufForSprintf, "%zu", _isDropped(memo, i) ? (size_t) memo->budgetDroppedBytes[i] : memo->nChars * sizeof(int));
+      vec_strcat(&encodingResults, &encodingResultsLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&encodingResults, &encodingResultsLen, ",");
+      }
+    }
+    vec_strcat(&encodingResults, &encodingResultsLen, "]");
+
+    break;
+  case ENCODING_BITMAP:
+    if (memo->windowed) {
+      _appendWindowedCosts(memo, &csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen,
+        &csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen);
+      break;
+    }
+    /* All memoized states cost |w| bits, rounded up to whole words */
+    logMsg(LOG_INFO, "%s: Bitmap encoding, so all memoized vertices paid |w| = %d bits (%d words)", prefix, memo->nChars, memo->nWordsPerVector);
+    for (i = 0; i < memo->nStates; i++) {
+
+      // Asymptotically, cost of 1 bit * |w|
+      sprintf(numBufForSprintf, "%d", _isDropped(memo, i) ? memo->budgetDroppedAsymptoticCost[i] : memo->nChars);
+      vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
+      }
+
+      // In the implementation, count the words backing this vertex's bit vector
+      sprintf(numBufForSprintf, "%zu", _isDropped(memo, i) ? (size_t) memo->budgetDroppedBytes[i] : memo->nWordsPerVector * sizeof(uint64_t));
       vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
       if (i + 1 != memo->nStates) {
         vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
@@ -167,37 +254,39 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
   case ENCODING_NEGATIVE:
   {
     logMsg(LOG_INFO, "%s: %d slots used (out of %d possible)",
-      prefix, HASH_COUNT(memo->simPosTable), memo->nStates * memo->nChars);
+      prefix, SimPosTable_count(memo->simPosTable), memo->nStates * memo->nChars);
 
     /* Memoized state costs vary by number of visits to each node. */
-    int UT_overheadPerVertex = UT_TABLE_OVERHEAD(hh, memo->simPosTable) / memo->nStates;
-    logMsg(LOG_INFO, "%s: distributing the table overhead of %d over the %d memo states",
-      prefix, UT_TABLE_OVERHEAD(hh, memo->simPosTable), memo->nStates);
+    long tableOverhead = SimPosTable_overheadBytes(memo->simPosTable);
+    long overheadPerVertex = memo->nStates > 0 ? tableOverhead / memo->nStates : 0;
+    int bytesPerEntry = SimPosTable_bytesPerEntry(memo->simPosTable);
+    logMsg(LOG_INFO, "%s: distributing the table overhead of %ld over the %d memo states",
+      prefix, tableOverhead, memo->nStates);
 
     count = 0;
-    for (i = 0; i < prog->len; i++) {
-      if (prog->start[i].memoInfo.shouldMemo) {
+    for (i = 0; i < prog->len - prog->nMemoChecks; i++) {
+      if (prog->info[i].memoInfo.shouldMemo) {
         count += visitsPerVertex[i];
 
         // Asymptotically, 1 per entry
         sprintf(numBufForSprintf, "%d", visitsPerVertex[i]);
         vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
-        if (prog->start[i].memoInfo.memoStateNum + 1 != memo->nStates) {
+        if (prog->info[i].memoInfo.memoStateNum + 1 != memo->nStates) {
           vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
         }
 
         // In implementation, count the cost of each sim table entry associated with this vertex
-        sprintf(numBufForSprintf, "%ld", UT_overheadPerVertex + (visitsPerVertex[i] * sizeof(SimPosTable)) );
+        sprintf(numBufForSprintf, "%ld", overheadPerVertex + ((long) visitsPerVertex[i] * bytesPerEntry) );
         vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
-        if (prog->start[i].memoInfo.memoStateNum + 1 != memo->nStates) {
+        if (prog->info[i].memoInfo.memoStateNum + 1 != memo->nStates) {
           vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
         }
       }
     }
 
-    if (!memo->backrefs) {
-      /* Sanity check: HASH_COUNT does correspond to the number of marked search states
-      * This count will be inaccurate if backrefs are enabled, because we don't know all of the subs that we encountered.
+    if (!memo->backrefs && memo->nCounters == 0 && (memo->budgetDropped == NULL || memo->nBudgetEvictions + memo->nBudgetNarrowings == 0)) {
+      /* Sanity check: SimPosTable_count does correspond to the number of marked search states
+      * This count will be inaccurate if backrefs or counters are enabled, because we don't know all of the subs that we encountered.
       * TODO We could enumerate them another way. */
       n = 0;
       for (i = 0; i < memo->nStates; i++) {
@@ -207,8 +296,8 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
           }
         }
       }
-      logMsg(LOG_DEBUG, "HASH_COUNT %d n %d count %d", HASH_COUNT(memo->simPosTable), n, count);
-      assert(n == HASH_COUNT(memo->simPosTable));
+      logMsg(LOG_DEBUG, "SimPosTable_count %d n %d count %d", SimPosTable_count(memo->simPosTable), n, count);
+      assert(n == SimPosTable_count(memo->simPosTable));
       assert(n == count);
     }
 
@@ -216,8 +305,25 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
   }
   case ENCODING_RLE:
   case ENCODING_RLE_TUNED:
+  {
+    long nFingerLookups = 0, nFingerHits = 0;
+
     logMsg(LOG_INFO, "%s: |w| = %d", prefix, memo->nChars);
     for (i = 0; i < memo->nStates; i++) {
+      if (_isDropped(memo, i)) {
+        sprintf(numBufForSprintf, "%d", memo->budgetDroppedAsymptoticCost[i]);
+        vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
+        sprintf(numBufForSprintf, "%d", memo->budgetDroppedBytes[i]);
+        vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
+        if (i + 1 != memo->nStates) {
+          vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
+          vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
+        }
+        continue;
+      }
+      nFingerLookups += RLEVector_nFingerLookups(memo->rleVectors[i]);
+      nFingerHits += RLEVector_nFingerHits(memo->rleVectors[i]);
+
       logMsg(LOG_INFO, "%s: memo vector %d (RL %d) has %d runs (max observed during execution: %d, max possible: %d)",
         prefix, i, RLEVector_runSize(memo->rleVectors[i]),
         RLEVector_currSize(memo->rleVectors[i]),
@@ -240,23 +346,88 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
       }
 
     }
+
+    logMsg(LOG_INFO, "%s: RLE finger resolved %ld of %ld lookups", prefix, nFingerHits, nFingerLookups);
+    sprintf(numBufForSprintf, ", \"rleFingerLookups\": %ld, \"rleFingerHits\": %ld", nFingerLookups, nFingerHits);
+    vec_strcat(&encodingResults, &encodingResultsLen, numBufForSprintf);
+    break;
+  }
+  case ENCODING_ADAPTIVE:
+    /* Each state reports the cost of whichever representation it ended up with */
+    logMsg(LOG_INFO, "%s: %d of %d memoized vertices were promoted to a bitmap", prefix, memo->nAdaptivePromotions, memo->nStates);
+    vec_strcat(&encodingResults, &encodingResultsLen, ", \"memoRepresentationPerMemoizedVertex\": [");
+    for (i = 0; i < memo->nStates; i++) {
+      int asymptoticCost, memoryBytes;
+      if (_isDropped(memo, i)) {
+        asymptoticCost = memo->budgetDroppedAsymptoticCost[i];
+        memoryBytes = memo->budgetDroppedBytes[i];
+        vec_strcat(&encodingResults, &encodingResultsLen, "\"DROPPED\"");
+      } else if (memo->bitVectors[i] != NULL) {
+        /* |w| bits, plus whatever the RLE vector cost before promotion */
+        asymptoticCost = memo->nChars;
+        memoryBytes = memo->nWordsPerVector * sizeof(uint64_t);
+        if (memo->adaptiveSparseBytes[i] > memoryBytes) {
+          memoryBytes = memo->adaptiveSparseBytes[i];
+        }
+        vec_strcat(&encodingResults, &encodingResultsLen, "\"BITMAP\"");
+      } else {
+        asymptoticCost = RLEVector_maxObservedSize(memo->rleVectors[i]);
+        memoryBytes = RLEVector_maxBytes(memo->rleVectors[i]);
+        vec_strcat(&encodingResults, &encodingResultsLen, "\"RLE\"");
+      }
+
+      sprintf(numBufForSprintf, "%d", asymptoticCost);
+      vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
+      sprintf(numBufForSprintf, "%d", memoryBytes);
+      vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
+        vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
+        vec_strcat(&encodingResults, &encodingResultsLen, ",");
+      }
+    }
+    vec_strcat(&encodingResults, &encodingResultsLen, "]");
     break;
     default:
       assert(!"Unexpected encoding\n");
   }
 
-  fprintf(stderr, ", \"memoizationInfo\": { \"config\": { \"vertexSelection\": %s, \"encoding\": %s }, \"results\": { \"nSelectedVertices\": %d, \"lenW\": %d, \"maxObservedAsymptoticCostsPerMemoizedVertex\": [%s], \"maxObservedMemoryBytesPerMemoizedVertex\": [%s]}}",
+  if (memo->windowed) {
+    sprintf(numBufForSprintf, ", \"windowBlockSize\": %d", memo->windowBlockSize);
+    vec_strcat(&encodingResults, &encodingResultsLen, numBufForSprintf);
+  }
+
+  if (memo->budgetDropped != NULL) {
+    char budgetBuf[256];
+    int nDropped = 0;
+    for (i = 0; i < memo->nStates; i++) {
+      nDropped += memo->budgetDropped[i];
+    }
+    logMsg(LOG_INFO, "%s: memo budget %ld bytes, peak %ld bytes, %d evictions, %d narrowings (%d of %d vertices dropped)%s",
+      prefix, memo->budgetBytes, memo->budgetPeakBytes, memo->nBudgetEvictions, memo->nBudgetNarrowings, nDropped, memo->nStates,
+      memo->budgetExhausted ? ", exhausted" : "");
+    /* narrowestSelection: the selection in force at the end, named as in config */
+    sprintf(budgetBuf, ", \"memoBudget\": { \"budgetBytes\": %ld, \"peakBytes\": %ld, \"nEvictions\": %d, \"nNarrowings\": %d, \"nDroppedVertices\": %d, \"narrowestSelection\": %s, \"degraded\": %s, \"exhausted\": %s }",
+      memo->budgetBytes, memo->budgetPeakBytes, memo->nBudgetEvictions, memo->nBudgetNarrowings, nDropped,
+      memo->budgetMode == MEMO_FULL ? "\"ALL\"" : memo->budgetMode == MEMO_IN_DEGREE_GT1 ? "\"INDEG>1\"" : memo->budgetMode == MEMO_LOOP_DEST ? "\"LOOP\"" : "\"NONE\"",
+      memo->nBudgetNarrowings > 0 ? "true" : "false",
+      memo->budgetExhausted ? "true" : "false");
+    vec_strcat(&encodingResults, &encodingResultsLen, budgetBuf);
+  }
+
+  fprintf(stderr, ", \"memoizationInfo\": { \"config\": { \"vertexSelection\": %s, \"encoding\": %s }, \"results\": { \"nSelectedVertices\": %d, \"lenW\": %d, \"maxObservedAsymptoticCostsPerMemoizedVertex\": [%s], \"maxObservedMemoryBytesPerMemoizedVertex\": [%s]%s}}",
     memoConfig_vertexSelection, memoConfig_encoding,
     memo->nStates, memo->nChars,
     csv_maxObservedAsymptoticCostsPerMemoizedVertex,
-    csv_maxObservedMemoryBytesPerMemoizedVertex
+    csv_maxObservedMemoryBytesPerMemoizedVertex,
+    encodingResults
   );
 
   fprintf(stderr, "}\n");
 
   free(csv_maxObservedAsymptoticCostsPerMemoizedVertex);
   free(csv_maxObservedMemoryBytesPerMemoizedVertex);
-  free(visitsPerVertex);
+  free(encodingResults);
 }
 
 uint64_t
@@ -4,16 +4,17 @@
 
 #include "regexp.h"
 
-Sub *freesub;
+/* Matchers without a pool of their own share this one */
+static SubPool defaultSubPool;
 
 Sub*
-newsub(int n, char *start)
+SubPool_newsub(SubPool *pool, int n, char *start)
 {
 	Sub *s;
 	
-	s = freesub;
+	s = pool->free;
 	if(s != nil)
-		freesub = (Sub*)s->sub[0];
+		pool->free = (Sub*)s->sub[0];
 	else
 		s = mal(sizeof *s);
 	s->nsub = n;
@@ -22,40 +23,86 @@ newsub(int n, char *start)
 	return s;
 }
 
-Sub*
-incref(Sub *s)
-{
-	s->ref++;
-	return s;
-}
-
-Sub*
-update(Sub *s, int i, char *p)
+/* s, or a copy of it if another thread shares it: one we may write */
+static Sub*
+_own(SubPool *pool, Sub *s)
 {
 	Sub *s1;
 	int j;
 
 	if(s->ref > 1) {
 		/* Fork */
-		s1 = newsub(s->nsub, s->start);
+		s1 = SubPool_newsub(pool, s->nsub, s->start);
 		for(j=0; j<s->nsub; j++)
 			s1->sub[j] = s->sub[j];
+		memcpy(s1->counter, s->counter, sizeof s->counter);
 		s->ref--;
 		s = s1;
 	}
+	return s;
+}
+
+Sub*
+SubPool_update(SubPool *pool, Sub *s, int i, char *p)
+{
+	s = _own(pool, s);
 	s->sub[i] = p;
 	return s;
 }
 
+Sub*
+SubPool_setCounter(SubPool *pool, Sub *s, int k, int value)
+{
+	s = _own(pool, s);
+	s->counter[k] = value;
+	return s;
+}
+
 void
-decref(Sub *s)
+SubPool_decref(SubPool *pool, Sub *s)
 {
 	if(--s->ref == 0) {
-		s->sub[0] = (char*)freesub;
-		freesub = s;
+		s->sub[0] = (char*)pool->free;
+		pool->free = s;
+	}
+}
+
+void
+SubPool_free(SubPool *pool)
+{
+	Sub *s;
+
+	while((s = pool->free) != nil) {
+		pool->free = (Sub*)s->sub[0];
+		free(s);
 	}
 }
 
+Sub*
+newsub(int n, char *start)
+{
+	return SubPool_newsub(&defaultSubPool, n, start);
+}
+
+Sub*
+incref(Sub *s)
+{
+	s->ref++;
+	return s;
+}
+
+Sub*
+update(Sub *s, int i, char *p)
+{
+	return SubPool_update(&defaultSubPool, s, i, p);
+}
+
+void
+decref(Sub *s)
+{
+	SubPool_decref(&defaultSubPool, s);
+}
+
 int
 isgroupset(Sub *s, int g)
 {
@@ -31,25 +31,25 @@ threadlist(int n)
 }
 
 static void
-addthread(ThreadList *l, Thread t)
+addthread(Prog *prog, ThreadList *l, Thread t)
 {
-	if(t.pc->gen == gen)
+	if(INST_INFO(prog, t.pc)->gen == gen)
 		return;	// already on list
 
-	t.pc->gen = gen;
+	INST_INFO(prog, t.pc)->gen = gen;
 	l->t[l->n] = t;
 	l->n++;
 	
 	switch(t.pc->opcode) {
 	case Jmp:
-		addthread(l, thread(t.pc->x));
+		addthread(prog, l, thread(t.pc->x));
 		break;
 	case Split:
-		addthread(l, thread(t.pc->x));
-		addthread(l, thread(t.pc->y));
+		addthread(prog, l, thread(t.pc->x));
+		addthread(prog, l, thread(t.pc->y));
 		break;
 	case Save:
-		addthread(l, thread(t.pc+1));
+		addthread(prog, l, thread(t.pc+1));
 		break;
 	}
 }
@@ -72,7 +72,7 @@ thompsonvm(Prog *prog, char *input, char **subp, int nsubp)
 	if(nsubp >= 1)
 		subp[0] = input;
 	gen++;
-	addthread(clist, thread(prog->start));
+	addthread(prog, clist, thread(prog->start));
 	matched = 0;
 	for(sp=input;; sp++) {
 		if(clist->n == 0)
@@ -89,7 +89,7 @@ thompsonvm(Prog *prog, char *input, char **subp, int nsubp)
 			case Any:
 				if(*sp == 0)
 					break;
-				addthread(nlist, thread(pc+1));
+				addthread(prog, nlist, thread(pc+1));
 				break;
 			case Match:
 				if(nsubp >= 2)